@@ -0,0 +1,223 @@
+#!/bin/bash
+# compares the copiers on the same file, build them first with: make all
+# usage: ./benchmark.sh <infile> <optional #runs> <optional #threads> <optional extra args for the B runs>
+# each case's TOTAL ACTUAL TIME is averaged over the runs and everything lands in bench_output.txt
+# with extra args every case that takes them is run again with them added, e.g. for placement:
+# ./benchmark.sh big.bin 5 4 "--cpus near"
+# ./benchmark.sh --calibrate <optional #runs> <optional #threads> times bmtcopier inline, on one thread and on
+# every thread over a range of file sizes and suggests its --inline-below and --bytes-per-thread
+# ./benchmark.sh --alignment <optional #runs> <optional #threads> copies odd sized files with bmtcopier's ranges
+# split at any byte (--unaligned) and on block boundaries, and shows the time and the threads' context switches
+# ./benchmark.sh --wait <optional #runs> <optional #threads> runs mtcopier and mtcopier2 with each --wait strategy
+# on a small in flight budget, so the queue waits are hot, and shows the wakeups per chunk and context switches
+
+# time a whole bmtcopier run in microseconds, small copies are over in well under a ms
+time_copy() {
+    local start
+    start=$(date +%s%N)
+    "$@" > /dev/null
+    echo $((($(date +%s%N) - start) / 1000))
+}
+
+# average microseconds for a bmtcopier copy of the calibration file on some threads with some flags
+time_engine() {
+    local threads=$1 total=0 r
+    shift
+    for ((r = 0; r < RUNS; ++r)); do
+        rm -f "$OUTFILE"
+        total=$((total + $(time_copy ./bmtcopier $threads "$CALFILE" "$OUTFILE" "$@")))
+        if ! cmp -s "$CALFILE" "$OUTFILE"; then
+            echo "BAD COPY" >&2
+        fi
+    done
+    echo $((total / RUNS))
+}
+
+calibrate() {
+    local size inline one all inline_below="" per_thread=""
+    echo "calibrating bmtcopier, $RUNS runs, $THREADS threads (microseconds per copy)"
+    for size in 4096 16384 65536 262144 1048576 4194304 16777216 67108864; do
+        head -c $size /dev/urandom > "$CALFILE"
+        inline=$(time_engine $THREADS --inline-below 1G)
+        one=$(time_engine 1 --inline-below 0)
+        all=$(time_engine $THREADS --inline-below 0 --bytes-per-thread 1)
+        echo "$size bytes: inline $inline, 1 thread $one, $THREADS threads $all"
+        # each line goes where the other engine starts winning and keeps winning for every bigger size
+        if [ "$one" -lt "$inline" ]; then
+            inline_below=${inline_below:-$size}
+        else
+            inline_below=""
+        fi
+        if [ "$all" -lt "$one" ]; then
+            per_thread=${per_thread:-$((size / THREADS))}
+        else
+            per_thread=""
+        fi
+    done
+    # an engine that never lost to the next one up is worth it past the biggest size tried
+    echo "suggested: --inline-below ${inline_below:-128M} --bytes-per-thread ${per_thread:-$((128 / THREADS))M}"
+    rm -f "$CALFILE"
+}
+
+# average of a -t stat over bmtcopier copies of the alignment file
+alignment_stat() {
+    local stat=$1 total=0 r
+    shift
+    for ((r = 0; r < RUNS; ++r)); do
+        rm -f "$OUTFILE"
+        sync
+        total=$((total + $(./bmtcopier $THREADS "$CALFILE" "$OUTFILE" -t --bytes-per-thread 1 "$@" | grep "^$stat" | grep -o "[0-9][0-9]*" | head -1)))
+        if ! cmp -s "$CALFILE" "$OUTFILE"; then
+            echo "BAD COPY" >&2
+        fi
+    done
+    echo $((total / RUNS))
+}
+
+alignment() {
+    local size args label
+    echo "bmtcopier range alignment, $RUNS runs, $THREADS threads"
+    # sizes that don't split into whole pages, so unaligned neighbours share one
+    for size in 1000003 16777259 100000007; do
+        head -c $size /dev/urandom > "$CALFILE"
+        for args in "--unaligned" ""; do
+            label=${args:-aligned}
+            echo "$size bytes ${label#--}: $(alignment_stat "TOTAL ACTUAL TIME" $args) ms," \
+                "$(alignment_stat "THREAD VOLUNTARY CONTEXT SWITCHES" $args) voluntary and" \
+                "$(alignment_stat "THREAD INVOLUNTARY CONTEXT SWITCHES" $args) involuntary context switches"
+        done
+    done
+    rm -f "$CALFILE"
+}
+
+# average of a -t stat over copies of the wait file, which can be a fraction
+wait_stat() {
+    local stat=$1 copier=$2 r
+    shift 2
+    for ((r = 0; r < RUNS; ++r)); do
+        rm -f "$OUTFILE"
+        ./$copier $THREADS "$CALFILE" "$OUTFILE" -t --max-inflight 256K --read-batch 1 "$@" | grep "^$stat" | grep -o "[0-9][0-9.]*" | head -1
+        if ! cmp -s "$CALFILE" "$OUTFILE"; then
+            echo "BAD COPY" >&2
+        fi
+    done | awk '{ total += $1 } END { printf "%.2f", total / NR }'
+}
+
+wait_strategies() {
+    local copier strategy
+    echo "queue wait strategies, $RUNS runs, $THREADS threads, $(nproc) cpus"
+    head -c 100000000 /dev/urandom > "$CALFILE"
+    for copier in mtcopier mtcopier2; do
+        for strategy in broadcast park spin adaptive; do
+            echo "$copier $strategy: $(wait_stat "TOTAL ACTUAL TIME" $copier --wait $strategy) ms," \
+                "$(wait_stat "WAKEUPS PER CHUNK" $copier --wait $strategy) wakeups per chunk," \
+                "$(wait_stat "READER INVOLUNTARY CONTEXT SWITCHES" $copier --wait $strategy) reader and" \
+                "$(wait_stat "WRITER INVOLUNTARY CONTEXT SWITCHES" $copier --wait $strategy) writer involuntary context switches"
+        done
+    done
+    rm -f "$CALFILE"
+}
+
+if [ "$1" == "--wait" ]; then
+    RUNS=${2:-5}
+    THREADS=${3:-8}
+    OUTFILE=$(mktemp)
+    CALFILE=$(mktemp)
+    wait_strategies | tee bench_output.txt
+    rm -f "$OUTFILE"
+    exit 0
+fi
+
+if [ "$1" == "--alignment" ]; then
+    RUNS=${2:-5}
+    THREADS=${3:-4}
+    OUTFILE=$(mktemp)
+    CALFILE=$(mktemp)
+    alignment | tee bench_output.txt
+    rm -f "$OUTFILE"
+    exit 0
+fi
+
+if [ "$1" == "--calibrate" ]; then
+    RUNS=${2:-5}
+    THREADS=${3:-4}
+    OUTFILE=$(mktemp)
+    CALFILE=$(mktemp)
+    calibrate | tee bench_output.txt
+    rm -f "$OUTFILE"
+    exit 0
+fi
+
+if [ $# -lt 1 ]; then
+    echo "usage: ./benchmark.sh <infile> <optional #runs> <optional #threads> <optional extra args for the B runs>"
+    exit 1
+fi
+
+INFILE=$1
+RUNS=${2:-5}
+THREADS=${3:-4}
+B_ARGS=$4
+OUTFILE=$(mktemp)
+RESULTS=bench_output.txt
+# port for the mtcopier loopback transfer
+PORT=${LOOPBACK_PORT:-9400}
+
+# label|command, @ is replaced by the infile and outfile
+CASES=(
+    "bmtcopier|./bmtcopier $THREADS @"
+    "bmtcopier --overlap|./bmtcopier $THREADS @ --overlap"
+    "mtcopier2|./mtcopier2 $THREADS @"
+    "ccopier|./ccopier @"
+    "ccopier --pool|./ccopier @ --pool --io-threads $THREADS"
+)
+
+# the cases that take the B args
+AB_CASES="bmtcopier mtcopier2"
+
+# run one case and print its average time in ms
+run_case() {
+    local cmd=$1 total=0 ms
+    for ((r = 0; r < RUNS; ++r)); do
+        rm -f "$OUTFILE"
+        ms=$(${cmd/@/$INFILE $OUTFILE} -t | grep "TOTAL ACTUAL TIME" | grep -o "[0-9]*")
+        if ! cmp -s "$INFILE" "$OUTFILE"; then
+            echo "BAD COPY"
+            return
+        fi
+        total=$((total + ms))
+    done
+    echo $((total / RUNS))
+}
+
+# send the file to an mtcopier receiver over loopback and print the receiver's average time in ms
+run_loopback() {
+    local args=$1 total=0 ms
+    for ((r = 0; r < RUNS; ++r)); do
+        rm -f "$OUTFILE"
+        ./mtcopier 1 tcp:$PORT "$OUTFILE" -t > "$OUTFILE.log" &
+        ./mtcopier $THREADS "$INFILE" tcp:127.0.0.1:$PORT $args > /dev/null
+        wait
+        ms=$(grep "TOTAL ACTUAL TIME" "$OUTFILE.log" | grep -o "[0-9]*")
+        if ! cmp -s "$INFILE" "$OUTFILE"; then
+            echo "BAD COPY"
+            return
+        fi
+        total=$((total + ms))
+    done
+    rm -f "$OUTFILE.log"
+    echo $((total / RUNS))
+}
+
+{
+    echo "file: $INFILE ($(stat -c %s "$INFILE") bytes), $RUNS runs, $THREADS threads"
+    for c in "${CASES[@]}"; do
+        echo "${c%%|*}: $(run_case "${c#*|}") ms"
+        if [ -n "$B_ARGS" ] && [[ " $AB_CASES " == *" ${c%%|*} "* ]]; then
+            echo "${c%%|*} $B_ARGS: $(run_case "${c#*|} $B_ARGS") ms"
+        fi
+    done
+    echo "mtcopier over loopback tcp ($THREADS connections): $(run_loopback) ms"
+    echo "mtcopier over loopback tcp --zerocopy: $(run_loopback --zerocopy) ms"
+} | tee "$RESULTS"
+
+rm -f "$OUTFILE"
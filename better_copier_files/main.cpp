@@ -11,26 +11,52 @@ Uses the <fcntl.h>  header for I/O file operations
 #include <iostream>
 #include <chrono>
 #include <functional>
+#include <pthread.h>
+
+#include "resourceusage.h"
+#include "spscring.h"
+#include "iohints.h"
+#include "durablefile.h"
 
 /*----CONSTANTS----*/
 /* cmd args position for infile */
 #define INFILE_INDX 1
 /* cmd args position for outfile */
 #define OUTFILE_INDX 2
-/* cmd args position for timer flag*/
-#define TIMER_INDEX 3
+/* cmd args position where the optional flags start */
+#define OPTIONS_INDX 3
 /* min number of cmd args */
 #define MIN_NUM_ARGS 3
-/* max number of cmd args*/
-#define MAX_NUM_ARGS 4
 /* file open error*/
 #define FILE_OPEN_ERR -1
 /* num bytes read at a time */
 #define READ_CHUNK 32768
 /* convert nano seconds to ms*/
 #define NS_PER_MS 1000000
+/* convert nano seconds to s*/
+#define NS_PER_SEC 1000000000.0
+/* bytes in a GB */
+#define BYTES_PER_GB 1000000000.0
 /* read write access for files */
 #define READ_WRITE_ACCESS 0644
+/* num bytes read at a time by the pipeline's reader thread */
+#define PIPELINE_CHUNK 1048576
+/* default number of slots in the pipeline's ring */
+#define DEFAULT_PIPELINE_SLOTS 4
+/* value for successful thread create or join*/
+#define THREAD_SUCCESS 0
+
+/*----GLOBAL VARIABLES-----*/
+/* whether to copy with a reader and a writer thread instead of one loop */
+bool pipelined = false;
+/* number of slots in the pipeline's ring */
+long pipelineSlots = DEFAULT_PIPELINE_SLOTS;
+/* whether to give the kernel readahead and write-behind hints */
+bool useHints = false;
+/* what the hints saw */
+hintstats copyHints;
+/* whether to copy into a temp file and only rename it into place once it's on disk */
+bool durable = false;
 
 /* used to time functions */
 std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
@@ -41,6 +67,15 @@ std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
     return duration;
 }
 
+/* function which is used to hopefully get a file's size */
+long getFileSize(const char* fileName) {
+    struct stat st;
+    if (stat(fileName, &st) == 0) {
+        return st.st_size;
+    }
+    return -1;
+}
+
 /* 
 * copy the contents of a file into another 
 * why put it in a queue when you can straight up put it in the output file?
@@ -66,23 +101,164 @@ void copyFile(const char* infileName, const char* outfileName) {
         throw std::runtime_error(fileNotFoundMsg);
     }
 
+    iohints* hints = useHints ? new iohints(infile, outfile, 0, getFileSize(infileName)) : nullptr;
+
     /* read from the infile and write directly to the outfile */
     char buffer[READ_CHUNK];
     
     ssize_t len = 0;
-    while ((len = read(infile, buffer, READ_CHUNK)) != 0)
+    long cursor = 0;
+    while ((len = read(infile, buffer, READ_CHUNK)) > 0)
     {
         std::ignore = write(outfile, buffer, len);
+        cursor += len;
+        if (hints != nullptr) {
+            hints->afterRead(cursor);
+            hints->afterWrite(cursor);
+        }
+    }
+
+    if (hints != nullptr) {
+        hints->finish();
+        copyHints = hints->stats;
+        delete hints;
+    }
+}
+
+/* params for the pipeline's reader thread */
+class pipelineparams
+{
+    public:
+        spscring* ring;
+        const int infile;
+        iohints* hints;
+        /* set by the reader if a read failed, so the copy isn't mistaken for a short file */
+        bool readFailed;
+        pipelineparams(spscring* r, int i, iohints* h) : ring(r), infile(i), hints(h), readFailed(false) {};
+};
+
+/* reader side of the pipeline, fills slots until end of file or the writer closes the ring */
+void* pipelineReader(void* arg) {
+    pipelineparams* params = (pipelineparams*) arg;
+    spscring* ring = params->ring;
+
+    long cursor = 0;
+    for (long h = 0;; ++h) {
+        char* buffer = ring->waitEmpty(h);
+        if (buffer == nullptr) {
+            break;
+        }
+        ssize_t len = read(params->infile, buffer, ring->slotSize);
+        /* an error ends the reading the same way end of file does, the writer throws once it's joined */
+        if (len < 0) {
+            params->readFailed = true;
+            len = 0;
+        }
+        cursor += len;
+        if (params->hints != nullptr) {
+            params->hints->afterRead(cursor);
+        }
+        ring->publish(h, len);
+        if (len == 0) {
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+/*
+* copy the contents of a file into another with reading and writing overlapped
+* a reader thread fills the ring while this thread drains it into the outfile
+*/
+void pipelineCopyFile(const char* infileName, const char* outfileName) {
+    int infile = open(infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        const std::string fileNotFoundMsg = "pipelineCopyFile: cannot find infile";
+        throw std::runtime_error(fileNotFoundMsg);
+    }
+
+    int outfile = open(outfileName, O_WRONLY|O_CREAT|O_TRUNC, READ_WRITE_ACCESS);
+    if (outfile == FILE_OPEN_ERR) {
+        close(infile);
+        const std::string fileNotFoundMsg = "pipelineCopyFile: cannot find outfile";
+        throw std::runtime_error(fileNotFoundMsg);
+    }
+
+    spscring ring(pipelineSlots, PIPELINE_CHUNK);
+    iohints* hints = useHints ? new iohints(infile, outfile, 0, getFileSize(infileName)) : nullptr;
+    pipelineparams params(&ring, infile, hints);
+
+    pthread_t reader;
+    if (pthread_create(&reader, nullptr, &pipelineReader, &params) != THREAD_SUCCESS) {
+        delete hints;
+        close(infile);
+        close(outfile);
+        throw std::runtime_error("pipelineCopyFile: could not create thread");
+    }
+
+    long cursor = 0;
+    bool writeFailed = false;
+    for (long t = 0;; ++t) {
+        long slot = ring.waitFilled(t);
+        ssize_t len = ring.lengths[slot];
+        if (len == 0) {
+            break;
+        }
+        /* keep going on short writes so the slot lands whole */
+        ssize_t done = 0;
+        while (done < len) {
+            ssize_t written = write(outfile, ring.buffers[slot] + done, len - done);
+            if (written <= 0) {
+                writeFailed = true;
+                break;
+            }
+            done += written;
+        }
+        /* the outfile would come out short, so stop the reader and give up */
+        if (writeFailed) {
+            ring.close();
+            break;
+        }
+        ring.release(t);
+        cursor += done;
+        if (hints != nullptr) {
+            hints->afterWrite(cursor);
+        }
+    }
+
+    if (pthread_join(reader, nullptr) != THREAD_SUCCESS) {
+        throw std::runtime_error("pipelineCopyFile: could not join thread");
+    }
+
+    if (hints != nullptr) {
+        hints->finish();
+        copyHints = hints->stats;
+        delete hints;
+    }
+
+    close(infile);
+    close(outfile);
+
+    if (writeFailed) {
+        throw std::runtime_error("pipelineCopyFile: could not write outfile");
+    }
+    if (params.readFailed) {
+        throw std::runtime_error("pipelineCopyFile: could not read infile");
     }
 }
 
 int main(int argc, char** argv) {
 
-    const std::string cmdErrorMessage = "main: the correct command is: ./sane_copier <infile> <outfile> <optional -t>";
+    const std::string cmdErrorMessage = "main: the correct command is: ./sane_copier <infile> <outfile> <optional -t> <optional --pipeline> <optional --slots <#slots>> <optional --hints> <optional --durable>";
     const std::string timerFlag = "-t";
+    const std::string pipelineFlag = "--pipeline";
+    const std::string slotsFlag = "--slots";
+    const std::string hintsFlag = "--hints";
+    const std::string durableFlag = "--durable";
 
     /* check number of cmd args */
-    if (argc < MIN_NUM_ARGS || argc > MAX_NUM_ARGS) {
+    if (argc < MIN_NUM_ARGS) {
 
         throw std::runtime_error(cmdErrorMessage);
     }
@@ -92,21 +268,85 @@ int main(int argc, char** argv) {
     char* outfileName = argv[OUTFILE_INDX];
     bool showTime = false;
 
-    /* check if the command has the timer flag*/
-    if (argc == MAX_NUM_ARGS) {
-        if (argv[TIMER_INDEX] == timerFlag) {
+    /* check the optional flags */
+    for (int i = OPTIONS_INDX; i < argc; ++i) {
+        if (argv[i] == timerFlag) {
             showTime = true;
+        } else if (argv[i] == pipelineFlag) {
+            pipelined = true;
+        } else if (argv[i] == hintsFlag) {
+            useHints = true;
+        } else if (argv[i] == durableFlag) {
+            durable = true;
+        } else if (argv[i] == slotsFlag && i + 1 < argc) {
+            try {
+                pipelineSlots = std::stol(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid slots command argument format");
+            }
+            if (pipelineSlots < 2) {
+                throw std::runtime_error("main: slots command argument cannot be below 2");
+            }
         } else {
             throw std::runtime_error(cmdErrorMessage);
         }
     }
 
+    /* durable copies go to a temp file which gets renamed over the outfile at the end */
+    durablefile* durableOut = durable ? new durablefile(outfileName, infileName) : nullptr;
+    const char* copyOutfileName = durable ? durableOut->tempName.c_str() : outfileName;
+
+    /* snapshot the process counters so only the copy gets counted */
+    resourceusage startUsage = resourceusage::ofProcess();
+    processio startIO = processio::current();
+
     /* copy the file */
-    long totalTime = timeFunction([&infileName, &outfileName] { copyFile(infileName, outfileName); }).count();
+    long totalTime = timeFunction([&infileName, copyOutfileName, durableOut] {
+        if (pipelined) {
+            pipelineCopyFile(infileName, copyOutfileName);
+        } else {
+            copyFile(infileName, copyOutfileName);
+        }
+        if (durableOut != nullptr) {
+            durableOut->publish();
+        }
+    }).count();
+
+    resourceusage usage = resourceusage::ofProcess() - startUsage;
+    processio io = processio::current() - startIO;
+    long bytesCopied = getFileSize(infileName);
 
     /* display the time taken */
     if (showTime) {
         std::cout << "----COPYING STATS----" << std::endl;
         std::cout << "total time: " << totalTime / NS_PER_MS << " ms" << std::endl;
+        if (pipelined) {
+            std::cout << "pipeline: " << pipelineSlots << " slots of " << PIPELINE_CHUNK << " bytes" << std::endl;
+        }
+        std::cout << "----RESOURCE STATS----" << std::endl;
+        std::cout << "voluntary context switches: " << usage.voluntarySwitches << std::endl;
+        std::cout << "involuntary context switches: " << usage.involuntarySwitches << std::endl;
+        std::cout << "minor faults: " << usage.minorFaults << std::endl;
+        std::cout << "major faults: " << usage.majorFaults << std::endl;
+        std::cout << "cpu time: " << usage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "read chars: " << io.readChars << std::endl;
+        std::cout << "write chars: " << io.writeChars << std::endl;
+        std::cout << "storage read bytes: " << io.readBytes << std::endl;
+        std::cout << "storage write bytes: " << io.writeBytes << std::endl;
+        if (useHints) {
+            std::cout << "dirty page cache high water: " << copyHints.highestDirtyKB << " kB" << std::endl;
+            std::cout << "write-behind sync wait: " << copyHints.syncWaitTime / NS_PER_MS << " ms" << std::endl;
+        }
+        if (durable) {
+            std::cout << "----SYNC STATS----" << std::endl;
+            std::cout << "fdatasync: " << durableOut->fdatasyncTime / NS_PER_MS << " ms" << std::endl;
+            std::cout << "rename + directory fsync: " << durableOut->publishTime / NS_PER_MS << " ms" << std::endl;
+        }
+        if (bytesCopied > 0) {
+            std::cout << "cpu seconds per GB: " << (usage.cpuTime / NS_PER_SEC) / (bytesCopied / BYTES_PER_GB) << std::endl;
+        }
     }
+
+    delete durableOut;
 }
@@ -0,0 +1,118 @@
+#ifndef RESOURCEUSAGE_H
+#define RESOURCEUSAGE_H
+
+#include <sys/resource.h>
+#include <fstream>
+#include <string>
+
+/*
+* class used for recording what the os charged a thread or the process
+* (context switches, page faults and cpu time in ns)
+*/
+class resourceusage
+{
+    public:
+        long voluntarySwitches;
+        long involuntarySwitches;
+        long minorFaults;
+        long majorFaults;
+        long cpuTime;
+        resourceusage(): voluntarySwitches(0), involuntarySwitches(0), minorFaults(0), majorFaults(0), cpuTime(0) {};
+        resourceusage(const struct rusage& usage) :
+            voluntarySwitches(usage.ru_nvcsw), involuntarySwitches(usage.ru_nivcsw),
+            minorFaults(usage.ru_minflt), majorFaults(usage.ru_majflt),
+            cpuTime((usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000L
+                + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000L) {};
+
+        /* usage of the calling thread so far */
+        static resourceusage ofThread() {
+            struct rusage usage;
+            if (getrusage(RUSAGE_THREAD, &usage) != 0) {
+                return resourceusage();
+            }
+            return resourceusage(usage);
+        }
+
+        /* usage of the whole process so far (includes finished threads) */
+        static resourceusage ofProcess() {
+            struct rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) != 0) {
+                return resourceusage();
+            }
+            return resourceusage(usage);
+        }
+
+        resourceusage operator+(const resourceusage& other) const {
+            resourceusage sum;
+            sum.voluntarySwitches = voluntarySwitches + other.voluntarySwitches;
+            sum.involuntarySwitches = involuntarySwitches + other.involuntarySwitches;
+            sum.minorFaults = minorFaults + other.minorFaults;
+            sum.majorFaults = majorFaults + other.majorFaults;
+            sum.cpuTime = cpuTime + other.cpuTime;
+            return sum;
+        }
+
+        resourceusage operator-(const resourceusage& other) const {
+            resourceusage diff;
+            diff.voluntarySwitches = voluntarySwitches - other.voluntarySwitches;
+            diff.involuntarySwitches = involuntarySwitches - other.involuntarySwitches;
+            diff.minorFaults = minorFaults - other.minorFaults;
+            diff.majorFaults = majorFaults - other.majorFaults;
+            diff.cpuTime = cpuTime - other.cpuTime;
+            return diff;
+        }
+};
+
+/*
+* class used for the byte counters in /proc/self/io
+* chars are what went through read/write, bytes are what hit the storage layer
+* and calls are the number of read/write syscalls
+*/
+class processio
+{
+    public:
+        long readChars;
+        long writeChars;
+        long readBytes;
+        long writeBytes;
+        long readCalls;
+        long writeCalls;
+        processio(): readChars(0), writeChars(0), readBytes(0), writeBytes(0), readCalls(0), writeCalls(0) {};
+
+        /* read the counters for this process, all zero if /proc/self/io isn't there */
+        static processio current() {
+            processio io;
+            std::ifstream file("/proc/self/io");
+            std::string key;
+            long value;
+            while (file >> key >> value) {
+                if (key == "rchar:") {
+                    io.readChars = value;
+                } else if (key == "wchar:") {
+                    io.writeChars = value;
+                } else if (key == "read_bytes:") {
+                    io.readBytes = value;
+                } else if (key == "write_bytes:") {
+                    io.writeBytes = value;
+                } else if (key == "syscr:") {
+                    io.readCalls = value;
+                } else if (key == "syscw:") {
+                    io.writeCalls = value;
+                }
+            }
+            return io;
+        }
+
+        processio operator-(const processio& other) const {
+            processio diff;
+            diff.readChars = readChars - other.readChars;
+            diff.writeChars = writeChars - other.writeChars;
+            diff.readBytes = readBytes - other.readBytes;
+            diff.writeBytes = writeBytes - other.writeBytes;
+            diff.readCalls = readCalls - other.readCalls;
+            diff.writeCalls = writeCalls - other.writeCalls;
+            return diff;
+        }
+};
+
+#endif
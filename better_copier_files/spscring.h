@@ -0,0 +1,94 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/types.h>
+
+/* alignment of each slot's buffer, a page so the kernel can copy whole pages */
+#define SLOT_ALIGNMENT 4096
+
+/*
+* single producer single consumer ring of large aligned buffers
+* the reader only ever moves head and the writer only ever moves tail,
+* so neither side needs a lock, they just wait on the other's counter
+*/
+class spscring
+{
+    public:
+        const long numSlots;
+        const long slotSize;
+        char** buffers;
+        ssize_t* lengths;
+        /* slots published by the reader (a length of 0 means end of file) */
+        std::atomic<long> head;
+        /* slots handed back by the writer */
+        std::atomic<long> tail;
+        /* set by the writer when it gives up, so the reader stops instead of waiting for room */
+        std::atomic<bool> closed;
+
+        spscring(long n, long size) : numSlots(n), slotSize(size), head(0), tail(0), closed(false) {
+            buffers = new char*[numSlots];
+            lengths = new ssize_t[numSlots];
+            for (long i = 0; i < numSlots; ++i) {
+                buffers[i] = (char*) std::aligned_alloc(SLOT_ALIGNMENT, slotSize);
+                if (buffers[i] == nullptr) {
+                    throw std::bad_alloc();
+                }
+            }
+        };
+
+        ~spscring() {
+            for (long i = 0; i < numSlots; ++i) {
+                std::free(buffers[i]);
+            }
+            delete[] buffers;
+            delete[] lengths;
+        };
+
+        /* reader side: wait until the writer has given back the slot for position h, nullptr once the ring is closed */
+        char* waitEmpty(long h) {
+            long t = tail.load(std::memory_order_acquire);
+            while (h - t >= numSlots) {
+                tail.wait(t, std::memory_order_acquire);
+                t = tail.load(std::memory_order_acquire);
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                return nullptr;
+            }
+            return buffers[h % numSlots];
+        }
+
+        /* reader side: hand the slot for position h to the writer */
+        void publish(long h, ssize_t length) {
+            lengths[h % numSlots] = length;
+            head.store(h + 1, std::memory_order_release);
+            head.notify_one();
+        }
+
+        /* writer side: wait until the reader has published the slot for position t */
+        long waitFilled(long t) {
+            long h = head.load(std::memory_order_acquire);
+            while (h == t) {
+                head.wait(h, std::memory_order_acquire);
+                h = head.load(std::memory_order_acquire);
+            }
+            return t % numSlots;
+        }
+
+        /* writer side: give the slot for position t back to the reader */
+        void release(long t) {
+            tail.store(t + 1, std::memory_order_release);
+            tail.notify_one();
+        }
+
+        /* writer side: stop the reader, tail moves on so a reader waiting for room wakes up and sees it */
+        void close() {
+            closed.store(true, std::memory_order_release);
+            tail.fetch_add(1, std::memory_order_release);
+            tail.notify_one();
+        }
+};
+
+#endif
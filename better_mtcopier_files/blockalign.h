@@ -0,0 +1,98 @@
+#ifndef BLOCKALIGN_H
+#define BLOCKALIGN_H
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <filesystem>
+#include <numeric>
+#include <string>
+#include <vector>
+
+/* most extents asked for in one FIEMAP call, the alignment only needs a sample of them */
+#define FIEMAP_SAMPLE 64
+
+/*
+* the boundary every copier thread's range starts on
+* ranges that split a page or filesystem block have two threads writing the same one at once,
+* so each ends up read-modify-written under the page lock, aligning to the biggest of the page size,
+* both files' block sizes and whatever the infile's extents are all laid out on keeps them apart
+*/
+class blockalignment
+{
+    public:
+        long bytes;
+        /* the page or block size part of it, what each thread's chunks have to be a multiple of */
+        long block;
+        /* what set it, for the stats */
+        std::string description;
+
+        blockalignment() : bytes(1), block(1), description("unaligned") {};
+
+        /* the alignment for splitting a file of size bytes between numParts threads */
+        static blockalignment of(const char* infileName, const char* outfileName, long size, int numParts) {
+            blockalignment align;
+            align.bytes = sysconf(_SC_PAGESIZE);
+            align.description = "page size";
+
+            long inBlock = blockSizeOf(infileName);
+            long outBlock = blockSizeOf(outfileName);
+            if (outBlock < 0) {
+                outBlock = blockSizeOf(std::filesystem::absolute(outfileName).parent_path().c_str());
+            }
+            if (std::max(inBlock, outBlock) > align.bytes) {
+                align.bytes = std::max(inBlock, outBlock);
+                align.description = inBlock >= outBlock ? "infile block size" : "outfile block size";
+            }
+
+            align.block = align.bytes;
+
+            /* only go up to the extents if rounding to them keeps every range within a sixteenth of even */
+            long extent = extentAlignmentOf(infileName);
+            if (extent > align.bytes && extent % align.bytes == 0 && extent <= size / numParts / 16) {
+                align.bytes = extent;
+                align.description = "infile extent layout";
+            }
+            return align;
+        }
+
+        /* x rounded up to a whole number of blocks */
+        long roundUpToBlock(long x) const {
+            return (x + block - 1) / block * block;
+        }
+
+    private:
+        static long blockSizeOf(const char* fileName) {
+            struct stat st;
+            return stat(fileName, &st) == 0 ? st.st_blksize : -1;
+        }
+
+        /* the largest size every extent of the file starts on a multiple of, -1 if FIEMAP can't say */
+        static long extentAlignmentOf(const char* fileName) {
+            int fd = open(fileName, O_RDONLY);
+            if (fd == -1) {
+                return -1;
+            }
+            std::vector<char> request(sizeof(struct fiemap) + FIEMAP_SAMPLE * sizeof(struct fiemap_extent), 0);
+            struct fiemap* map = (struct fiemap*) request.data();
+            map->fm_start = 0;
+            map->fm_length = FIEMAP_MAX_OFFSET;
+            map->fm_extent_count = FIEMAP_SAMPLE;
+            int result = ioctl(fd, FS_IOC_FIEMAP, map);
+            close(fd);
+            if (result != 0 || map->fm_mapped_extents < 2) {
+                return -1;
+            }
+            /* the first extent starts at 0, so it's the others that say anything */
+            long alignment = 0;
+            for (unsigned i = 1; i < map->fm_mapped_extents; ++i) {
+                alignment = std::gcd(alignment, (long) map->fm_extents[i].fe_logical);
+            }
+            return alignment > 0 ? alignment : -1;
+        }
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+
+/* size of a huge page on x86-64 */
+#define HUGE_PAGE_SIZE 2097152L
+
+/*
+* one big mapping carved into a slice per thread for its chunk buffers
+* with huge pages asked for, MAP_HUGETLB is tried first and when no huge pages
+* are reserved it falls back to asking for transparent huge pages with madvise,
+* fewer pages means fewer TLB misses while the kernel copies in and out of them
+*/
+class bufferpool
+{
+    public:
+        /* bytes each thread gets */
+        const long sliceSize;
+        const int numSlices;
+        /* how the memory ended up being backed */
+        std::string backing;
+
+        bufferpool(int slices, long size, bool hugePages) :
+            sliceSize(roundUp(size, hugePages ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE))), numSlices(slices) {
+            length = sliceSize * numSlices;
+            region = MAP_FAILED;
+            if (hugePages) {
+                region = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                backing = "hugetlb";
+            }
+            if (region == MAP_FAILED) {
+                region = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (region == MAP_FAILED) {
+                    throw std::runtime_error("bufferpool: could not map the buffers");
+                }
+                backing = "normal pages";
+                if (hugePages) {
+                    backing = madvise(region, length, MADV_HUGEPAGE) == 0 ? "transparent huge pages" : "normal pages (no huge pages available)";
+                }
+            }
+        };
+
+        ~bufferpool() {
+            munmap(region, length);
+        };
+
+        /* the buffer for one thread */
+        char* slice(int index) {
+            return (char*) region + sliceSize * index;
+        }
+
+        /* fault a slice in from the thread that will use it, so its pages land on that thread's node */
+        void touch(int index) {
+            char* start = slice(index);
+            long pageSize = sysconf(_SC_PAGESIZE);
+            for (long i = 0; i < sliceSize; i += pageSize) {
+                start[i] = 0;
+            }
+        }
+
+    private:
+        void* region;
+        long length;
+
+        static long roundUp(long size, long multiple) {
+            return (size + multiple - 1) / multiple * multiple;
+        }
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef CHANGEINDEX_H
+#define CHANGEINDEX_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "dedupindex.h"
+#include "durablefile.h"
+
+/* first 8 bytes of a change index file */
+#define CHANGE_INDEX_MAGIC "BMTCIDX3"
+/*
+* an older index, from before entries knew their tree (1) or before keys were SHA-256 (2),
+* it's started again rather than trusted, only the last digit differs
+*/
+#define CHANGE_INDEX_OLD_MAGIC "BMTCIDX"
+
+/*
+* what a source file looked like when it was last synced
+* laid out as is in the index file, so it's kept to plain 8 byte fields
+* key is the hash of the source and destination paths, so one index can serve several trees,
+* and tree the hash of the two roots, so a sync only prunes the entries of the tree it walked
+*/
+struct changeentry
+{
+    uint64_t keyHigh;
+    uint64_t keyLow;
+    uint64_t treeHigh;
+    uint64_t treeLow;
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime;
+    uint64_t contentHigh;
+    uint64_t contentLow;
+
+    bool operator<(const changeentry& other) const {
+        return keyHigh != other.keyHigh ? keyHigh < other.keyHigh : keyLow < other.keyLow;
+    }
+};
+
+struct changeindexheader
+{
+    char magic[8];
+    uint64_t count;
+};
+
+/*
+* whole file content hash, two 64 bit lanes fed a read at a time, only used to tell a touched file from a changed one
+* gives the same hash however the file is read, since words are only mixed in once there are 8 bytes of them
+*/
+class contenthasher
+{
+    public:
+        uint64_t high;
+        uint64_t low;
+        long length;
+        contenthasher(): high(0x9E3779B97F4A7C15UL), low(0xC2B2AE3D27D4EB4FUL), length(0), pendingBytes(0), pending(0) {};
+
+        void update(const char* data, long bytes) {
+            long i = 0;
+            /* finish off a word left over from the last read, then take whole words while there are any */
+            for (; i < bytes && pendingBytes != 0; ++i) {
+                addByte(data[i]);
+            }
+            for (; i + 8 <= bytes; i += 8) {
+                uint64_t word;
+                std::memcpy(&word, data + i, sizeof(word));
+                addWord(word);
+            }
+            for (; i < bytes; ++i) {
+                addByte(data[i]);
+            }
+            length += bytes;
+        }
+
+        chunkhash finish() const {
+            uint64_t h = mix(high ^ pending ^ (uint64_t) length);
+            return chunkhash(h, mix(low + pending + (uint64_t) length + h));
+        }
+
+    private:
+        int pendingBytes;
+        uint64_t pending;
+
+        void addWord(uint64_t word) {
+            high = rotate((high ^ word) * 0x87C37B91114253D5UL, 31);
+            low = rotate((low + word) * 0x4CF5AD432745937FUL, 27) ^ high;
+        }
+
+        /* little endian, so a word built up a byte at a time matches the same word read in one go */
+        void addByte(char byte) {
+            pending |= (uint64_t) (unsigned char) byte << (8 * pendingBytes);
+            if (++pendingBytes == 8) {
+                addWord(pending);
+                pending = 0;
+                pendingBytes = 0;
+            }
+        }
+
+        static uint64_t rotate(uint64_t x, int bits) {
+            return (x << bits) | (x >> (64 - bits));
+        }
+
+        static uint64_t mix(uint64_t x) {
+            x ^= x >> 33;
+            x *= 0xFF51AFD7ED558CCDUL;
+            x ^= x >> 33;
+            x *= 0xC4CEB9FE1A85EC53UL;
+            x ^= x >> 33;
+            return x;
+        }
+};
+
+/*
+* persistent index of every synced file's inode, size, mtime and content hash
+* the file is a header and an array of entries sorted by key, mapped shared so lookups
+* are a binary search over the page cache and an entry that changes is rewritten in place
+* straight away, entries for files seen for the first time are merged in by save(),
+* which also drops this tree's entries for files that weren't there this time
+*/
+class changeindex
+{
+    public:
+        const std::string indexName;
+        /* entries added since the index was mapped, merged in by save */
+        std::vector<changeentry> added;
+        /* entries rewritten in place */
+        std::atomic<long> updated;
+        /* entries dropped by save because their file is gone from the tree */
+        long pruned;
+
+        /* tree is the hash of the roots being synced, see changeentry */
+        changeindex(const std::string& name, const chunkhash& tree) : indexName(name), updated(0), pruned(0), tree(tree),
+            entries(nullptr), count(0), mapping(nullptr), mappingSize(0) {
+            pthread_mutex_init(&addedMutex, nullptr);
+            int fd = open(indexName.c_str(), O_RDWR);
+            if (fd == -1) {
+                return;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < (long) sizeof(changeindexheader)) {
+                close(fd);
+                throw std::runtime_error("changeindex: " + indexName + " is not a change index");
+            }
+            mappingSize = st.st_size;
+            mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                throw std::runtime_error("changeindex: could not map " + indexName);
+            }
+            changeindexheader* header = (changeindexheader*) mapping;
+            if (std::memcmp(header->magic, CHANGE_INDEX_OLD_MAGIC, sizeof(header->magic) - 1) == 0
+                && std::memcmp(header->magic, CHANGE_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+                munmap(mapping, mappingSize);
+                mapping = nullptr;
+                return;
+            }
+            if (std::memcmp(header->magic, CHANGE_INDEX_MAGIC, sizeof(header->magic)) != 0
+                || sizeof(changeindexheader) + header->count * sizeof(changeentry) != (uint64_t) mappingSize) {
+                munmap(mapping, mappingSize);
+                mapping = nullptr;
+                throw std::runtime_error("changeindex: " + indexName + " is not a change index");
+            }
+            count = header->count;
+            entries = (changeentry*) ((char*) mapping + sizeof(changeindexheader));
+            seen.assign(count, 0);
+        }
+
+        ~changeindex() {
+            if (mapping != nullptr) {
+                munmap(mapping, mappingSize);
+            }
+            pthread_mutex_destroy(&addedMutex);
+        }
+
+        long size() const {
+            return count;
+        }
+
+        /* the entry for a key, nullptr if the file has never been synced, safe to call from any thread */
+        changeentry* find(const chunkhash& key) const {
+            changeentry probe;
+            probe.keyHigh = key.high;
+            probe.keyLow = key.low;
+            changeentry* found = std::lower_bound(entries, entries + count, probe);
+            if (found == entries + count || found->keyHigh != key.high || found->keyLow != key.low) {
+                return nullptr;
+            }
+            return found;
+        }
+
+        /* an entry whose file is still in the tree, so save keeps it, each thread marks different ones */
+        void keep(changeentry* existing) {
+            seen[existing - entries] = 1;
+        }
+
+        /*
+        * record what a file looked like once it's been synced
+        * each file has its own entry, so threads only ever write different ones
+        */
+        void record(changeentry* existing, const changeentry& entry) {
+            if (existing != nullptr) {
+                *existing = entry;
+                ++updated;
+                return;
+            }
+            pthread_mutex_lock(&addedMutex);
+            added.push_back(entry);
+            pthread_mutex_unlock(&addedMutex);
+        }
+
+        /*
+        * flush the in place updates, and if there are new entries or gone ones merge into a new sorted file
+        * which replaces the old one through a rename, so a crash leaves the old index and its updates
+        */
+        void save() {
+            if (mapping != nullptr) {
+                msync(mapping, mappingSize, MS_SYNC);
+            }
+            for (long i = 0; i < count; ++i) {
+                if (!keeping(i)) {
+                    ++pruned;
+                }
+            }
+            if (added.empty() && pruned == 0 && mapping != nullptr) {
+                return;
+            }
+            std::sort(added.begin(), added.end());
+
+            durablefile out(indexName);
+            {
+                std::ofstream file(out.tempName, std::ofstream::binary | std::ofstream::trunc);
+                changeindexheader header;
+                std::memcpy(header.magic, CHANGE_INDEX_MAGIC, sizeof(header.magic));
+                header.count = count - pruned + added.size();
+                file.write((const char*) &header, sizeof(header));
+
+                /* both sides are sorted, so one pass merges them */
+                long i = 0;
+                long j = 0;
+                while (i < count || j < (long) added.size()) {
+                    bool takeExisting = j == (long) added.size() || (i < count && entries[i] < added[j]);
+                    if (takeExisting && !keeping(i)) {
+                        ++i;
+                        continue;
+                    }
+                    const changeentry& entry = takeExisting ? entries[i++] : added[j++];
+                    file.write((const char*) &entry, sizeof(entry));
+                }
+                if (!file) {
+                    out.abandon();
+                    throw std::runtime_error("changeindex: could not write " + out.tempName);
+                }
+            }
+            out.publish();
+        }
+
+    private:
+        chunkhash tree;
+        changeentry* entries;
+        long count;
+        /* which entries were found this run */
+        std::vector<char> seen;
+
+        /* other trees' entries are always kept, this tree's only if their file was found */
+        bool keeping(long i) const {
+            return seen[i] || entries[i].treeHigh != tree.high || entries[i].treeLow != tree.low;
+        }
+        void* mapping;
+        long mappingSize;
+        pthread_mutex_t addedMutex;
+};
+
+#endif
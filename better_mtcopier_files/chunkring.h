@@ -0,0 +1,112 @@
+#ifndef CHUNKRING_H
+#define CHUNKRING_H
+
+#include <pthread.h>
+#include <vector>
+
+class iohints;
+
+/*
+* ring of chunk buffers shared by a copier thread and its helper writer
+* the copier fills the slot at head while the helper writes out the slot at tail,
+* so the next read is in flight while the last chunk is being written
+*/
+class chunkring
+{
+    public:
+        std::vector<char*> buffers;
+        std::vector<long> lengths;
+        std::vector<long> offsets;
+        int head;
+        int tail;
+        int filled;
+        bool done;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+
+        /* the buffers are carved from memory if it's given, otherwise the ring allocates its own */
+        chunkring(int numBuffers, long chunkSize, char* memory = nullptr) :
+            buffers(numBuffers), lengths(numBuffers, 0), offsets(numBuffers, 0),
+            head(0), tail(0), filled(0), done(false) {
+            if (memory == nullptr) {
+                storage.resize(numBuffers * chunkSize);
+                memory = storage.data();
+            }
+            for (int i = 0; i < numBuffers; ++i) {
+                buffers[i] = memory + i * chunkSize;
+            }
+            pthread_mutex_init(&mutex, nullptr);
+            pthread_cond_init(&cond, nullptr);
+        };
+
+        ~chunkring() {
+            pthread_mutex_destroy(&mutex);
+            pthread_cond_destroy(&cond);
+        };
+
+        /* wait for a slot the helper has finished writing and return it */
+        int acquireEmpty() {
+            pthread_mutex_lock(&mutex);
+            while (filled == (int) buffers.size()) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            int slot = head;
+            pthread_mutex_unlock(&mutex);
+            return slot;
+        }
+
+        /* hand the slot at head over to the helper */
+        void publish(long length, long offset) {
+            pthread_mutex_lock(&mutex);
+            lengths[head] = length;
+            offsets[head] = offset;
+            head = (head + 1) % buffers.size();
+            ++filled;
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        /* wait for a filled slot and return it, -1 once the copier is done and everything is written */
+        int acquireFilled() {
+            pthread_mutex_lock(&mutex);
+            while (filled == 0 && !done) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            int slot = filled == 0 ? -1 : tail;
+            pthread_mutex_unlock(&mutex);
+            return slot;
+        }
+
+        /* give the slot at tail back to the copier */
+        void release() {
+            pthread_mutex_lock(&mutex);
+            tail = (tail + 1) % buffers.size();
+            --filled;
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        /* the copier has read everything it is going to */
+        void finish() {
+            pthread_mutex_lock(&mutex);
+            done = true;
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+    private:
+        std::vector<char> storage;
+};
+
+/* params for the helper thread which writes out a copier thread's ring */
+class ringwriterparams
+{
+    public:
+        chunkring* ring;
+        const int outfile;
+        iohints* hints;
+        long writeTime;
+        ringwriterparams(chunkring* r, int o, iohints* h) : ring(r), outfile(o), hints(h), writeTime(0) {};
+};
+
+#endif
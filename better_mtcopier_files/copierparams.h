@@ -5,6 +5,7 @@
 * params for the copier threads 
 * used to know where in the input file to read from
 * and how many bytes to read
+* (outPosition is where they go in the output file, the same place unless splitting or joining)
 */
 class copierparams
 {
@@ -14,8 +15,11 @@ class copierparams
         const char* outfileName;
         const long position;
         const long bytes;
+        const long outPosition;
         copierparams(long i, const char* ifile, const char* ofile, long p, long b) :
-            id(i), infileName(ifile), outfileName(ofile), position(p), bytes(b) {};
+            id(i), infileName(ifile), outfileName(ofile), position(p), bytes(b), outPosition(p) {};
+        copierparams(long i, const char* ifile, const char* ofile, long p, long b, long op) :
+            id(i), infileName(ifile), outfileName(ofile), position(p), bytes(b), outPosition(op) {};
 };
 
 #endif
\ No newline at end of file
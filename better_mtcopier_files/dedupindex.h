@@ -0,0 +1,367 @@
+#ifndef DEDUPINDEX_H
+#define DEDUPINDEX_H
+
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "durablefile.h"
+
+/* smallest chunk the chunker cuts, nothing before this is even hashed for a boundary */
+#define DEDUP_MIN_CHUNK (16 * 1024L)
+/* biggest chunk the chunker cuts, a boundary is forced here */
+#define DEDUP_MAX_CHUNK (256 * 1024L)
+/* how much of the infile each thread keeps in memory while cutting it up */
+#define DEDUP_WINDOW (4 * DEDUP_MAX_CHUNK)
+/* a boundary is wherever the top 16 bits of the rolling hash are zero, so about every 64K past the minimum */
+#define DEDUP_BOUNDARY_MASK 0xFFFF000000000000UL
+/* first line of an index file */
+#define DEDUP_INDEX_HEADER "bmtcopier-dedup-index 2"
+/* an index whose chunks were hashed before the hash was cryptographic, it's started again rather than trusted */
+#define DEDUP_INDEX_OLD_HEADER "bmtcopier-dedup-index 1"
+
+/* FIPS 180-4 SHA-256, only the one shot digest of a chunk in memory is needed */
+class sha256
+{
+    public:
+        static void digest(const char* data, long length, unsigned char out[32]) {
+            uint32_t state[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+            long whole = length & ~63L;
+            for (long i = 0; i < whole; i += 64) {
+                block(state, (const unsigned char*) data + i);
+            }
+            /* the tail, the 0x80 end marker and the length in bits, in one block or two */
+            unsigned char last[128] = {};
+            long tail = length - whole;
+            std::memcpy(last, data + whole, tail);
+            last[tail] = 0x80;
+            long lastLength = tail < 56 ? 64 : 128;
+            uint64_t bits = (uint64_t) length * 8;
+            for (int i = 0; i < 8; ++i) {
+                last[lastLength - 1 - i] = (unsigned char) (bits >> (8 * i));
+            }
+            for (long i = 0; i < lastLength; i += 64) {
+                block(state, last + i);
+            }
+            for (int i = 0; i < 8; ++i) {
+                out[4 * i] = (unsigned char) (state[i] >> 24);
+                out[4 * i + 1] = (unsigned char) (state[i] >> 16);
+                out[4 * i + 2] = (unsigned char) (state[i] >> 8);
+                out[4 * i + 3] = (unsigned char) state[i];
+            }
+        }
+
+    private:
+        static uint32_t rotate(uint32_t x, int bits) {
+            return (x >> bits) | (x << (32 - bits));
+        }
+
+        static void block(uint32_t state[8], const unsigned char* data) {
+            static const uint32_t k[64] = {
+                0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+                0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+                0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+                0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+                0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+                0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+                0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+                0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+            };
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i) {
+                w[i] = (uint32_t) data[4 * i] << 24 | (uint32_t) data[4 * i + 1] << 16 | (uint32_t) data[4 * i + 2] << 8 | data[4 * i + 3];
+            }
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i) {
+                uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+};
+
+/* 128 bit hash, the content hash of a chunk or the hash of a pair of paths */
+class chunkhash
+{
+    public:
+        uint64_t high;
+        uint64_t low;
+        chunkhash(): high(0), low(0) {};
+        chunkhash(uint64_t h, uint64_t l): high(h), low(l) {};
+
+        bool operator==(const chunkhash& other) const {
+            return high == other.high && low == other.low;
+        }
+
+        /*
+        * the first 128 bits of the SHA-256 of a chunk, so a chunk with the same hash can be taken
+        * from a local copy without reading the infile's bytes to compare them, even for untrusted files
+        */
+        static chunkhash of(const char* data, long length) {
+            unsigned char digest[32];
+            sha256::digest(data, length, digest);
+            uint64_t h = 0;
+            uint64_t l = 0;
+            for (int i = 0; i < 8; ++i) {
+                h = h << 8 | digest[i];
+                l = l << 8 | digest[8 + i];
+            }
+            return chunkhash(h, l);
+        }
+
+        std::string toString() const {
+            std::ostringstream out;
+            out << std::hex << std::setfill('0') << std::setw(16) << high << std::setw(16) << low;
+            return out.str();
+        }
+
+        static chunkhash fromString(const std::string& str) {
+            return chunkhash(std::stoull(str.substr(0, 16), nullptr, 16), std::stoull(str.substr(16, 16), nullptr, 16));
+        }
+
+};
+
+struct chunkhashhasher
+{
+    size_t operator()(const chunkhash& hash) const {
+        return hash.low;
+    }
+};
+
+/* one chunk of a file, where it is and what's in it */
+class dedupchunk
+{
+    public:
+        chunkhash hash;
+        long offset;
+        long length;
+        dedupchunk(): offset(0), length(0) {};
+        dedupchunk(const chunkhash& h, long o, long l): hash(h), offset(o), length(l) {};
+};
+
+/* the chunks a file was cut into, with the size and mtime it had then */
+class dedupfile
+{
+    public:
+        std::string path;
+        long size;
+        long mtime;
+        std::vector<dedupchunk> chunks;
+        dedupfile(): size(0), mtime(0) {};
+
+        /* whether the file on disk still looks like it did when it was chunked */
+        bool current() const {
+            struct stat st;
+            return stat(path.c_str(), &st) == 0 && st.st_size == size && mtimeOf(st) == mtime;
+        }
+
+        /* stamp the record with the file's size and mtime now, false if it's gone */
+        bool stamp() {
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) {
+                return false;
+            }
+            size = st.st_size;
+            mtime = mtimeOf(st);
+            return true;
+        }
+
+        static long mtimeOf(const struct stat& st) {
+            return st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+        }
+};
+
+/*
+* content-defined chunker using a gear rolling hash
+* each byte shifts the hash left and adds a random value for the byte, so the top bits
+* only depend on the last 64 bytes, and a boundary falls in the same place in the content
+* wherever that content has moved to in the file
+*/
+class gearchunker
+{
+    public:
+        /* length of the chunk at the start of data, data has length bytes and more to come unless last */
+        static long cut(const char* data, long length) {
+            static const std::vector<uint64_t> gear = table();
+            if (length <= DEDUP_MIN_CHUNK) {
+                return length;
+            }
+            long limit = std::min(length, DEDUP_MAX_CHUNK);
+            uint64_t fingerprint = 0;
+            for (long i = DEDUP_MIN_CHUNK; i < limit; ++i) {
+                fingerprint = (fingerprint << 1) + gear[(unsigned char) data[i]];
+                if ((fingerprint & DEDUP_BOUNDARY_MASK) == 0) {
+                    return i + 1;
+                }
+            }
+            return limit;
+        }
+
+    private:
+        /* fixed by a splitmix64 seed so every run cuts the same content in the same places */
+        static std::vector<uint64_t> table() {
+            std::vector<uint64_t> values(256);
+            uint64_t state = 0x2545F4914F6CDD1DUL;
+            for (uint64_t& value : values) {
+                state += 0x9E3779B97F4A7C15UL;
+                uint64_t z = state;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+                value = z ^ (z >> 31);
+            }
+            return values;
+        }
+};
+
+/*
+* persistent index of the chunks in files that have been copied before
+* a text file with a line per file (size, mtime, number of chunks, path)
+* followed by a line per chunk (hash, offset, length),
+* files that have changed since they were recorded are dropped when it's loaded
+*/
+class dedupindex
+{
+    public:
+        const std::string indexName;
+        /* every file that's still current */
+        std::vector<dedupfile> files;
+        /* where each chunk can be found, index into files and the chunk in it */
+        std::unordered_map<chunkhash, std::pair<int, int>, chunkhashhasher> locations;
+        /* files dropped because they changed or went away */
+        int staleFiles;
+
+        dedupindex(const std::string& name) : indexName(name), staleFiles(0) {
+            std::ifstream in(indexName);
+            std::string line;
+            if (!std::getline(in, line)) {
+                return;
+            }
+            if (line == DEDUP_INDEX_OLD_HEADER) {
+                return;
+            }
+            if (line != DEDUP_INDEX_HEADER) {
+                throw std::runtime_error("dedupindex: " + indexName + " is not a dedup index");
+            }
+            dedupfile file;
+            long numChunks;
+            while (in >> file.size >> file.mtime >> numChunks && in.get() == ' ' && std::getline(in, file.path)) {
+                file.chunks.clear();
+                std::string hash;
+                for (long i = 0; i < numChunks; ++i) {
+                    dedupchunk chunk;
+                    if (!(in >> hash >> chunk.offset >> chunk.length) || hash.size() != 32) {
+                        throw std::runtime_error("dedupindex: " + indexName + " is cut short");
+                    }
+                    chunk.hash = chunkhash::fromString(hash);
+                    file.chunks.push_back(chunk);
+                }
+                /* a path that isn't absolute was recorded before paths were made absolute, from who knows where */
+                if (std::filesystem::path(file.path).is_absolute() && file.current()) {
+                    record(file);
+                } else {
+                    ++staleFiles;
+                }
+            }
+        }
+
+        /*
+        * the same path the index stores for a file, whichever way it was named and whether it exists yet,
+        * made absolute first since weakly_canonical leaves a relative path to a missing file relative
+        */
+        static std::string canonical(const std::string& name) {
+            return std::filesystem::weakly_canonical(std::filesystem::absolute(name)).string();
+        }
+
+        /* the recorded chunks of a file that hasn't changed since, nullptr if there aren't any */
+        const dedupfile* find(const std::string& path) const {
+            for (const dedupfile& file : files) {
+                if (file.path == path) {
+                    return &file;
+                }
+            }
+            return nullptr;
+        }
+
+        /* make every chunk findable, except the chunks in the files being copied from and over */
+        void mapLocations(const std::string& skipFirst, const std::string& skipSecond) {
+            locations.clear();
+            for (int f = 0; f < (int) files.size(); ++f) {
+                if (files[f].path == skipFirst || files[f].path == skipSecond) {
+                    continue;
+                }
+                for (int c = 0; c < (int) files[f].chunks.size(); ++c) {
+                    locations.emplace(files[f].chunks[c].hash, std::make_pair(f, c));
+                }
+            }
+        }
+
+        /* replace whatever was recorded for a file */
+        void record(const dedupfile& file) {
+            for (dedupfile& existing : files) {
+                if (existing.path == file.path) {
+                    existing = file;
+                    return;
+                }
+            }
+            files.push_back(file);
+        }
+
+        long totalChunks() const {
+            long total = 0;
+            for (const dedupfile& file : files) {
+                total += file.chunks.size();
+            }
+            return total;
+        }
+
+        /* write the index out, through a temp file so a crash never leaves half an index */
+        void save() const {
+            durablefile out(indexName);
+            {
+                std::ofstream file(out.tempName, std::ofstream::trunc);
+                file << DEDUP_INDEX_HEADER << "\n";
+                for (const dedupfile& record : files) {
+                    file << record.size << " " << record.mtime << " " << record.chunks.size() << " " << record.path << "\n";
+                    for (const dedupchunk& chunk : record.chunks) {
+                        file << chunk.hash.toString() << " " << chunk.offset << " " << chunk.length << "\n";
+                    }
+                }
+                if (!file) {
+                    out.abandon();
+                    throw std::runtime_error("dedupindex: could not write " + out.tempName);
+                }
+            }
+            out.publish();
+        }
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef DURABLEFILE_H
+#define DURABLEFILE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+* an outfile which only shows up once it's safely on disk
+* the copy goes to a hidden sibling, which gets fdatasynced, renamed over
+* the real name and then has its directory fsynced so the rename sticks,
+* a reader either sees the old file or the whole new one,
+* the new one keeps the permissions of the file it replaces (or of the infile when there wasn't one),
+* and a copy that fails, even by an exception escaping a thread, doesn't leave the temp file behind
+*/
+class durablefile
+{
+    public:
+        const std::string finalName;
+        const std::string tempName;
+        /* time for the final fdatasync in ns */
+        long fdatasyncTime;
+        /* time for the rename and the directory fsync in ns */
+        long publishTime;
+
+        durablefile(const std::string& name, const std::string& sourceName = "") :
+            finalName(name), tempName(tempSibling(name)), fdatasyncTime(0), publishTime(0),
+            mode(modeFor(name, sourceName)), published(false) {
+            if (std::get_terminate() != &removeTempsAndTerminate) {
+                previousTerminate = std::set_terminate(&removeTempsAndTerminate);
+            }
+            unpublished().push_back(this);
+        };
+
+        ~durablefile() {
+            if (!published) {
+                abandon();
+            }
+            forget();
+        };
+
+        /* wait for a range of the temp file to be written back, returns how long it took in ns */
+        static long syncRange(int fd, long offset, long length) {
+            auto start = std::chrono::high_resolution_clock::now();
+            sync_file_range(fd, offset, length,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+        }
+
+        /* make the temp file durable and move it into place */
+        void publish() {
+            auto start = std::chrono::high_resolution_clock::now();
+            int fd = open(tempName.c_str(), O_WRONLY);
+            if (fd == -1 || (mode != -1 && fchmod(fd, mode) != 0) || fdatasync(fd) != 0) {
+                abandon();
+                throw std::runtime_error("durablefile: could not sync " + tempName);
+            }
+            close(fd);
+            auto synced = std::chrono::high_resolution_clock::now();
+            fdatasyncTime = std::chrono::duration_cast<std::chrono::nanoseconds>(synced - start).count();
+
+            if (rename(tempName.c_str(), finalName.c_str()) != 0) {
+                abandon();
+                throw std::runtime_error("durablefile: could not rename " + tempName);
+            }
+            published = true;
+            forget();
+            int dir = open(directoryOf(finalName).c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir == -1 || fsync(dir) != 0) {
+                throw std::runtime_error("durablefile: could not sync the directory of " + finalName);
+            }
+            close(dir);
+            publishTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - synced).count();
+        }
+
+        /* throw the temp file away */
+        void abandon() {
+            unlink(tempName.c_str());
+        }
+
+    private:
+        /* permissions to give the temp file before it's published, -1 to leave them */
+        int mode;
+        bool published;
+        static inline std::terminate_handler previousTerminate = nullptr;
+
+        /* every durablefile not yet published, for the terminate handler */
+        static std::vector<durablefile*>& unpublished() {
+            static std::vector<durablefile*> files;
+            return files;
+        }
+
+        void forget() {
+            std::vector<durablefile*>& files = unpublished();
+            files.erase(std::remove(files.begin(), files.end(), this), files.end());
+        }
+
+        /* an exception nobody catches never runs the destructors, so the temp files are removed here */
+        static void removeTempsAndTerminate() {
+            for (durablefile* file : unpublished()) {
+                unlink(file->tempName.c_str());
+            }
+            if (previousTerminate != nullptr) {
+                previousTerminate();
+            }
+            std::abort();
+        }
+
+        /* the outfile's permissions if it's there, otherwise the infile's */
+        static int modeFor(const std::string& name, const std::string& sourceName) {
+            struct stat st;
+            if (stat(name.c_str(), &st) == 0 || stat(sourceName.c_str(), &st) == 0) {
+                return st.st_mode & 07777;
+            }
+            return -1;
+        }
+
+        static std::string directoryOf(const std::string& name) {
+            size_t slash = name.rfind('/');
+            if (slash == std::string::npos) {
+                return ".";
+            }
+            return slash == 0 ? "/" : name.substr(0, slash);
+        }
+
+        /* .name.tmp.pid next to name, so the rename never crosses filesystems */
+        static std::string tempSibling(const std::string& name) {
+            size_t slash = name.rfind('/');
+            std::string dir = slash == std::string::npos ? "" : name.substr(0, slash + 1);
+            std::string base = slash == std::string::npos ? name : name.substr(slash + 1);
+            return dir + "." + base + ".tmp." + std::to_string(getpid());
+        }
+};
+
+#endif
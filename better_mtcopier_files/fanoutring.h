@@ -0,0 +1,109 @@
+#ifndef FANOUTRING_H
+#define FANOUTRING_H
+
+#include <pthread.h>
+#include <vector>
+
+/*
+* ring of chunk buffers read once and written to several outfiles
+* every published chunk starts with one reference per outfile and its slot
+* is only reused once every outfile's writer has let go of it,
+* so the fastest writer can get at most a ring's worth of chunks ahead of the slowest
+*/
+class fanoutring
+{
+    public:
+        std::vector<char*> buffers;
+        std::vector<long> lengths;
+        std::vector<long> offsets;
+        /* writers that still need each slot */
+        std::vector<int> refs;
+        /* next chunk each writer will take */
+        std::vector<long> cursors;
+        /* chunks published so far */
+        long published;
+        bool done;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+
+        fanoutring(int numSlots, long chunkSize, int numWriters, char* memory) :
+            buffers(numSlots), lengths(numSlots, 0), offsets(numSlots, 0), refs(numSlots, 0),
+            cursors(numWriters, 0), published(0), done(false) {
+            for (int i = 0; i < numSlots; ++i) {
+                buffers[i] = memory + i * chunkSize;
+            }
+            pthread_mutex_init(&mutex, nullptr);
+            pthread_cond_init(&cond, nullptr);
+        };
+
+        ~fanoutring() {
+            pthread_mutex_destroy(&mutex);
+            pthread_cond_destroy(&cond);
+        };
+
+        /* wait for the next slot to be let go by every writer and return it */
+        int acquireFree() {
+            pthread_mutex_lock(&mutex);
+            int slot = published % buffers.size();
+            while (refs[slot] > 0) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            pthread_mutex_unlock(&mutex);
+            return slot;
+        }
+
+        /* hand the next slot to every writer */
+        void publish(long length, long offset) {
+            pthread_mutex_lock(&mutex);
+            int slot = published % buffers.size();
+            lengths[slot] = length;
+            offsets[slot] = offset;
+            refs[slot] = cursors.size();
+            ++published;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        /* wait for the writer's next chunk and return its slot, -1 once everything is written */
+        int acquire(int writer) {
+            pthread_mutex_lock(&mutex);
+            while (cursors[writer] == published && !done) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            int slot = cursors[writer] == published ? -1 : cursors[writer] % buffers.size();
+            pthread_mutex_unlock(&mutex);
+            return slot;
+        }
+
+        /* the writer is done with its chunk, the last one out frees the slot */
+        void release(int writer) {
+            pthread_mutex_lock(&mutex);
+            int slot = cursors[writer] % buffers.size();
+            ++cursors[writer];
+            if (--refs[slot] == 0) {
+                pthread_cond_broadcast(&cond);
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+
+        /* nothing else is coming */
+        void finish() {
+            pthread_mutex_lock(&mutex);
+            done = true;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+        }
+};
+
+/* params for a thread writing one outfile's share of a fan-out ring */
+class fanoutwriterparams
+{
+    public:
+        fanoutring* ring;
+        const int writer;
+        const int outfile;
+        long writeTime;
+        fanoutwriterparams(fanoutring* r, int w, int o) : ring(r), writer(w), outfile(o), writeTime(0) {};
+};
+
+#endif
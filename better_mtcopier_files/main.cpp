@@ -19,9 +19,27 @@ but these timing functions really slow everything down
 #include <sys/types.h>
 #include <chrono>
 #include <functional>
+#include <numeric>
+#include <algorithm>
+#include <cerrno>
+#include <atomic>
+#include <climits>
 
 #include "copierparams.h"
 #include "threadtimes.h"
+#include "resourceusage.h"
+#include "chunkring.h"
+#include "iohints.h"
+#include "durablefile.h"
+#include "bufferpool.h"
+#include "tlbcounter.h"
+#include "placement.h"
+#include "fanoutring.h"
+#include "simdscan.h"
+#include "dedupindex.h"
+#include "changeindex.h"
+#include "blockalign.h"
+#include <filesystem>
 
 /*----CONSTANTS----*/
 /* cmd args position for number of threads*/
@@ -30,13 +48,11 @@ but these timing functions really slow everything down
 #define INFILE_INDX 2
 /* cmd args position for outfile */
 #define OUTFILE_INDX 3
-/* cmd args position for timer flag*/
-#define TIMER_INDEX 4
+/* cmd args position where the optional flags start */
+#define OPTIONS_INDX 4
 /* min number of cmd args */
 #define MIN_NUM_ARGS 4
-/* max number of cmd args*/
-#define MAX_NUM_ARGS 5
-/* num bytes read at a time */
+/* default num bytes read at a time */
 #define READ_CHUNK 32768
 /* value for successful thread create or join*/
 #define THREAD_SUCCESS 0
@@ -44,8 +60,26 @@ but these timing functions really slow everything down
 #define FILE_OPEN_ERR -1
 /* convert nano seconds to ms*/
 #define NANO_PER_MS 1000000
+/* convert nano seconds to s*/
+#define NANO_PER_SEC 1000000000.0
+/* bytes in a GB */
+#define BYTES_PER_GB 1000000000.0
 /* read write access */
 #define READ_WRITE_ACCESS 0644
+/* default number of rotating buffers per thread in overlap mode */
+#define DEFAULT_NUM_BUFFERS 2
+/* number of buffers the streaming reader can get ahead of the writer by */
+#define STREAM_BUFFERS 16
+/* most bytes moved by one splice call */
+#define SPLICE_CHUNK 1048576
+/* default number of chunks the fastest outfile can get ahead of the slowest in fan-out */
+#define DEFAULT_LAG_CHUNKS 8
+/* file name meaning stdin or stdout */
+#define STDIO_NAME "-"
+/* files smaller than this are copied on the main thread without starting any, see ./benchmark.sh --calibrate */
+#define DEFAULT_INLINE_BELOW (256 * 1024L)
+/* least each copier thread gets, smaller files start fewer threads than asked for, see ./benchmark.sh --calibrate */
+#define DEFAULT_BYTES_PER_THREAD (4 * 1024 * 1024L)
 
 /* whether to show the time for each thread */
 //#define SHOW_EACH_THREAD_TIME
@@ -57,6 +91,111 @@ but these timing functions really slow everything down
 bool showTime = false;
 /* keeps track of thread times*/
 threadtimes* threadTimes;
+/* keeps track of what the os charged each thread */
+resourceusage* threadUsage;
+/* whether each thread overlaps its reads with a helper thread's writes */
+bool overlapped = false;
+/* number of rotating buffers each thread uses in overlap mode */
+int numBuffers = DEFAULT_NUM_BUFFERS;
+/* whether to give the kernel readahead and write-behind hints */
+bool useHints = false;
+/* what the hints saw for each thread */
+hintstats* threadHints;
+/* whether to copy into a temp file and only rename it into place once it's on disk */
+bool durable = false;
+/* how long each thread waited for its range to be written back in durable mode */
+long* threadSyncTimes;
+/* num bytes each thread reads at a time */
+long chunkSize = READ_CHUNK;
+/* whether to back the chunk buffers with huge pages */
+bool hugePages = false;
+/* the chunk buffers, a slice per thread */
+bufferpool* buffers;
+/* how the chunk buffers ended up being backed */
+std::string bufferBacking;
+/* which cpus the copier threads run on */
+placement threadPlacement;
+/* every outfile when copying to more than one, empty otherwise */
+std::vector<std::string> fanoutNames;
+/* number of chunks the fastest outfile can get ahead of the slowest */
+int lagChunks = DEFAULT_LAG_CHUNKS;
+/* time each thread spent writing to each outfile, thread major */
+long* fanoutWriteTimes;
+/* time each thread spent waiting for the slowest outfile to free a slot */
+long* fanoutStallTimes;
+/* number of part files to split the infile into, 0 when not splitting */
+int splitParts = 0;
+/* whether to join the infile's part files into the outfile */
+bool joining = false;
+/* the part files being split into or joined from */
+std::vector<std::string> partNames;
+/* the copy for each part, claimed by the part threads in order */
+std::vector<copierparams*> partJobs;
+/* next part job to be claimed */
+std::atomic<long> nextPartJob(0);
+/* bytes in all the parts */
+long partsTotalBytes = 0;
+/* whether to skip writing chunks that are all zeros and leave holes instead */
+bool sparse = false;
+/* bytes of zeros that were never written because of it */
+std::atomic<long> elidedBytes(0);
+/* where the chunk index for --dedup lives, empty when not deduplicating */
+std::string dedupIndexName;
+/* the chunk index for --dedup, nullptr when not deduplicating */
+dedupindex* dedupIndex = nullptr;
+/* the infile's chunks from the index when it hasn't changed since, so it doesn't need reading at all */
+const dedupfile* sourceManifest = nullptr;
+/* the chunks each thread cut its range into */
+std::vector<dedupchunk>* threadChunks;
+/* bytes read from the infile, and the chunks and bytes that came from local copies instead */
+std::atomic<long> sourceBytesRead(0);
+std::atomic<long> dedupedBytes(0);
+std::atomic<long> dedupedChunks(0);
+std::atomic<long> totalDedupChunks(0);
+/* where the change index for --sync lives, empty unless syncing a tree */
+std::string syncIndexName;
+/* the change index, and the source and destination trees */
+changeindex* syncIndex = nullptr;
+std::string syncSource;
+std::string syncTarget;
+/* hash of the two roots, which tree an index entry belongs to */
+chunkhash syncTree;
+/* every regular file under the source, relative to it, and the next one a thread will take */
+std::vector<std::string> syncFiles;
+std::atomic<long> nextSyncFile(0);
+/* what happened to the files */
+std::atomic<long> syncSkipped(0);
+std::atomic<long> syncTouched(0);
+std::atomic<long> syncCopied(0);
+std::atomic<long> syncVanished(0);
+long syncNotRegular = 0;
+/* bytes written into the destination tree, and bytes read only to check a hash */
+std::atomic<long> syncBytesCopied(0);
+std::atomic<long> syncBytesHashed(0);
+/* whether to compare the infile and outfile instead of copying */
+bool comparing = false;
+/* lowest offset any compare thread has found a difference at, LONG_MAX while there's none */
+std::atomic<long> firstDifference(LONG_MAX);
+/* bytes the compare threads got through before finishing or stopping */
+std::atomic<long> bytesCompared(0);
+/* how the copy was done when one side couldn't be seeked, empty if it could */
+std::string streamMode;
+/* bytes moved in streaming mode, since there's no file size to go by */
+long streamedBytes = 0;
+/* threads the streaming copy ran on, splice is just this one, the ring adds a reader */
+int streamThreads = 0;
+/* files below this size are copied inline, 0 never does */
+long inlineBelow = DEFAULT_INLINE_BELOW;
+/* the least bytes worth a copier thread of their own */
+long bytesPerThread = DEFAULT_BYTES_PER_THREAD;
+/* how many copier threads the file got, 0 if it was copied inline */
+int copyWorkers = -1;
+/* how the inline copy moved the bytes, empty if it wasn't inline */
+std::string inlineMode;
+/* whether to split the file at any byte instead of on block boundaries */
+bool unaligned = false;
+/* what the copier threads' ranges start on */
+blockalignment partitionAlign;
 
 /* used to time functions */
 std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
@@ -67,6 +206,24 @@ std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
     return duration;
 }
 
+/* parse a byte count with an optional K, M or G suffix */
+long parseByteSize(const std::string& str) {
+    size_t end = 0;
+    long bytes = std::stol(str, &end);
+    if (end < str.size()) {
+        if (end + 1 != str.size()) {
+            throw std::invalid_argument(str);
+        }
+        switch (str[end]) {
+            case 'K': case 'k': bytes *= 1024L; break;
+            case 'M': case 'm': bytes *= 1024L * 1024L; break;
+            case 'G': case 'g': bytes *= 1024L * 1024L * 1024L; break;
+            default: throw std::invalid_argument(str);
+        }
+    }
+    return bytes;
+}
+
 /* function which is used to hopefully get a file's size */
 long getFileSize(const char* fileName) {
     struct stat st;
@@ -97,6 +254,396 @@ int slowestThread(threadtimes* threadTimes, int len) {
     return indx;
 }
 
+/* lower the first difference to offset unless another thread already found one before it */
+void recordDifference(long offset) {
+    long current = firstDifference;
+    while (offset < current && !firstDifference.compare_exchange_weak(current, offset)) {
+    }
+}
+
+/*
+* runner for each thread to compare its range of the infile and outfile
+* gives up as soon as any thread has found a difference before where it's up to,
+* since nothing it could find would be the first one any more
+*/
+void* compareThread(void* arg) {
+    copierparams* params = (copierparams*) arg;
+
+    int infile = open(params->infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open infile!";
+        throw std::runtime_error(errMsg);
+    }
+    int outfile = open(params->outfileName, O_RDONLY);
+    if (outfile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open outfile!";
+        throw std::runtime_error(errMsg);
+    }
+
+    /* two chunks from this thread's slice, one per file */
+    char* first = buffers->slice(params->id);
+    char* second = first + chunkSize;
+    if (threadPlacement.active()) {
+        buffers->touch(params->id);
+    }
+
+    long compared = 0;
+    for (long b = 0; b < params->bytes && firstDifference > params->position + b; b += chunkSize) {
+        long length = std::min(chunkSize, params->bytes - b);
+        long offset = params->position + b;
+
+        long gotFirst = 0;
+        long gotSecond = 0;
+        while (gotFirst < length) {
+            ssize_t got = pread(infile, first + gotFirst, length - gotFirst, offset + gotFirst);
+            if (got <= 0) {
+                break;
+            }
+            gotFirst += got;
+        }
+        while (gotSecond < length) {
+            ssize_t got = pread(outfile, second + gotSecond, length - gotSecond, offset + gotSecond);
+            if (got <= 0) {
+                break;
+            }
+            gotSecond += got;
+        }
+
+        long mismatch = firstMismatch(first, second, std::min(gotFirst, gotSecond));
+        compared += std::min(gotFirst, gotSecond);
+        if (mismatch >= 0) {
+            recordDifference(offset + mismatch);
+            break;
+        }
+        /* one of them got shorter while we were comparing */
+        if (gotFirst != gotSecond) {
+            recordDifference(offset + std::min(gotFirst, gotSecond));
+            break;
+        }
+    }
+    bytesCompared += compared;
+
+    threadUsage[params->id] = resourceusage::ofThread();
+
+    close(infile);
+    close(outfile);
+    delete params;
+    return nullptr;
+}
+
+/* copy length bytes between two files, through buffer when the kernel can't do it for us */
+bool copyRange(int from, long fromOffset, int to, long toOffset, long length, char* buffer, long bufferSize) {
+    loff_t in = fromOffset;
+    loff_t out = toOffset;
+    long left = length;
+    while (left > 0) {
+        ssize_t copied = copy_file_range(from, &in, to, &out, left, 0);
+        if (copied <= 0) {
+            break;
+        }
+        left -= copied;
+    }
+    while (left > 0 && buffer != nullptr) {
+        ssize_t got = pread(from, buffer, std::min(left, bufferSize), in);
+        if (got <= 0 || pwrite(to, buffer, got, out) != got) {
+            return false;
+        }
+        in += got;
+        out += got;
+        left -= got;
+    }
+    return left == 0;
+}
+
+/* 
+* put a chunk in place from a local file that already has it, reflinked where the filesystem can
+* false if no file has it, then it has to come from the infile
+*/
+bool copyChunkLocally(const dedupchunk& chunk, int outfile, std::unordered_map<int, int>& providers) {
+    auto location = dedupIndex->locations.find(chunk.hash);
+    if (location == dedupIndex->locations.end()) {
+        return false;
+    }
+    int f = location->second.first;
+    const dedupchunk& found = dedupIndex->files[f].chunks[location->second.second];
+    if (found.length != chunk.length) {
+        return false;
+    }
+    if (providers.count(f) == 0) {
+        providers[f] = open(dedupIndex->files[f].path.c_str(), O_RDONLY);
+    }
+    return providers[f] != FILE_OPEN_ERR && copyRange(providers[f], found.offset, outfile, chunk.offset, chunk.length, nullptr, 0);
+}
+
+/*
+* runner for each thread to copy its range chunk by content-defined chunk
+* chunks the index already knows are copied from the local file that has them, the rest are written
+* from what was read, and if the infile hasn't changed since it was last chunked its chunks come
+* straight from the index without reading it
+*/
+void* dedupThread(void* arg) {
+    copierparams* params = (copierparams*) arg;
+
+    int infile = open(params->infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open infile!";
+        throw std::runtime_error(errMsg);
+    }
+    int outfile = open(params->outfileName, O_WRONLY|O_CREAT, READ_WRITE_ACCESS);
+    if (outfile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open outfile!";
+        throw std::runtime_error(errMsg);
+    }
+
+    char* window = buffers->slice(params->id);
+    if (threadPlacement.active()) {
+        buffers->touch(params->id);
+    }
+
+    /* descriptors for the local files chunks come from, opened as they're needed */
+    std::unordered_map<int, int> providers;
+    std::vector<dedupchunk>& chunks = threadChunks[params->id];
+    long end = params->position + params->bytes;
+    long read = 0;
+    long deduped = 0;
+    long dedupedCount = 0;
+
+    if (sourceManifest != nullptr) {
+        /* the chunks starting in this thread's range */
+        for (const dedupchunk& chunk : sourceManifest->chunks) {
+            if (chunk.offset < params->position || chunk.offset >= end) {
+                continue;
+            }
+            chunks.push_back(chunk);
+            if (copyChunkLocally(chunk, outfile, providers)) {
+                deduped += chunk.length;
+                ++dedupedCount;
+            } else {
+                std::ignore = copyRange(infile, chunk.offset, outfile, chunk.offset, chunk.length, window, DEDUP_WINDOW);
+                read += chunk.length;
+            }
+        }
+    } else {
+        /* window[cursor] is at offset in the infile, and filled bytes of the window hold data */
+        long offset = params->position;
+        long cursor = 0;
+        long filled = 0;
+        while (offset < end) {
+            /* keep a whole max chunk ahead of the cursor unless the range runs out first */
+            if (filled - cursor < DEDUP_MAX_CHUNK && offset + filled - cursor < end) {
+                std::memmove(window, window + cursor, filled - cursor);
+                filled -= cursor;
+                cursor = 0;
+                long want = std::min(DEDUP_WINDOW - filled, end - offset - filled);
+                while (want > 0) {
+                    ssize_t got = pread(infile, window + filled, want, offset + filled);
+                    if (got <= 0) {
+                        break;
+                    }
+                    filled += got;
+                    want -= got;
+                    read += got;
+                }
+            }
+            /* the infile got shorter under us */
+            if (filled == cursor) {
+                break;
+            }
+
+            long length = gearchunker::cut(window + cursor, filled - cursor);
+            dedupchunk chunk(chunkhash::of(window + cursor, length), offset, length);
+            chunks.push_back(chunk);
+            if (copyChunkLocally(chunk, outfile, providers)) {
+                deduped += length;
+                ++dedupedCount;
+            } else {
+                std::ignore = pwrite(outfile, window + cursor, length, offset);
+            }
+            cursor += length;
+            offset += length;
+        }
+    }
+
+    sourceBytesRead += read;
+    dedupedBytes += deduped;
+    dedupedChunks += dedupedCount;
+    totalDedupChunks += chunks.size();
+
+    threadUsage[params->id] = resourceusage::ofThread();
+
+    for (auto& provider : providers) {
+        if (provider.second != FILE_OPEN_ERR) {
+            close(provider.second);
+        }
+    }
+    close(infile);
+    close(outfile);
+    delete params;
+    return nullptr;
+}
+
+/* read a whole file through buffer, copying it to outfile as well unless that's FILE_OPEN_ERR */
+chunkhash hashFile(int infile, int outfile, char* buffer, long& bytes) {
+    contenthasher hasher;
+    bytes = 0;
+    ssize_t got;
+    while ((got = read(infile, buffer, chunkSize)) > 0) {
+        hasher.update(buffer, got);
+        if (outfile != FILE_OPEN_ERR && write(outfile, buffer, got) != got) {
+            throw std::runtime_error("hashFile: could not write");
+        }
+        bytes += got;
+    }
+    return hasher.finish();
+}
+
+/*
+* runner for each thread to sync files from the source tree, a file at a time
+* a file whose inode, size and mtime match the index and whose copy is still there is skipped
+* without being read, one that only has a new mtime or inode is hashed and skipped if the
+* content hasn't changed, everything else is copied and hashed on the way through
+*/
+void* syncThread(void* arg) {
+    int* id = (int*) arg;
+    char* buffer = buffers->slice(*id);
+    if (threadPlacement.active()) {
+        buffers->touch(*id);
+    }
+
+    for (long job = nextSyncFile++; job < (long) syncFiles.size(); job = nextSyncFile++) {
+        std::string source = syncSource + "/" + syncFiles[job];
+        std::string target = syncTarget + "/" + syncFiles[job];
+
+        struct stat sourceStat;
+        if (stat(source.c_str(), &sourceStat) != 0) {
+            ++syncVanished;
+            continue;
+        }
+        std::string paths = source + '\0' + target;
+        chunkhash key = chunkhash::of(paths.c_str(), paths.size());
+        changeentry* known = syncIndex->find(key);
+        if (known != nullptr) {
+            syncIndex->keep(known);
+        }
+
+        changeentry entry;
+        entry.keyHigh = key.high;
+        entry.keyLow = key.low;
+        entry.treeHigh = syncTree.high;
+        entry.treeLow = syncTree.low;
+        entry.inode = sourceStat.st_ino;
+        entry.size = sourceStat.st_size;
+        entry.mtime = dedupfile::mtimeOf(sourceStat);
+
+        /* the copy has to still be there for the index to count for anything */
+        struct stat targetStat;
+        bool targetIntact = known != nullptr && stat(target.c_str(), &targetStat) == 0 && targetStat.st_size == sourceStat.st_size;
+        if (targetIntact && known->inode == entry.inode && known->size == entry.size && known->mtime == entry.mtime) {
+            ++syncSkipped;
+            continue;
+        }
+
+        int infile = open(source.c_str(), O_RDONLY);
+        if (infile == FILE_OPEN_ERR) {
+            ++syncVanished;
+            continue;
+        }
+
+        /* same size as last time, so it might only have been touched */
+        long bytes = 0;
+        if (targetIntact && known->size == entry.size) {
+            chunkhash content = hashFile(infile, FILE_OPEN_ERR, buffer, bytes);
+            syncBytesHashed += bytes;
+            if (content.high == known->contentHigh && content.low == known->contentLow) {
+                entry.contentHigh = content.high;
+                entry.contentLow = content.low;
+                syncIndex->record(known, entry);
+                ++syncTouched;
+                close(infile);
+                continue;
+            }
+            lseek(infile, 0, SEEK_SET);
+        }
+
+        int outfile = open(target.c_str(), O_WRONLY|O_CREAT|O_TRUNC, READ_WRITE_ACCESS);
+        if (outfile == FILE_OPEN_ERR) {
+            throw std::runtime_error("syncThread: could not open " + target);
+        }
+        chunkhash content = hashFile(infile, outfile, buffer, bytes);
+        close(infile);
+        close(outfile);
+
+        entry.contentHigh = content.high;
+        entry.contentLow = content.low;
+        syncIndex->record(known, entry);
+        syncBytesCopied += bytes;
+        ++syncCopied;
+    }
+
+    threadUsage[*id] = resourceusage::ofThread();
+
+    delete id;
+    return nullptr;
+}
+
+/*
+* sync the source tree into the destination tree
+* the tree is walked up front (making the directories as it goes), then the threads
+* take a file at a time, so the stats and the reads of changed files run in parallel
+*/
+void startSyncThreads(int numThreads, const char* sourceName, const char* targetName)
+{
+    const std::string threadCreateErrMsg = "could not create thread";
+    const std::string threadJoinErrMsg = "could not join thread";
+
+    /* canonical roots, so src, ./src and src/ all find the same entries */
+    std::filesystem::create_directories(targetName);
+    syncSource = dedupindex::canonical(sourceName);
+    syncTarget = dedupindex::canonical(targetName);
+    std::string roots = syncSource + '\0' + syncTarget;
+    syncTree = chunkhash::of(roots.c_str(), roots.size());
+    syncIndex = new changeindex(syncIndexName, syncTree);
+
+    /* only regular files and directories are synced, symlinks and the like are counted and left */
+    for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator(syncSource)) {
+        std::string relative = std::filesystem::relative(entry.path(), syncSource).string();
+        if (entry.is_symlink()) {
+            ++syncNotRegular;
+        } else if (entry.is_directory()) {
+            std::filesystem::create_directories(syncTarget + "/" + relative);
+        } else if (entry.is_regular_file()) {
+            syncFiles.push_back(relative);
+        } else {
+            ++syncNotRegular;
+        }
+    }
+
+    buffers = new bufferpool(numThreads, chunkSize, hugePages);
+    bufferBacking = buffers->backing;
+
+    pthread_t threads[numThreads];
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (threadPlacement.active()) {
+            threadPlacement.apply(&attr, i);
+        }
+        if (pthread_create(&threads[i], &attr, &syncThread, new int(i)) != THREAD_SUCCESS) {
+            throw std::runtime_error(threadCreateErrMsg);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for (int i = 0; i < numThreads; ++i) {
+        if (pthread_join(threads[i], nullptr) != THREAD_SUCCESS) {
+            throw std::runtime_error(threadJoinErrMsg);
+        }
+    }
+
+    syncIndex->save();
+    delete buffers;
+}
+
 /* runner for each thread to copy a file's contents */
 void* copierThread(void* arg) {
     #ifdef SHOW_OTHER_TIMES
@@ -108,8 +655,11 @@ void* copierThread(void* arg) {
     /* cast the arg pointer so we can now have an easier time accessing stuff*/
     copierparams* params = (copierparams*) arg;
 
-    /* the buffer to store the characters */
-    char buffer[READ_CHUNK];
+    /* the buffer to store the characters, this thread's slice of the pool */
+    char* buffer = buffers->slice(params->id);
+    if (threadPlacement.active()) {
+        buffers->touch(params->id);
+    }
 
     /* open the infile in read only */
     int infile = open(params->infileName, O_RDONLY);
@@ -134,15 +684,21 @@ void* copierThread(void* arg) {
     * where the chunk of text is going to be read and written from
     */
     lseek(infile, params->position, SEEK_SET);
-    lseek(outfile, params->position, SEEK_SET);
+    lseek(outfile, params->outPosition, SEEK_SET);
+
+    iohints* hints = useHints ? new iohints(infile, outfile, params->position, params->bytes) : nullptr;
+
+    /* the run of zero chunks skipped since the last write, punched out in one go once it ends */
+    long holeStart = params->outPosition;
+    long holeLength = 0;
     
     /* loop through the bytes and perform the copy */
-    for (long b = 0; b < params->bytes; b += READ_CHUNK) {
+    for (long b = 0; b < params->bytes; b += chunkSize) {
         /* read a chunk from the infile and put it in the buffer */
         #ifdef SHOW_OTHER_TIMES
         totalReadTime += timeFunction([infile, &buffer]{
         #endif
-            std::ignore = read(infile, buffer, READ_CHUNK); 
+            std::ignore = read(infile, buffer, chunkSize); 
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
@@ -150,63 +706,713 @@ void* copierThread(void* arg) {
         * make sure a we don't take the entire last chunk
         * just in case if a bit of the last chunk is assigned for another thread
         */
-        long length = READ_CHUNK;
-        if (b + READ_CHUNK > params->bytes) {
+        long length = chunkSize;
+        if (b + chunkSize > params->bytes) {
             length = params->bytes - b;
         }
-        /* write to the output file */
+
+        /* 
+        * step over zeros instead of writing them, a truncated outfile is already a hole there
+        * and a preallocated one gets the run punched out when it ends
+        */
+        if (sparse && allZero(buffer, length)) {
+            if (holeLength == 0) {
+                holeStart = params->outPosition + b;
+            }
+            holeLength += length;
+            lseek(outfile, length, SEEK_CUR);
+        } else {
+            if (holeLength > 0) {
+                std::ignore = fallocate(outfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, holeStart, holeLength);
+                elidedBytes += holeLength;
+                holeLength = 0;
+            }
+
+            /* write to the output file */
+            #ifdef SHOW_OTHER_TIMES
+            totalWriteTime += timeFunction([outfile, length, &buffer]{
+            #endif
+                std::ignore = write(outfile, buffer, length); 
+            #ifdef SHOW_OTHER_TIMES
+            }).count();
+            #endif
+        }
+
+        if (hints != nullptr) {
+            hints->afterRead(params->position + b + length);
+            hints->afterWrite(params->position + b + length);
+        }
+    }
+
+    if (holeLength > 0) {
+        std::ignore = fallocate(outfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, holeStart, holeLength);
+        elidedBytes += holeLength;
+    }
+
+    if (hints != nullptr) {
+        hints->finish();
+        threadHints[params->id] = hints->stats;
+        delete hints;
+    }
+
+    #ifdef SHOW_OTHER_TIMES
+    long totalTime = totalReadTime + totalWriteTime;
+
+    /* set the time for the corresponding thread (a thread can copy several parts, so add to it) */
+    threadTimes[params->id].readTime += totalReadTime;
+    threadTimes[params->id].writeTime += totalWriteTime;
+    threadTimes[params->id].totalTime += totalTime;
+    #endif
+
+    /* flush this thread's range now so the final fdatasync has little left to do */
+    if (durable) {
+        threadSyncTimes[params->id] += durablefile::syncRange(outfile, params->outPosition, params->bytes);
+    }
+
+    /* record the os accounting for this thread before it exits */
+    threadUsage[params->id] = resourceusage::ofThread();
+
+    /* don't forget to close the files */
+    close(infile);
+    close(outfile);
+    /* don't forget to clear memory*/
+    delete params;
+    /* exit */
+    return nullptr;
+}
+
+/* helper for an overlapped copier thread, writes out the ring's chunks as they fill */
+void* ringWriterThread(void* arg) {
+    ringwriterparams* params = (ringwriterparams*) arg;
+    chunkring* ring = params->ring;
+
+    for (int slot = ring->acquireFilled(); slot != -1; slot = ring->acquireFilled()) {
         #ifdef SHOW_OTHER_TIMES
-        totalWriteTime += timeFunction([outfile, length, &buffer]{
+        params->writeTime += timeFunction([ring, slot, params]{
         #endif
-            std::ignore = write(outfile, buffer, length); 
+            /* keep going on short writes so the chunk lands whole */
+            long done = 0;
+            while (done < ring->lengths[slot]) {
+                ssize_t written = pwrite(params->outfile, ring->buffers[slot] + done,
+                    ring->lengths[slot] - done, ring->offsets[slot] + done);
+                if (written <= 0) {
+                    break;
+                }
+                done += written;
+            }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
+        /* the slot can be refilled as soon as it's released, so note where it ended first */
+        long end = ring->offsets[slot] + ring->lengths[slot];
+        ring->release();
+        if (params->hints != nullptr) {
+            params->hints->afterWrite(end);
+        }
     }
 
+    return nullptr;
+}
+
+/*
+* runner for each thread to copy a file's contents with its reads and writes overlapped
+* this thread reads into a ring of buffers while a helper thread writes them out,
+* so the next read is in flight while the previous chunk is being written
+*/
+void* overlappedCopierThread(void* arg) {
+    const std::string threadCreateErrMsg = "could not create thread";
+    const std::string threadJoinErrMsg = "could not join thread";
+
     #ifdef SHOW_OTHER_TIMES
-    long totalTime = totalReadTime + totalWriteTime;
+    long totalReadTime = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    #endif
+
+    copierparams* params = (copierparams*) arg;
+
+    int infile = open(params->infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open infile!";
+        throw std::runtime_error(errMsg);
+    }
+
+    int outfile = open(params->outfileName, O_WRONLY|O_CREAT, READ_WRITE_ACCESS);
+    if (outfile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open outfile!";
+        throw std::runtime_error(errMsg);
+    }
+
+    if (threadPlacement.active()) {
+        buffers->touch(params->id);
+    }
+    chunkring ring(numBuffers, chunkSize, buffers->slice(params->id));
+    iohints* hints = useHints ? new iohints(infile, outfile, params->position, params->bytes) : nullptr;
+    ringwriterparams writerParams(&ring, outfile, hints);
+
+    pthread_t writer;
+    if (pthread_create(&writer, nullptr, &ringWriterThread, &writerParams) != THREAD_SUCCESS) {
+        throw std::runtime_error(threadCreateErrMsg);
+    }
+
+    /* positional reads so the helper's writes never move our offset */
+    for (long b = 0; b < params->bytes; b += chunkSize) {
+        long length = chunkSize;
+        if (b + chunkSize > params->bytes) {
+            length = params->bytes - b;
+        }
+        long offset = params->position + b;
+
+        int slot = ring.acquireEmpty();
+        long done = 0;
+        #ifdef SHOW_OTHER_TIMES
+        totalReadTime += timeFunction([infile, &ring, slot, length, offset, &done]{
+        #endif
+            while (done < length) {
+                ssize_t got = pread(infile, ring.buffers[slot] + done, length - done, offset + done);
+                if (got <= 0) {
+                    break;
+                }
+                done += got;
+            }
+        #ifdef SHOW_OTHER_TIMES
+        }).count();
+        #endif
+        ring.publish(done, params->outPosition + b);
+        if (hints != nullptr) {
+            hints->afterRead(offset + done);
+        }
+    }
+
+    ring.finish();
+    if (pthread_join(writer, nullptr) != THREAD_SUCCESS) {
+        throw std::runtime_error(threadJoinErrMsg);
+    }
 
-    /* set the time for the corresponding thread */
-    threadTimes[params->id].readTime = totalReadTime;
-    threadTimes[params->id].writeTime = totalWriteTime;
-    threadTimes[params->id].totalTime = totalTime;
+    if (hints != nullptr) {
+        hints->finish();
+        threadHints[params->id] = hints->stats;
+        delete hints;
+    }
+
+    #ifdef SHOW_OTHER_TIMES
+    /* total is wall time here, so whatever read + write exceeds it by ran at the same time */
+    long totalTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now() - start).count();
+    threadTimes[params->id].readTime += totalReadTime;
+    threadTimes[params->id].writeTime += writerParams.writeTime;
+    threadTimes[params->id].totalTime += totalTime;
+    threadTimes[params->id].overlapTime += std::max(0L, totalReadTime + writerParams.writeTime - totalTime);
     #endif
 
-    /* don't forget to close the files */
+    if (durable) {
+        threadSyncTimes[params->id] += durablefile::syncRange(outfile, params->outPosition, params->bytes);
+    }
+
+    /* helper's usage is left out, it isn't this thread */
+    threadUsage[params->id] = resourceusage::ofThread();
+
     close(infile);
     close(outfile);
-    /* don't forget to clear memory*/
     delete params;
-    /* exit */
     return nullptr;
 }
 
+/* writes one outfile's copy of every chunk in a fan-out ring */
+void* fanoutWriterThread(void* arg) {
+    fanoutwriterparams* params = (fanoutwriterparams*) arg;
+    fanoutring* ring = params->ring;
+
+    for (int slot = ring->acquire(params->writer); slot != -1; slot = ring->acquire(params->writer)) {
+        /* one clock read per chunk per outfile is cheap enough to always keep */
+        params->writeTime += timeFunction([ring, slot, params]{
+            long done = 0;
+            while (done < ring->lengths[slot]) {
+                ssize_t written = pwrite(params->outfile, ring->buffers[slot] + done,
+                    ring->lengths[slot] - done, ring->offsets[slot] + done);
+                if (written <= 0) {
+                    break;
+                }
+                done += written;
+            }
+        }).count();
+        ring->release(params->writer);
+    }
+
+    return nullptr;
+}
+
+/*
+* runner for each thread when there is more than one outfile
+* its range is read once into a ring and a writer per outfile writes it out,
+* so a slow outfile only holds the others up once it's a whole ring behind
+*/
+void* fanoutCopierThread(void* arg) {
+    const std::string threadCreateErrMsg = "could not create thread";
+    const std::string threadJoinErrMsg = "could not join thread";
+
+    copierparams* params = (copierparams*) arg;
+    int numOutfiles = fanoutNames.size();
+
+    int infile = open(params->infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        const std::string errMsg = "Could not open infile!";
+        throw std::runtime_error(errMsg);
+    }
+
+    std::vector<int> outfiles(numOutfiles);
+    for (int d = 0; d < numOutfiles; ++d) {
+        outfiles[d] = open(fanoutNames[d].c_str(), O_WRONLY|O_CREAT, READ_WRITE_ACCESS);
+        if (outfiles[d] == FILE_OPEN_ERR) {
+            const std::string errMsg = "Could not open outfile " + fanoutNames[d] + "!";
+            throw std::runtime_error(errMsg);
+        }
+    }
+
+    if (threadPlacement.active()) {
+        buffers->touch(params->id);
+    }
+    fanoutring ring(lagChunks, chunkSize, numOutfiles, buffers->slice(params->id));
+
+    std::vector<fanoutwriterparams*> writerParams(numOutfiles);
+    std::vector<pthread_t> writers(numOutfiles);
+    for (int d = 0; d < numOutfiles; ++d) {
+        writerParams[d] = new fanoutwriterparams(&ring, d, outfiles[d]);
+        if (pthread_create(&writers[d], nullptr, &fanoutWriterThread, writerParams[d]) != THREAD_SUCCESS) {
+            throw std::runtime_error(threadCreateErrMsg);
+        }
+    }
+
+    long stallTime = 0;
+    for (long b = 0; b < params->bytes; b += chunkSize) {
+        long length = chunkSize;
+        if (b + chunkSize > params->bytes) {
+            length = params->bytes - b;
+        }
+        long offset = params->position + b;
+
+        int slot;
+        stallTime += timeFunction([&ring, &slot]{
+            slot = ring.acquireFree();
+        }).count();
+
+        long done = 0;
+        while (done < length) {
+            ssize_t got = pread(infile, ring.buffers[slot] + done, length - done, offset + done);
+            if (got <= 0) {
+                break;
+            }
+            done += got;
+        }
+        ring.publish(done, offset);
+    }
+
+    ring.finish();
+    for (int d = 0; d < numOutfiles; ++d) {
+        if (pthread_join(writers[d], nullptr) != THREAD_SUCCESS) {
+            throw std::runtime_error(threadJoinErrMsg);
+        }
+        fanoutWriteTimes[params->id * numOutfiles + d] = writerParams[d]->writeTime;
+        delete writerParams[d];
+    }
+    fanoutStallTimes[params->id] = stallTime;
+
+    if (durable) {
+        for (int d = 0; d < numOutfiles; ++d) {
+            threadSyncTimes[params->id] += durablefile::syncRange(outfiles[d], params->position, params->bytes);
+        }
+    }
+
+    threadUsage[params->id] = resourceusage::ofThread();
+
+    close(infile);
+    for (int outfile : outfiles) {
+        close(outfile);
+    }
+    delete params;
+    return nullptr;
+}
+
+/* whether a name is stdin/stdout or something other than a regular file (pipe, socket, tty...) */
+bool isStream(const char* fileName) {
+    if (std::string(fileName) == STDIO_NAME) {
+        return true;
+    }
+    struct stat st;
+    return stat(fileName, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+/* whether a descriptor is a pipe, so splice can use it directly */
+bool isPipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* 
+* move everything from infile to outfile inside the kernel
+* returns false without moving anything if splice can't handle this pair
+*/
+bool spliceCopy(int infile, int outfile) {
+    while (true) {
+        ssize_t moved = splice(infile, nullptr, outfile, nullptr, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved == 0) {
+            return true;
+        }
+        if (moved < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (streamedBytes == 0 && errno == EINVAL) {
+                return false;
+            }
+            throw std::runtime_error("spliceCopy: splice failed");
+        }
+        streamedBytes += moved;
+    }
+}
+
+/* params for the streaming reader */
+class streamparams
+{
+    public:
+        chunkring* ring;
+        const int infile;
+        streamparams(chunkring* r, int i) : ring(r), infile(i) {};
+};
+
+/* reads ahead into the ring in order until end of input */
+void* streamReaderThread(void* arg) {
+    streamparams* params = (streamparams*) arg;
+    chunkring* ring = params->ring;
+
+    while (true) {
+        int slot = ring->acquireEmpty();
+        ssize_t len = read(params->infile, ring->buffers[slot], READ_CHUNK);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            break;
+        }
+        ring->publish(len, 0);
+    }
+    ring->finish();
+
+    return nullptr;
+}
+
+/*
+* copy when either side can't be seeked so it can't be split between threads
+* splice when one side is a pipe, otherwise one thread reads ahead while this one writes behind
+*/
+void streamCopy(const char* infileName, const char* outfileName) {
+    bool stdinUsed = std::string(infileName) == STDIO_NAME;
+    bool stdoutUsed = std::string(outfileName) == STDIO_NAME;
+
+    int infile = stdinUsed ? STDIN_FILENO : open(infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        throw std::runtime_error("streamCopy: could not open infile");
+    }
+
+    int outfile = stdoutUsed ? STDOUT_FILENO : open(outfileName, O_WRONLY|O_CREAT|O_TRUNC, READ_WRITE_ACCESS);
+    if (outfile == FILE_OPEN_ERR) {
+        throw std::runtime_error("streamCopy: could not open outfile");
+    }
+
+    if ((isPipe(infile) || isPipe(outfile)) && spliceCopy(infile, outfile)) {
+        streamMode = "splice";
+        streamThreads = 1;
+    } else {
+        streamMode = "read-ahead ring";
+        streamThreads = 2;
+        chunkring ring(STREAM_BUFFERS, READ_CHUNK);
+        streamparams params(&ring, infile);
+
+        pthread_t reader;
+        if (pthread_create(&reader, nullptr, &streamReaderThread, &params) != THREAD_SUCCESS) {
+            throw std::runtime_error("streamCopy: could not create thread");
+        }
+
+        for (int slot = ring.acquireFilled(); slot != -1; slot = ring.acquireFilled()) {
+            /* keep going on short writes, pipes and sockets take what they can */
+            long done = 0;
+            while (done < ring.lengths[slot]) {
+                ssize_t written = write(outfile, ring.buffers[slot] + done, ring.lengths[slot] - done);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    throw std::runtime_error("streamCopy: could not write to outfile");
+                }
+                done += written;
+            }
+            streamedBytes += done;
+            ring.release();
+        }
+
+        if (pthread_join(reader, nullptr) != THREAD_SUCCESS) {
+            throw std::runtime_error("streamCopy: could not join thread");
+        }
+    }
+
+    if (!stdinUsed) {
+        close(infile);
+    }
+    if (!stdoutUsed) {
+        close(outfile);
+    }
+}
+
+/* 
+* the range of a file of size bytes which part i of numParts covers, the last part takes the remainder
+* every range starts on partitionAlign, so a file too small for that many whole blocks each
+* gives the first parts a block and leaves the rest empty
+*/
+void partitionRange(long size, int numParts, int i, long& position, long& bytes) {
+    long bytesPerPart = std::max(size / numParts / partitionAlign.bytes, 1L) * partitionAlign.bytes;
+    position = std::min(i * bytesPerPart, size);
+    bytes = (i == numParts - 1) ? size - position : std::min(bytesPerPart, size - position);
+}
+
+/* pick the boundary the ranges start on, and make each thread's chunks a whole number of blocks so they stay on it */
+void alignPartitions(const char* infileName, const char* outfileName, long size, int numParts) {
+    if (unaligned) {
+        return;
+    }
+    partitionAlign = blockalignment::of(infileName, outfileName, size, numParts);
+    chunkSize = partitionAlign.roundUpToBlock(chunkSize);
+}
+
+/* name of part i, numbered like split does so they sort and glob in order */
+std::string partName(const std::string& prefix, int i) {
+    std::string number = std::to_string(i);
+    return prefix + "." + std::string(number.size() < 3 ? 3 - number.size() : 0, '0') + number;
+}
+
+/* 
+* runner for the split and join threads
+* keeps claiming the next part and copying it with the copier thread runner,
+* using this thread's id so its buffers and stats are its own
+*/
+void* partThread(void* arg) {
+    int* id = (int*) arg;
+    void* (*runner)(void*) = overlapped ? &overlappedCopierThread : &copierThread;
+
+    for (long job = nextPartJob++; job < (long) partJobs.size(); job = nextPartJob++) {
+        copierparams* part = partJobs[job];
+        runner(new copierparams(*id, part->infileName, part->outfileName, part->position, part->bytes, part->outPosition));
+    }
+
+    delete id;
+    return nullptr;
+}
+
+/*
+* split the infile into part files or join the infile's part files into the outfile
+* the parts are laid out with the same partitioner the copier threads use,
+* and every part is its own file so no thread shares an output descriptor when splitting
+*/
+void startPartThreads(int numThreads, const char* infileName, const char* outfileName)
+{
+    const std::string threadCreateErrMsg = "could not create thread";
+    const std::string threadJoinErrMsg = "could not join thread";
+
+    if (splitParts > 0) {
+        long infileSize = getFileSize(infileName);
+        if (infileSize < 0) {
+            throw std::runtime_error("startPartThreads: could not stat infile");
+        }
+        for (int i = 0; i < splitParts; ++i) {
+            partNames.push_back(partName(outfileName, i));
+        }
+        alignPartitions(infileName, partNames[0].c_str(), infileSize, splitParts);
+        for (int i = 0; i < splitParts; ++i) {
+            long position, bytes;
+            partitionRange(infileSize, splitParts, i, position, bytes);
+            clearFile(partNames[i].c_str());
+            partJobs.push_back(new copierparams(i, infileName, partNames[i].c_str(), position, bytes, 0));
+        }
+        partsTotalBytes = infileSize;
+    } else {
+        /* every part that exists, laid end to end */
+        for (int i = 0; getFileSize(partName(infileName, i).c_str()) >= 0; ++i) {
+            partNames.push_back(partName(infileName, i));
+        }
+        if (partNames.empty()) {
+            throw std::runtime_error("startPartThreads: no parts found for " + std::string(infileName));
+        }
+        for (int i = 0; i < (int) partNames.size(); ++i) {
+            long bytes = getFileSize(partNames[i].c_str());
+            partJobs.push_back(new copierparams(i, partNames[i].c_str(), outfileName, 0, bytes, partsTotalBytes));
+            partsTotalBytes += bytes;
+        }
+
+        /* size the outfile up front so the parallel writes don't keep growing it */
+        int outfile = open(outfileName, O_WRONLY|O_CREAT|O_TRUNC, READ_WRITE_ACCESS);
+        if (outfile == FILE_OPEN_ERR) {
+            throw std::runtime_error("startPartThreads: could not open outfile");
+        }
+        if (partsTotalBytes > 0 && posix_fallocate(outfile, 0, partsTotalBytes) != 0) {
+            std::ignore = ftruncate(outfile, partsTotalBytes);
+        }
+        close(outfile);
+    }
+
+    int chunksPerThread = overlapped ? numBuffers : 1;
+    buffers = new bufferpool(numThreads, chunkSize * chunksPerThread, hugePages);
+    bufferBacking = buffers->backing;
+
+    pthread_t threads[numThreads];
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (threadPlacement.active()) {
+            threadPlacement.apply(&attr, i);
+        }
+        if (pthread_create(&threads[i], &attr, &partThread, new int(i)) != THREAD_SUCCESS) {
+            throw std::runtime_error(threadCreateErrMsg);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for (int i = 0; i < numThreads; ++i) {
+        if (pthread_join(threads[i], nullptr) != THREAD_SUCCESS) {
+            throw std::runtime_error(threadJoinErrMsg);
+        }
+    }
+
+    for (copierparams* part : partJobs) {
+        /* a part that ended in zeros was never written that far */
+        if (sparse && splitParts > 0 && getFileSize(part->outfileName) < part->bytes) {
+            std::ignore = truncate(part->outfileName, part->bytes);
+        }
+        delete part;
+    }
+    delete buffers;
+}
+
+/* 
+* copy a small file on the calling thread, in one copy_file_range if the filesystems allow it
+* or a plain read and write otherwise, so a 1K file doesn't pay for starting threads
+*/
+void inlineCopy(const char* infileName, const char* outfileName, long size) {
+    int infile = open(infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        throw std::runtime_error("inlineCopy: could not open infile");
+    }
+    int outfile = open(outfileName, O_WRONLY|O_CREAT|O_TRUNC, READ_WRITE_ACCESS);
+    if (outfile == FILE_OPEN_ERR) {
+        close(infile);
+        throw std::runtime_error("inlineCopy: could not open outfile");
+    }
+
+    loff_t in = 0;
+    loff_t out = 0;
+    long left = size;
+    while (left > 0) {
+        ssize_t copied = copy_file_range(infile, &in, outfile, &out, left, 0);
+        if (copied <= 0) {
+            break;
+        }
+        left -= copied;
+    }
+    inlineMode = "copy_file_range";
+
+    /* copy_file_range can't go between some filesystems, so finish with a buffer */
+    if (left > 0) {
+        inlineMode = "read/write";
+        std::vector<char> buffer(std::min(left, std::max(chunkSize, inlineBelow)));
+        while (left > 0) {
+            ssize_t got = pread(infile, buffer.data(), std::min(left, (long) buffer.size()), in);
+            if (got <= 0 || pwrite(outfile, buffer.data(), got, out) != got) {
+                close(infile);
+                close(outfile);
+                throw std::runtime_error("inlineCopy: could not copy " + std::string(infileName));
+            }
+            in += got;
+            out += got;
+            left -= got;
+        }
+    }
+
+    close(infile);
+    close(outfile);
+}
+
 /* start the copier threads */
 void startCopierThreads(int numThreads, const char* infileName, const char* outfileName)
 {
     const std::string threadCreateErrMsg = "could not create thread";
     const std::string threadJoinErrMsg = "could not join thread";
 
-    /* copier threads */
-    pthread_t copiers[numThreads];
+    /* can't split what can't be seeked, so stream it in order instead */
+    if (isStream(infileName) || isStream(outfileName)) {
+        streamCopy(infileName, outfileName);
+        return;
+    }
 
     /* get the file size for in file */
     long infileSize = getFileSize(infileName);
-    /* clear the output file */
-    clearFile(outfileName);
-    /* the minimum number of bytes processed for each thread */
-    long bytesPerThread = infileSize / numThreads;
+    if (infileSize < 0) {
+        throw std::runtime_error("startCopierThreads: could not stat infile");
+    }
+
+    /* comparing only goes as far as the shorter file, main reports any difference in size */
+    if (comparing) {
+        long outfileSize = getFileSize(outfileName);
+        if (outfileSize < 0) {
+            throw std::runtime_error("startCopierThreads: could not stat outfile");
+        }
+        infileSize = std::min(infileSize, outfileSize);
+    }
+
+    /* 
+    * small files aren't worth the threads, the plain copy does them inline and everything
+    * else starts a thread per bytesPerThread up to the number asked for
+    */
+    bool plainCopy = !comparing && dedupIndex == nullptr && fanoutNames.empty() && !overlapped && !sparse && !useHints;
+    if (plainCopy && infileSize < inlineBelow) {
+        copyWorkers = 0;
+        inlineCopy(infileName, outfileName, infileSize);
+        return;
+    }
+    numThreads = std::max(1L, std::min((long) numThreads, infileSize / bytesPerThread));
+    copyWorkers = numThreads;
+    alignPartitions(infileName, fanoutNames.empty() ? outfileName : fanoutNames[0].c_str(), infileSize, numThreads);
+
+    /* clear the output files */
+    if (fanoutNames.empty() && !comparing) {
+        clearFile(outfileName);
+    }
+    for (const std::string& name : fanoutNames) {
+        clearFile(name.c_str());
+    }
+    /* one slice of buffers per thread, overlapped and fan-out threads need a chunk for each slot in their ring */
+    int chunksPerThread = comparing ? 2 : !fanoutNames.empty() ? lagChunks : overlapped ? numBuffers : 1;
+    buffers = new bufferpool(numThreads, dedupIndex != nullptr ? DEDUP_WINDOW : chunkSize * chunksPerThread, hugePages);
+    bufferBacking = buffers->backing;
+
+    /* copier threads */
+    pthread_t copiers[numThreads];
 
     for (int i = 0; i < numThreads; ++i)
     {
-        long position = i * bytesPerThread;
-        long bytes = (i == numThreads - 1) ? infileSize - position : bytesPerThread;
+        long position, bytes;
+        partitionRange(infileSize, numThreads, i, position, bytes);
         copierparams* cParams = new copierparams(i, infileName, outfileName, position, bytes);
 
-        if (pthread_create(&copiers[i], nullptr, &copierThread, cParams) != THREAD_SUCCESS) {
+        /* pinned threads start on their cpus, and the overlap helper inherits them */
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (threadPlacement.active()) {
+            threadPlacement.apply(&attr, i);
+        }
+
+        void* (*runner)(void*) = comparing ? &compareThread : dedupIndex != nullptr ? &dedupThread
+            : !fanoutNames.empty() ? &fanoutCopierThread : overlapped ? &overlappedCopierThread : &copierThread;
+        if (pthread_create(&copiers[i], &attr, runner, cParams) != THREAD_SUCCESS) {
             throw std::runtime_error(threadCreateErrMsg);
         }
+        pthread_attr_destroy(&attr);
     }
 
     for (int i = 0; i < numThreads; ++i)
@@ -215,15 +1421,42 @@ void startCopierThreads(int numThreads, const char* infileName, const char* outf
             throw std::runtime_error(threadJoinErrMsg);
         }
     }
+
+    /* 
+    * a file that ends in zeros was never written that far, so size it now the threads are done
+    * (doing it from the threads could cut off a later range another thread had just written)
+    */
+    if (sparse && getFileSize(outfileName) < infileSize) {
+        std::ignore = truncate(outfileName, infileSize);
+    }
+
+    delete buffers;
 }
 
 int main(int argc, char** argv) {
 
-    const std::string cmdErrorMessage = "main: the correct command is: ./better_mtcopier <#threads> <infile> <outfile> <optional -t>";
+    const std::string cmdErrorMessage = "main: the correct command is: ./better_mtcopier <#threads> <infile> <outfile> <optional more outfiles> <optional -t> <optional --overlap> <optional --buffers <#buffers>> <optional --hints> <optional --durable> <optional --chunk <bytes>[K|M|G]> <optional --huge-pages> <optional --cpus <list>|near> <optional --lag <#chunks>> <optional --split <#parts> | --join> <optional --compare> <optional --sparse> <optional --dedup <indexfile>> <optional --sync <indexfile>> <optional --inline-below <bytes>[K|M|G]> <optional --bytes-per-thread <bytes>[K|M|G]> <optional --unaligned> (infile/outfile can be - for stdin/stdout)";
     const std::string timerFlag = "-t";
+    const std::string overlapFlag = "--overlap";
+    const std::string buffersFlag = "--buffers";
+    const std::string hintsFlag = "--hints";
+    const std::string durableFlag = "--durable";
+    const std::string chunkFlag = "--chunk";
+    const std::string hugePagesFlag = "--huge-pages";
+    const std::string cpusFlag = "--cpus";
+    const std::string lagFlag = "--lag";
+    const std::string splitFlag = "--split";
+    const std::string joinFlag = "--join";
+    const std::string compareFlag = "--compare";
+    const std::string sparseFlag = "--sparse";
+    const std::string dedupFlag = "--dedup";
+    const std::string syncFlag = "--sync";
+    const std::string inlineBelowFlag = "--inline-below";
+    const std::string bytesPerThreadFlag = "--bytes-per-thread";
+    const std::string unalignedFlag = "--unaligned";
 
     /* check number of cmd args */
-    if (argc < MIN_NUM_ARGS || argc > MAX_NUM_ARGS) {
+    if (argc < MIN_NUM_ARGS) {
 
         throw std::runtime_error(cmdErrorMessage);
     }
@@ -244,10 +1477,106 @@ int main(int argc, char** argv) {
         throw std::runtime_error("main: thread command argument cannot be below 1");
     }
 
-    /* check if the command has the timer flag*/
-    if (argc == MAX_NUM_ARGS) {
-        if (argv[TIMER_INDEX] == timerFlag) {
+    /* any more outfiles come before the flags */
+    int optionsIndx = OPTIONS_INDX;
+    while (optionsIndx < argc && argv[optionsIndx][0] != '-') {
+        if (fanoutNames.empty()) {
+            fanoutNames.push_back(outfileName);
+        }
+        fanoutNames.push_back(argv[optionsIndx++]);
+    }
+
+    /* check the optional flags */
+    for (int i = optionsIndx; i < argc; ++i) {
+        if (argv[i] == timerFlag) {
             showTime = true;
+        } else if (argv[i] == overlapFlag) {
+            overlapped = true;
+        } else if (argv[i] == hintsFlag) {
+            useHints = true;
+        } else if (argv[i] == durableFlag) {
+            durable = true;
+        } else if (argv[i] == chunkFlag && i + 1 < argc) {
+            try {
+                chunkSize = parseByteSize(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid chunk command argument format");
+            }
+            if (chunkSize < 1) {
+                throw std::runtime_error("main: chunk command argument cannot be below 1");
+            }
+        } else if (argv[i] == inlineBelowFlag && i + 1 < argc) {
+            try {
+                inlineBelow = parseByteSize(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid inline below command argument format");
+            }
+            if (inlineBelow < 0) {
+                throw std::runtime_error("main: inline below command argument cannot be below 0");
+            }
+        } else if (argv[i] == bytesPerThreadFlag && i + 1 < argc) {
+            try {
+                bytesPerThread = parseByteSize(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid bytes per thread command argument format");
+            }
+            if (bytesPerThread < 1) {
+                throw std::runtime_error("main: bytes per thread command argument cannot be below 1");
+            }
+        } else if (argv[i] == unalignedFlag) {
+            unaligned = true;
+        } else if (argv[i] == hugePagesFlag) {
+            hugePages = true;
+        } else if (argv[i] == cpusFlag && i + 1 < argc) {
+            try {
+                threadPlacement = placement::fromArg(argv[++i], infileName);
+            }
+            catch(const std::invalid_argument& e) {
+                throw std::runtime_error("main: invalid cpus command argument format");
+            }
+        } else if (argv[i] == splitFlag && i + 1 < argc) {
+            try {
+                splitParts = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid split command argument format");
+            }
+            if (splitParts < 1) {
+                throw std::runtime_error("main: split command argument cannot be below 1");
+            }
+        } else if (argv[i] == joinFlag) {
+            joining = true;
+        } else if (argv[i] == compareFlag) {
+            comparing = true;
+        } else if (argv[i] == sparseFlag) {
+            sparse = true;
+        } else if (argv[i] == dedupFlag && i + 1 < argc) {
+            dedupIndexName = argv[++i];
+        } else if (argv[i] == syncFlag && i + 1 < argc) {
+            syncIndexName = argv[++i];
+        } else if (argv[i] == lagFlag && i + 1 < argc) {
+            try {
+                lagChunks = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid lag command argument format");
+            }
+            if (lagChunks < 1) {
+                throw std::runtime_error("main: lag command argument cannot be below 1");
+            }
+        } else if (argv[i] == buffersFlag && i + 1 < argc) {
+            try {
+                numBuffers = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid buffers command argument format");
+            }
+            if (numBuffers < 2) {
+                throw std::runtime_error("main: buffers command argument cannot be below 2");
+            }
         } else {
             throw std::runtime_error(cmdErrorMessage);
         }
@@ -257,12 +1586,178 @@ int main(int argc, char** argv) {
     /* initialise the thread time arrays*/
     threadTimes = new threadtimes[numThreads];
     #endif
+    /* initialise the thread resource usage array */
+    threadUsage = new resourceusage[numThreads];
+    /* initialise the thread hint stats array */
+    threadHints = new hintstats[numThreads];
+    /* initialise the thread sync time array */
+    threadSyncTimes = new long[numThreads]();
+
+    /* fan-out splits the infile by size and writes every outfile at its offsets */
+    if (!fanoutNames.empty()) {
+        bool anyStream = isStream(infileName);
+        for (const std::string& name : fanoutNames) {
+            anyStream = anyStream || isStream(name.c_str());
+        }
+        if (anyStream) {
+            throw std::runtime_error("main: more than one outfile needs a regular infile and regular outfiles");
+        }
+        if (useHints) {
+            throw std::runtime_error("main: --hints only works with one outfile");
+        }
+        /* the fan-out threads already write behind their reads, one writer per outfile */
+        if (overlapped) {
+            throw std::runtime_error("main: --overlap only works with one outfile");
+        }
+    }
+    /* splitting writes outfile.000, outfile.001... and joining reads infile.000, infile.001... */
+    if (splitParts > 0 || joining) {
+        if (splitParts > 0 && joining) {
+            throw std::runtime_error("main: can't --split and --join at once");
+        }
+        if (!fanoutNames.empty() || useHints || (durable && splitParts > 0)) {
+            throw std::runtime_error("main: --split and --join don't go with more than one outfile, --hints, or --durable when splitting");
+        }
+        if (std::string(infileName) == STDIO_NAME || std::string(outfileName) == STDIO_NAME) {
+            throw std::runtime_error("main: --split and --join need files, not stdin/stdout");
+        }
+    }
+
+    /* comparing reads both files in place, so none of the ways of writing apply */
+    if (comparing) {
+        if (!fanoutNames.empty() || splitParts > 0 || joining || durable || useHints || overlapped) {
+            throw std::runtime_error("main: --compare only goes with -t, --chunk, --huge-pages and --cpus");
+        }
+        if (isStream(infileName) || isStream(outfileName)) {
+            throw std::runtime_error("main: --compare needs two regular files");
+        }
+    }
+
+    /* only the plain copier threads look for zeros, the other ways of writing don't */
+    if (sparse && (overlapped || !fanoutNames.empty() || comparing || isStream(infileName) || isStream(outfileName))) {
+        throw std::runtime_error("main: --sparse doesn't go with --overlap, more outfiles, --compare or stdin/stdout");
+    }
+
+    /* syncing goes a file at a time, so none of the ways of splitting up one file apply */
+    if (!syncIndexName.empty()) {
+        if (overlapped || !fanoutNames.empty() || comparing || sparse || useHints || splitParts > 0 || joining
+            || durable || !dedupIndexName.empty()) {
+            throw std::runtime_error("main: --sync only goes with -t, --chunk, --huge-pages and --cpus");
+        }
+        if (!std::filesystem::is_directory(infileName)) {
+            throw std::runtime_error("main: --sync needs the infile to be a directory");
+        }
+    }
+
+    /* the chunks go straight from one file to the other, so only plain copies (and --durable) dedup */
+    if (!dedupIndexName.empty()) {
+        if (overlapped || !fanoutNames.empty() || comparing || sparse || useHints || splitParts > 0 || joining
+            || isStream(infileName) || isStream(outfileName)) {
+            throw std::runtime_error("main: --dedup only goes with -t, --durable, --huge-pages and --cpus");
+        }
+    }
+
+    /* initialise the fan-out time arrays */
+    fanoutWriteTimes = new long[numThreads * std::max((int) fanoutNames.size(), 1)]();
+    fanoutStallTimes = new long[numThreads]();
+
+    /* durable copies go to a temp file which gets renamed over the outfile at the end */
+    if (durable && isStream(outfileName)) {
+        throw std::runtime_error("main: --durable needs a regular outfile");
+    }
+    std::vector<durablefile*> durableOuts;
+    if (durable) {
+        if (fanoutNames.empty()) {
+            durableOuts.push_back(new durablefile(outfileName, infileName));
+        }
+        for (std::string& name : fanoutNames) {
+            durableOuts.push_back(new durablefile(name, infileName));
+            name = durableOuts.back()->tempName;
+        }
+    }
+    const char* copyOutfileName = durable ? durableOuts[0]->tempName.c_str() : outfileName;
+
+    /* 
+    * load the chunk index and stamp the infile before it's read, so a change while copying shows up next time
+    * without --durable the outfile is truncated before anything is copied, so its own chunks can't be used
+    */
+    dedupfile sourceRecord;
+    dedupfile targetRecord;
+    if (!dedupIndexName.empty()) {
+        dedupIndex = new dedupindex(dedupIndexName);
+        sourceRecord.path = dedupindex::canonical(infileName);
+        targetRecord.path = dedupindex::canonical(outfileName);
+        sourceRecord.stamp();
+        sourceManifest = dedupIndex->find(sourceRecord.path);
+        dedupIndex->mapLocations(sourceRecord.path, durable ? "" : targetRecord.path);
+        threadChunks = new std::vector<dedupchunk>[numThreads];
+    }
+    bool sourceUnchanged = sourceManifest != nullptr;
+
+    /* start counting tlb misses before any copier thread exists so they all get counted */
+    tlbcounter tlbMisses;
+
+    /* snapshot the process counters so only the copy gets counted */
+    resourceusage startProcessUsage = resourceusage::ofProcess();
+    processio startProcessIO = processio::current();
 
     /* start the threads */
-    long totalActualTime = timeFunction([numThreads, &infileName, &outfileName]{
-        startCopierThreads(numThreads, infileName, outfileName);
+    long totalActualTime = timeFunction([numThreads, &infileName, copyOutfileName, &durableOuts, &sourceRecord, &targetRecord]{
+        if (!syncIndexName.empty()) {
+            startSyncThreads(numThreads, infileName, copyOutfileName);
+        } else if (splitParts > 0 || joining) {
+            startPartThreads(numThreads, infileName, copyOutfileName);
+        } else {
+            startCopierThreads(numThreads, infileName, copyOutfileName);
+        }
+        for (durablefile* durableOut : durableOuts) {
+            durableOut->publish();
+        }
+
+        /* the threads' ranges are in order, so their chunks laid end to end are the file's */
+        if (dedupIndex != nullptr) {
+            for (int i = 0; i < numThreads; ++i) {
+                sourceRecord.chunks.insert(sourceRecord.chunks.end(), threadChunks[i].begin(), threadChunks[i].end());
+            }
+            targetRecord.chunks = sourceRecord.chunks;
+            sourceManifest = nullptr;
+            dedupIndex->record(sourceRecord);
+            if (targetRecord.stamp()) {
+                dedupIndex->record(targetRecord);
+            }
+            dedupIndex->save();
+        }
     }).count();
 
+    resourceusage processUsage = resourceusage::ofProcess() - startProcessUsage;
+    processio processIO = processio::current() - startProcessIO;
+    long dtlbLoadMisses = tlbMisses.loadMisses();
+    long dtlbStoreMisses = tlbMisses.storeMisses();
+    resourceusage totalThreadUsage = std::accumulate(threadUsage, threadUsage + numThreads, resourceusage());
+    long bytesCopied = !syncIndexName.empty() ? syncBytesCopied.load() : !streamMode.empty() ? streamedBytes
+        : !partNames.empty() ? partsTotalBytes : getFileSize(infileName);
+
+    /* like cmp, say where the files differ even without -t */
+    bool filesDiffer = false;
+    if (comparing) {
+        long infileSize = getFileSize(infileName);
+        long outfileSize = getFileSize(outfileName);
+        if (firstDifference != LONG_MAX) {
+            std::cout << infileName << " " << outfileName << " differ: byte " << firstDifference + 1 << std::endl;
+            filesDiffer = true;
+        } else if (infileSize != outfileSize) {
+            std::cout << "EOF on " << (infileSize < outfileSize ? infileName : outfileName)
+                << " after byte " << std::min(infileSize, outfileSize) << std::endl;
+            filesDiffer = true;
+        }
+        bytesCopied = bytesCompared;
+    }
+
+    /* the copy went to stdout, so the stats go to stderr instead of into the data */
+    if (std::string(outfileName) == STDIO_NAME) {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
     /* display the times */
     if (showTime) { 
         #if defined(SHOW_EACH_THREAD_TIME) && defined(SHOW_OTHER_TIMES)
@@ -271,6 +1766,20 @@ int main(int argc, char** argv) {
             std::cout << "read time*: " << threadTimes[i].readTime / NANO_PER_MS << " ms" << std::endl;
             std::cout << "write time*: " << threadTimes[i].writeTime / NANO_PER_MS << " ms" << std::endl;
             std::cout << "total time*: " << threadTimes[i].totalTime / NANO_PER_MS << " ms" << std::endl;
+            if (overlapped) {
+                std::cout << "overlap time*: " << threadTimes[i].overlapTime / NANO_PER_MS << " ms" << std::endl;
+            }
+        }
+        #endif
+
+        #ifdef SHOW_EACH_THREAD_TIME
+        for (int i = 0; i < numThreads; ++i) {
+            std::cout << "---THREAD " << i << " RESOURCES---" << std::endl;
+            std::cout << "voluntary context switches: " << threadUsage[i].voluntarySwitches << std::endl;
+            std::cout << "involuntary context switches: " << threadUsage[i].involuntarySwitches << std::endl;
+            std::cout << "minor faults: " << threadUsage[i].minorFaults << std::endl;
+            std::cout << "major faults: " << threadUsage[i].majorFaults << std::endl;
+            std::cout << "cpu time: " << threadUsage[i].cpuTime / NANO_PER_MS << " ms" << std::endl;
         }
         #endif
 
@@ -279,17 +1788,146 @@ int main(int argc, char** argv) {
         int slowestThreadIndx = slowestThread(threadTimes, numThreads);
         std::cout << "SLOWEST THREAD TOTAL READ: " << threadTimes[slowestThreadIndx].readTime / NANO_PER_MS << " ms" << std::endl;
         std::cout << "SLOWEST THREAD TOTAL WRITE: " << threadTimes[slowestThreadIndx].writeTime / NANO_PER_MS << " ms" << std::endl;
-        std::cout << "SLOWEST THREAD TOTAL TIME (READ + WRITE): " << threadTimes[slowestThreadIndx].totalTime / NANO_PER_MS << " ms" << std::endl; 
+        if (overlapped) {
+            std::cout << "SLOWEST THREAD TOTAL TIME (WALL): " << threadTimes[slowestThreadIndx].totalTime / NANO_PER_MS << " ms" << std::endl;
+            std::cout << "SLOWEST THREAD OVERLAP (READ + WRITE - WALL): " << threadTimes[slowestThreadIndx].overlapTime / NANO_PER_MS << " ms" << std::endl;
+        } else {
+            std::cout << "SLOWEST THREAD TOTAL TIME (READ + WRITE): " << threadTimes[slowestThreadIndx].totalTime / NANO_PER_MS << " ms" << std::endl; 
+        }
         #endif
+        if (!streamMode.empty()) {
+            std::cout << "STREAMED WITH: " << streamMode << " (" << streamedBytes << " bytes, " << streamThreads
+                << (streamThreads == 1 ? " thread)" : " threads)") << std::endl;
+        }
         std::cout << "TOTAL ACTUAL TIME: " << totalActualTime / NANO_PER_MS << " ms" << std::endl;
+
+        std::cout << "===RESOURCE STATS===" << std::endl;
+        std::cout << "THREAD VOLUNTARY CONTEXT SWITCHES: " << totalThreadUsage.voluntarySwitches << std::endl;
+        std::cout << "THREAD INVOLUNTARY CONTEXT SWITCHES: " << totalThreadUsage.involuntarySwitches << std::endl;
+        std::cout << "THREAD MINOR FAULTS: " << totalThreadUsage.minorFaults << std::endl;
+        std::cout << "THREAD MAJOR FAULTS: " << totalThreadUsage.majorFaults << std::endl;
+        std::cout << "THREAD CPU TIME: " << totalThreadUsage.cpuTime / NANO_PER_MS << " ms" << std::endl;
+        std::cout << "PROCESS CPU TIME: " << processUsage.cpuTime / NANO_PER_MS << " ms" << std::endl;
+        std::cout << "PROCESS READ CHARS: " << processIO.readChars << std::endl;
+        std::cout << "PROCESS WRITE CHARS: " << processIO.writeChars << std::endl;
+        std::cout << "PROCESS STORAGE READ BYTES: " << processIO.readBytes << std::endl;
+        std::cout << "PROCESS STORAGE WRITE BYTES: " << processIO.writeBytes << std::endl;
+        if (useHints) {
+            hintstats totalHints = std::accumulate(threadHints, threadHints + numThreads, hintstats());
+            std::cout << "DIRTY PAGE CACHE HIGH WATER: " << totalHints.highestDirtyKB << " kB" << std::endl;
+            std::cout << "WRITE-BEHIND SYNC WAIT (ALL THREADS): " << totalHints.syncWaitTime / NANO_PER_MS << " ms" << std::endl;
+        }
+        if (syncIndex != nullptr) {
+            std::cout << "SYNCED FILES: " << syncFiles.size() << " (" << syncSkipped << " unchanged, " << syncTouched
+                << " touched but the same, " << syncCopied << " copied, " << syncVanished << " gone before they were read)" << std::endl;
+            std::cout << "SYNC BYTES HASHED TO CHECK: " << syncBytesHashed << std::endl;
+            if (syncNotRegular > 0) {
+                std::cout << "NOT REGULAR FILES LEFT OUT: " << syncNotRegular << std::endl;
+            }
+            std::cout << "CHANGE INDEX: " << syncIndex->size() << " entries, " << syncIndex->updated << " updated in place, "
+                << syncIndex->added.size() << " added, " << syncIndex->pruned << " pruned" << std::endl;
+        }
+        if (dedupIndex != nullptr) {
+            std::cout << "DEDUP CHUNKS: " << dedupedChunks << " of " << totalDedupChunks << " from local copies"
+                << (sourceUnchanged ? " (infile unchanged since it was indexed, not chunked again)" : "") << std::endl;
+            std::cout << "DEDUP BYTES: " << dedupedBytes << std::endl;
+            if (bytesCopied > 0) {
+                std::cout << "DEDUP RATIO: " << dedupedBytes * 100.0 / bytesCopied << "%" << std::endl;
+            }
+            std::cout << "INFILE BYTES READ: " << sourceBytesRead << std::endl;
+            std::cout << "DEDUP INDEX: " << dedupIndex->files.size() << " files, " << dedupIndex->totalChunks() << " chunks, "
+                << dedupIndex->staleFiles << " dropped as changed" << std::endl;
+        }
+        if (sparse) {
+            std::cout << "ZEROS ELIDED: " << elidedBytes << " bytes";
+            if (bytesCopied > 0) {
+                std::cout << " (" << elidedBytes * 100 / bytesCopied << "% of the copy left as holes)";
+            }
+            std::cout << std::endl;
+        }
+        if (comparing) {
+            std::cout << "COMPARED: " << bytesCompared << " bytes of each file (" << simdLevel() << ")" << std::endl;
+            if (totalActualTime > 0) {
+                std::cout << "COMPARE READ RATE (BOTH FILES): " << (2 * bytesCompared / BYTES_PER_GB) / (totalActualTime / NANO_PER_SEC) << " GB/s" << std::endl;
+            }
+        }
+        if (!partNames.empty()) {
+            std::cout << (joining ? "JOINED " : "SPLIT INTO ") << partNames.size() << " PARTS (" << partsTotalBytes << " bytes)" << std::endl;
+        }
+        if (copyWorkers >= 0) {
+            if (copyWorkers == 0) {
+                std::cout << "COPY ENGINE: inline on the main thread with " << inlineMode << std::endl;
+            } else {
+                std::cout << "COPY ENGINE: " << copyWorkers << " of " << numThreads << " threads" << std::endl;
+            }
+            std::cout << "SIZE THRESHOLDS: inline below " << inlineBelow << " bytes, a thread per " << bytesPerThread << " bytes" << std::endl;
+        }
+        if (copyWorkers > 0 || splitParts > 0) {
+            std::cout << "PARTITION ALIGNMENT: " << partitionAlign.bytes << " bytes (" << partitionAlign.description << ")" << std::endl;
+        }
+        if (copyWorkers == 0) {
+            /* the inline copy never builds a buffer pool or places a thread */
+            std::cout << "CHUNK SIZE: inline, no buffers" << std::endl;
+        } else if (streamMode.empty()) {
+            std::cout << "THREAD PLACEMENT: " << threadPlacement.description << std::endl;
+            std::cout << "CHUNK SIZE: " << chunkSize << " bytes (" << bufferBacking << ")" << std::endl;
+        }
+        if (!tlbMisses.error.empty()) {
+            std::cout << "DTLB MISSES: unavailable (" << tlbMisses.error << ")" << std::endl;
+        } else {
+            std::cout << "DTLB LOAD MISSES" << (tlbMisses.loadKernelCounted ? "" : " (USER ONLY)") << ": " << dtlbLoadMisses << std::endl;
+            if (dtlbStoreMisses >= 0) {
+                std::cout << "DTLB STORE MISSES" << (tlbMisses.storeKernelCounted ? "" : " (USER ONLY)") << ": " << dtlbStoreMisses << std::endl;
+            }
+        }
+        if (durable) {
+            std::cout << "===SYNC STATS===" << std::endl;
+            std::cout << "SLOWEST THREAD RANGE FLUSH: " << *std::max_element(threadSyncTimes, threadSyncTimes + numThreads) / NANO_PER_MS << " ms" << std::endl;
+            long fdatasyncTime = 0;
+            long publishTime = 0;
+            for (durablefile* durableOut : durableOuts) {
+                fdatasyncTime += durableOut->fdatasyncTime;
+                publishTime += durableOut->publishTime;
+            }
+            std::cout << "FINAL FDATASYNC: " << fdatasyncTime / NANO_PER_MS << " ms" << std::endl;
+            std::cout << "RENAME + DIRECTORY FSYNC: " << publishTime / NANO_PER_MS << " ms" << std::endl;
+        }
+        if (!fanoutNames.empty()) {
+            int numOutfiles = fanoutNames.size();
+            std::cout << "===FAN-OUT STATS===" << std::endl;
+            std::cout << "OUTFILES: " << numOutfiles << " (lag window " << lagChunks << " chunks per thread)" << std::endl;
+            for (int d = 0; d < numOutfiles; ++d) {
+                long writeTime = 0;
+                for (int i = 0; i < numThreads; ++i) {
+                    writeTime += fanoutWriteTimes[i * numOutfiles + d];
+                }
+                std::cout << "OUTFILE " << d << " WRITE TIME (ALL THREADS): " << writeTime / NANO_PER_MS << " ms" << std::endl;
+            }
+            std::cout << "READS STALLED BY THE SLOWEST OUTFILE (ALL THREADS): "
+                << std::accumulate(fanoutStallTimes, fanoutStallTimes + numThreads, 0L) / NANO_PER_MS << " ms" << std::endl;
+        }
+        if (bytesCopied > 0) {
+            std::cout << "CPU SECONDS PER GB: " << (processUsage.cpuTime / NANO_PER_SEC) / (bytesCopied / BYTES_PER_GB) << std::endl;
+        }
     }
 
     #ifdef SHOW_OTHER_TIMES
     /* clean up the arrays for thread times */
     delete[] threadTimes;
     #endif
+    delete[] threadUsage;
+    delete[] threadChunks;
+    delete dedupIndex;
+    delete syncIndex;
+    delete[] threadHints;
+    delete[] threadSyncTimes;
+    delete[] fanoutWriteTimes;
+    delete[] fanoutStallTimes;
+    for (durablefile* durableOut : durableOuts) {
+        delete durableOut;
+    }
 
-    return EXIT_SUCCESS;
+    return filesDiffer ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
   
\ No newline at end of file
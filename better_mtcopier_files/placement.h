@@ -0,0 +1,151 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* what to pass instead of a cpu list to stay near the infile's block device */
+#define NEAR_DEVICE "near"
+
+/*
+* where the copier threads are allowed to run
+* a cpu list pins each thread to one cpu from it in turn, near the device lets every
+* thread run anywhere on the numa node the infile's block device hangs off,
+* when there's nothing to choose between (one node, or the node can't be found) nothing is pinned
+*/
+class placement
+{
+    public:
+        /* the cpus threads go on, empty when they aren't pinned */
+        std::vector<int> cpus;
+        /* whether each thread gets one cpu from the list instead of all of them */
+        bool spread;
+        /* what was decided and why, for the stats */
+        std::string description;
+
+        placement() : spread(false), description("not pinned") {};
+
+        /* from "near" or a list like 0-3,8,10-11 */
+        static placement fromArg(const std::string& arg, const char* fileName) {
+            if (arg == NEAR_DEVICE) {
+                return nearFile(fileName);
+            }
+            placement place;
+            place.cpus = parseCpuList(arg);
+            long numCpus = sysconf(_SC_NPROCESSORS_CONF);
+            for (int cpu : place.cpus) {
+                if (cpu >= numCpus || cpu >= CPU_SETSIZE) {
+                    throw std::runtime_error("placement: cpu " + std::to_string(cpu) + " doesn't exist");
+                }
+            }
+            place.spread = true;
+            place.description = "pinned one cpu each from " + arg;
+            return place;
+        }
+
+        /* the cpus of the numa node the file's block device is attached to */
+        static placement nearFile(const char* fileName) {
+            placement place;
+            int node = numaNodeOf(fileName);
+            if (node < 0) {
+                place.description = "not pinned (no numa node for the infile's device)";
+                return place;
+            }
+            if (numNodes() <= 1) {
+                place.description = "not pinned (node " + std::to_string(node) + " is the only node)";
+                return place;
+            }
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string list;
+            if (!(file >> list)) {
+                place.description = "not pinned (no cpu list for node " + std::to_string(node) + ")";
+                return place;
+            }
+            place.cpus = parseCpuList(list);
+            place.description = "node " + std::to_string(node) + " cpus " + list;
+            return place;
+        }
+
+        bool active() const {
+            return !cpus.empty();
+        }
+
+        /* set the affinity a thread starting in the given slot should get */
+        void apply(pthread_attr_t* attr, int index) const {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (spread) {
+                CPU_SET(cpus[index % cpus.size()], &set);
+            } else {
+                for (int cpu : cpus) {
+                    CPU_SET(cpu, &set);
+                }
+            }
+            pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+        }
+
+        /* "0-3,8" -> 0 1 2 3 8 */
+        static std::vector<int> parseCpuList(const std::string& list) {
+            std::vector<int> cpus;
+            std::stringstream ranges(list);
+            std::string range;
+            while (std::getline(ranges, range, ',')) {
+                size_t dash = range.find('-');
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                if (first < 0 || last < first) {
+                    throw std::invalid_argument(range);
+                }
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (cpus.empty()) {
+                throw std::invalid_argument(list);
+            }
+            return cpus;
+        }
+
+    private:
+        /* walk up from the block device in sysfs until something says which node it's on */
+        static int numaNodeOf(const char* fileName) {
+            struct stat st;
+            if (stat(fileName, &st) != 0) {
+                return -1;
+            }
+            std::string link = "/sys/dev/block/" + std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev));
+            char resolved[PATH_MAX];
+            if (realpath(link.c_str(), resolved) == nullptr) {
+                return -1;
+            }
+            for (std::string dir = resolved; dir.size() > 1; dir = dir.substr(0, dir.rfind('/'))) {
+                std::ifstream file(dir + "/numa_node");
+                int node;
+                if (file >> node) {
+                    return node;
+                }
+            }
+            return -1;
+        }
+
+        static int numNodes() {
+            std::ifstream file("/sys/devices/system/node/online");
+            std::string list;
+            if (!(file >> list)) {
+                return 1;
+            }
+            return parseCpuList(list).size();
+        }
+};
+
+#endif
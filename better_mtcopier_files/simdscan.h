@@ -0,0 +1,133 @@
+#ifndef SIMDSCAN_H
+#define SIMDSCAN_H
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMDSCAN_X86
+#endif
+
+/*
+* vectorised scans over chunk buffers
+* the build doesn't ask for avx2, so the avx2 versions are compiled for it on their own
+* and only picked when the cpu has it, sse2 is always there on x86-64,
+* anything else gets plain memcmp
+*/
+
+#ifdef SIMDSCAN_X86
+__attribute__((target("avx2")))
+inline long firstMismatchAVX2(const char* a, const char* b, long length) {
+    long i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+        unsigned int equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFFFFFFu) {
+            return i + __builtin_ctz(~equal);
+        }
+    }
+    for (; i < length; ++i) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+inline long firstMismatchSSE2(const char* a, const char* b, long length) {
+    long i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+        unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFFu) {
+            return i + __builtin_ctz(~equal);
+        }
+    }
+    for (; i < length; ++i) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* ors four vectors at a time together so there's only one test per 128 bytes */
+__attribute__((target("avx2")))
+inline bool allZeroAVX2(const char* a, long length) {
+    long i = 0;
+    for (; i + 128 <= length; i += 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (a + i)), _mm256_loadu_si256((const __m256i*) (a + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (a + i + 64)), _mm256_loadu_si256((const __m256i*) (a + i + 96))));
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+    for (; i < length; ++i) {
+        if (a[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool allZeroSSE2(const char* a, long length) {
+    const __m128i zero = _mm_setzero_si128();
+    long i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (a + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*) (a + i + 32)), _mm_loadu_si128((const __m128i*) (a + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) {
+            return false;
+        }
+    }
+    for (; i < length; ++i) {
+        if (a[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/* name of the version the cpu will get, for the stats */
+inline const char* simdLevel() {
+    #ifdef SIMDSCAN_X86
+    return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+    #else
+    return "memcmp";
+    #endif
+}
+
+/* index of the first byte where a and b differ, -1 if they're the same */
+inline long firstMismatch(const char* a, const char* b, long length) {
+    #ifdef SIMDSCAN_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? firstMismatchAVX2(a, b, length) : firstMismatchSSE2(a, b, length);
+    #else
+    if (std::memcmp(a, b, length) == 0) {
+        return -1;
+    }
+    long i = 0;
+    while (a[i] == b[i]) {
+        ++i;
+    }
+    return i;
+    #endif
+}
+
+/* whether every byte of a is zero, an empty buffer counts */
+inline bool allZero(const char* a, long length) {
+    #ifdef SIMDSCAN_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? allZeroAVX2(a, length) : allZeroSSE2(a, length);
+    #else
+    /* zero first byte and every byte equal to the one before it */
+    return length == 0 || (a[0] == 0 && std::memcmp(a, a + 1, length - 1) == 0);
+    #endif
+}
+
+#endif
@@ -1,14 +1,18 @@
 #ifndef THREADTIMES_H
 #define THREADTIMES_H
 
-/* class used for timing reads and writes */
+/* 
+* class used for timing reads and writes 
+* overlapTime is how long reads and writes were running at the same time
+*/
 class threadtimes 
 {   
     public:
         long readTime;
         long writeTime;
         long totalTime;
-        threadtimes(): readTime(0), writeTime(0), totalTime(0) {};
+        long overlapTime;
+        threadtimes(): readTime(0), writeTime(0), totalTime(0), overlapTime(0) {};
 };
 
 #endif
\ No newline at end of file
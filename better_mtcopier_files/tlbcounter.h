@@ -0,0 +1,86 @@
+#ifndef TLBCOUNTER_H
+#define TLBCOUNTER_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+/*
+* counts data TLB misses for this process and every thread it starts afterwards
+* (inherited counts are only added in once those threads exit, so read after joining)
+* kernel side misses are counted too when perf_event_paranoid lets us, since that's
+* where read and write do their copying, otherwise it's user space only
+*/
+class tlbcounter
+{
+    public:
+        /* why the counters couldn't be opened, empty if they were */
+        std::string error;
+        /* whether misses in the kernel are included, each counter can end up either way */
+        bool loadKernelCounted;
+        bool storeKernelCounted;
+
+        tlbcounter() : loadKernelCounted(false), storeKernelCounted(false) {
+            loadFd = openCounter(PERF_COUNT_HW_CACHE_OP_READ, loadKernelCounted);
+            storeFd = loadFd == -1 ? -1 : openCounter(PERF_COUNT_HW_CACHE_OP_WRITE, storeKernelCounted);
+            if (loadFd == -1) {
+                error = std::strerror(errno);
+            }
+        };
+
+        ~tlbcounter() {
+            if (loadFd != -1) {
+                close(loadFd);
+            }
+            if (storeFd != -1) {
+                close(storeFd);
+            }
+        };
+
+        long loadMisses() {
+            return readCounter(loadFd);
+        }
+
+        /* -1 where the cpu has no store miss event */
+        long storeMisses() {
+            return readCounter(storeFd);
+        }
+
+    private:
+        int loadFd;
+        int storeFd;
+
+        /* open the counter for op, setting kernelCounted to whether it got to count the kernel too */
+        static int openCounter(long op, bool& kernelCounted) {
+            struct perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            attr.inherit = 1;
+            attr.exclude_hv = 1;
+
+            int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            kernelCounted = fd != -1;
+            /* not allowed to count the kernel, settle for user space */
+            if (fd == -1 && errno == EACCES) {
+                attr.exclude_kernel = 1;
+                fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            }
+            return fd;
+        }
+
+        static long readCounter(int fd) {
+            long count = 0;
+            if (fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+                return -1;
+            }
+            return count;
+        }
+};
+
+#endif
@@ -1,7 +1,11 @@
 /*
 This is the single-threaded copier which uses a queue
+The queue is now bounded by a byte budget, so one thread
+reads the file into the queue while another writes it out
+and the whole file never has to sit in memory
 */
 
+#include <pthread.h>
 #include <stdexcept>
 #include <queue>
 #include <string>
@@ -9,22 +13,50 @@ This is the single-threaded copier which uses a queue
 #include <fstream>
 #include <chrono>
 #include <functional>
+#include <sys/resource.h>
 
 /*----CONSTANTS----*/
 /* cmd args position for infile */
 #define INFILE_INDX 1
 /* cmd args position for outfile */
 #define OUTFILE_INDX 2
-/* cmd args position for timer flag*/
-#define TIMER_INDEX 3
+/* cmd args position where the optional flags start */
+#define OPTIONS_INDX 3
 /* min number of cmd args */
 #define MIN_NUM_ARGS 3
-/* max number of cmd args*/
-#define MAX_NUM_ARGS 4
 /* num bytes read at a time */
 #define READ_CHUNK 32768
+/* default number of bytes allowed in the queue */
+#define DEFAULT_BUFFER_BYTES (1024L * READ_CHUNK)
+/* value for successful thread create or join*/
+#define THREAD_SUCCESS 0
 /* convert nano seconds to ms*/
 #define NS_PER_MS 1000000
+/* ru_maxrss is in KB */
+#define BYTES_PER_KB 1024
+
+/*----GLOBAL VARIABLES----*/
+/* the queue to store the file chunks*/
+std::queue<std::string> queue;
+/* number of bytes currently sitting in the queue */
+long queuedBytes = 0;
+/* max number of bytes allowed in the queue */
+long bufferBytes = DEFAULT_BUFFER_BYTES;
+/* whether the reader is still reading */
+bool reading = true;
+/* mutex for the queue */
+pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+/* conditional to check if the queue has elements */
+pthread_cond_t queueFullCond = PTHREAD_COND_INITIALIZER;
+/* conditional to check if the queue has space */
+pthread_cond_t queueEmptyCond = PTHREAD_COND_INITIALIZER;
+
+/* time spent reading and writing */
+long readTime = 0;
+long writeTime = 0;
+/* time spent waiting on the other thread */
+long readWaitTime = 0;
+long writeWaitTime = 0;
 
 /* used to time functions */
 std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
@@ -35,8 +67,26 @@ std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
     return duration;
 }
 
-/* read file contents into a queue */
-void fileIntoQueue(const std::string& infileName, std::queue<std::string>& queue) {
+/* parse a byte count with an optional K, M or G suffix */
+long parseByteSize(const std::string& str) {
+    size_t end = 0;
+    long bytes = std::stol(str, &end);
+    if (end < str.size()) {
+        if (end + 1 != str.size()) {
+            throw std::invalid_argument(str);
+        }
+        switch (str[end]) {
+            case 'K': case 'k': bytes *= 1024L; break;
+            case 'M': case 'm': bytes *= 1024L * 1024L; break;
+            case 'G': case 'g': bytes *= 1024L * 1024L * 1024L; break;
+            default: throw std::invalid_argument(str);
+        }
+    }
+    return bytes;
+}
+
+/* read file contents into the queue while there is budget for it */
+void fileIntoQueue(const std::string& infileName) {
     /* current bytes from file */
     char buffer[READ_CHUNK];
 
@@ -45,24 +95,49 @@ void fileIntoQueue(const std::string& infileName, std::queue<std::string>& queue
 
     /* throw an error if we can't find the file */
     if (!file) {
+        /* let the writer know nothing is coming */
+        pthread_mutex_lock(&queueMutex);
+        reading = false;
+        pthread_cond_signal(&queueFullCond);
+        pthread_mutex_unlock(&queueMutex);
+
         const std::string fileNotFoundMsg = "fileIntoQueue: cannot find infile";
         throw std::runtime_error(fileNotFoundMsg);
     }
 
     /* keep reading chunk by chunk until we get to the end*/
     while (!file.eof()) {
-        file.read(buffer, READ_CHUNK);
+        readTime += timeFunction([&file, &buffer] {
+            file.read(buffer, READ_CHUNK);
+        }).count();
         /* last chunk might not be the same size as the rest*/
         std::streamsize len = file.gcount();
+
+        pthread_mutex_lock(&queueMutex);
+        /* wait until the writer has made room, an empty queue always takes a chunk */
+        readWaitTime += timeFunction([len] {
+            while (queuedBytes > 0 && queuedBytes + len > bufferBytes) {
+                pthread_cond_wait(&queueEmptyCond, &queueMutex);
+            }
+        }).count();
         queue.push(std::string(buffer, len));
+        queuedBytes += len;
+        pthread_cond_signal(&queueFullCond);
+        pthread_mutex_unlock(&queueMutex);
     }
 
+    /* let the writer know we're done */
+    pthread_mutex_lock(&queueMutex);
+    reading = false;
+    pthread_cond_signal(&queueFullCond);
+    pthread_mutex_unlock(&queueMutex);
+
     /* don't forget to close the file! */
     file.close();
 }
 
 /* write into file from queue */
-void fileFromQueue(const std::string& outfileName, std::queue<std::string>& queue) {
+void fileFromQueue(const std::string& outfileName) {
     /* open the file in binary mode and clear it*/
     std::ofstream file(outfileName, std::ofstream::binary | std::ofstream::trunc);
 
@@ -71,23 +146,58 @@ void fileFromQueue(const std::string& outfileName, std::queue<std::string>& queu
         throw std::runtime_error(fileNotFoundMsg);
     }
 
-    /* keep writing to file from queue until its empty */
-    while (!queue.empty()) {
-        file << queue.front();
+    /* keep writing to file from queue until its empty and the reader is done */
+    while (true) {
+        pthread_mutex_lock(&queueMutex);
+        writeWaitTime += timeFunction([] {
+            while (queue.empty() && reading) {
+                pthread_cond_wait(&queueFullCond, &queueMutex);
+            }
+        }).count();
+        if (queue.empty()) {
+            pthread_mutex_unlock(&queueMutex);
+            break;
+        }
+        std::string item = std::move(queue.front());
         queue.pop();
+        queuedBytes -= item.length();
+        pthread_cond_signal(&queueEmptyCond);
+        pthread_mutex_unlock(&queueMutex);
+
+        writeTime += timeFunction([&file, &item] {
+            file << item;
+        }).count();
     }
 
     /* don't forget to close the file! */
     file.close();
 }
 
+/* reader thread */
+void* reader(void* arg) {
+    /* the infile name */
+    std::string* infileName = (std::string*) arg;
+    fileIntoQueue(*infileName);
+    return nullptr;
+}
+
+/* get the peak resident set size of the process in bytes */
+long peakResidentBytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss * BYTES_PER_KB;
+}
+
 int main(int argc, char** argv) {
 
-    const std::string cmdErrorMessage = "main: the correct command is: ./copier <infile> <outfile> <optional -t>";
+    const std::string cmdErrorMessage = "main: the correct command is: ./copier <infile> <outfile> <optional -t> <optional --buffer <bytes>[K|M|G]>";
     const std::string timerFlag = "-t";
+    const std::string bufferFlag = "--buffer";
 
     /* check number of cmd args */
-    if (argc < MIN_NUM_ARGS || argc > MAX_NUM_ARGS) {
+    if (argc < MIN_NUM_ARGS) {
 
         throw std::runtime_error(cmdErrorMessage);
     }
@@ -97,30 +207,46 @@ int main(int argc, char** argv) {
     std::string outfileName = argv[OUTFILE_INDX];
     bool showTime = false;
 
-    /* check if the command has the timer flag*/
-    if (argc == MAX_NUM_ARGS) {
-        if (argv[TIMER_INDEX] == timerFlag) {
+    /* check the optional flags */
+    for (int i = OPTIONS_INDX; i < argc; ++i) {
+        if (argv[i] == timerFlag) {
             showTime = true;
+        } else if (argv[i] == bufferFlag && i + 1 < argc) {
+            try {
+                bufferBytes = parseByteSize(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid buffer command argument format");
+            }
+            if (bufferBytes < 1) {
+                throw std::runtime_error("main: buffer command argument cannot be below 1");
+            }
         } else {
             throw std::runtime_error(cmdErrorMessage);
         }
     }
 
-    /* the queue to store the file chunks*/
-    std::queue<std::string> queue;
-
-    /* copy the file */
-    long readTime = timeFunction([&infileName, &queue] { 
-        fileIntoQueue(infileName, queue); }).count();
-    long writeTime = timeFunction([&outfileName, &queue] { 
-        fileFromQueue(outfileName, queue); }).count();
-    long totalTime = readTime + writeTime;
+    /* copy the file, reading and writing at the same time */
+    long totalTime = timeFunction([&infileName, &outfileName] {
+        pthread_t readerThread;
+        if (pthread_create(&readerThread, nullptr, &reader, &infileName) != THREAD_SUCCESS) {
+            throw std::runtime_error("main: could not create reader thread");
+        }
+        fileFromQueue(outfileName);
+        if (pthread_join(readerThread, nullptr) != THREAD_SUCCESS) {
+            throw std::runtime_error("main: could not join reader thread");
+        }
+    }).count();
 
     /* display the time taken */
     if (showTime) {
         std::cout << "----COPYING STATS----" << std::endl;
         std::cout << "read time: " << readTime / NS_PER_MS << " ms" << std::endl;
         std::cout << "write time: " << writeTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "read wait time: " << readWaitTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "write wait time: " << writeWaitTime / NS_PER_MS << " ms" << std::endl;
         std::cout << "total time: " << totalTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "buffer budget: " << bufferBytes << " bytes" << std::endl;
+        std::cout << "peak resident memory: " << peakResidentBytes() << " bytes" << std::endl;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,535 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* most submission queue entries asked for, the kernel rounds it up to a power of 2 */
+#define MAX_RING_ENTRIES 4096
+/* user_data of the poll on the pool's eventfd, requests use their own address */
+#define POOL_WAKE_TAG 0
+
+/*
+* one operation a coroutine is waiting on
+* reads and writes go to io_uring when there is one, anything else (or everything, without a ring)
+* runs as work on the pool, the coroutine that submitted it is resumed with the result once it's done
+*/
+class iorequest
+{
+    public:
+        static const int WORK = 0;
+        static const int READ = 1;
+        static const int WRITE = 2;
+
+        int kind;
+        std::function<long()> work;
+        int fd;
+        long offset;
+        struct iovec iov;
+        /* bytes done, or -errno like a cqe */
+        long result;
+        /* what the work threw, rethrown in the coroutine */
+        std::exception_ptr error;
+        std::coroutine_handle<> handle;
+        iorequest(std::function<long()> w) : kind(WORK), work(std::move(w)), fd(-1), offset(0), iov{nullptr, 0}, result(0) {};
+        iorequest(int k, int f, char* data, long length, long off) : kind(k), fd(f), offset(off), result(0) {
+            iov.iov_base = data;
+            iov.iov_len = length;
+        };
+};
+
+/*
+* event loop for the coroutine copier
+* reads and writes are queued on an io_uring as the coroutines ask for them and the loop (whoever calls run)
+* submits them in one io_uring_enter, waits for completions and resumes each coroutine as its cqe comes in,
+* so every chunk in flight is an operation in the kernel rather than a thread blocked in a syscall,
+* cpu work like a transform goes to a small pool whose completions wake the ring through an eventfd,
+* and when io_uring_setup fails (old kernel, seccomp, memlock limits) the pool runs the syscalls too,
+* either way coroutines only ever run on the loop thread and can share state without locks
+*/
+class ioengine
+{
+    public:
+        /* live coroutines, only touched from the loop thread */
+        long liveTasks;
+        /* most requests ever waiting at once */
+        long highestPending;
+        /* first exception a coroutine let escape, rethrown by run */
+        std::exception_ptr error;
+        /* why there's no ring, empty if there is one */
+        std::string fallbackReason;
+
+        ioengine(int numThreads, int queueDepth, bool useRing) : liveTasks(0), highestPending(0), numPoolThreads(numThreads),
+            stopping(false), pending(0), ringFd(-1), wakeFd(-1), wakeArmed(false), ringPending(0), toSubmit(0) {
+            pthread_mutex_init(&submitMutex, nullptr);
+            pthread_cond_init(&submitCond, nullptr);
+            pthread_mutex_init(&completeMutex, nullptr);
+            pthread_cond_init(&completeCond, nullptr);
+            if (useRing) {
+                /* one more than the coroutines so the wake poll always has a slot */
+                setupRing(std::min(queueDepth + 1, MAX_RING_ENTRIES));
+            } else {
+                fallbackReason = "asked for the pool";
+            }
+        };
+
+        ~ioengine() {
+            pthread_mutex_lock(&submitMutex);
+            stopping = true;
+            pthread_cond_broadcast(&submitCond);
+            pthread_mutex_unlock(&submitMutex);
+            for (pthread_t& thread : threads) {
+                pthread_join(thread, nullptr);
+            }
+            if (ringFd != -1) {
+                if (cqRing != sqRing) {
+                    munmap(cqRing, cqRingSize);
+                }
+                munmap(sqRing, sqRingSize);
+                munmap(sqes, sqEntries * sizeof(struct io_uring_sqe));
+                close(ringFd);
+            }
+            if (wakeFd != -1) {
+                close(wakeFd);
+            }
+            pthread_mutex_destroy(&submitMutex);
+            pthread_cond_destroy(&submitCond);
+            pthread_mutex_destroy(&completeMutex);
+            pthread_cond_destroy(&completeCond);
+        };
+
+        /* awaitable which submits its request and resumes with the result */
+        class awaitable
+        {
+            public:
+                ioengine* engine;
+                iorequest request;
+                awaitable(ioengine* e, iorequest&& r) : engine(e), request(std::move(r)) {};
+                bool await_ready() const noexcept { return false; }
+                void await_suspend(std::coroutine_handle<> h) {
+                    request.handle = h;
+                    engine->submit(&request);
+                }
+                long await_resume() const {
+                    if (request.error) {
+                        std::rethrow_exception(request.error);
+                    }
+                    return request.result;
+                }
+        };
+
+        /* co_await engine.offload(...) to run cpu or blocking work on the pool */
+        awaitable offload(std::function<long()> work) {
+            return awaitable(this, iorequest(std::move(work)));
+        }
+
+        /* co_await one pread's worth, returns the bytes read or -errno */
+        awaitable read(int fd, char* data, long length, long offset) {
+            if (ringFd == -1) {
+                return offload([fd, data, length, offset] {
+                    ssize_t n = pread(fd, data, length, offset);
+                    return n < 0 ? (long) -errno : (long) n;
+                });
+            }
+            return awaitable(this, iorequest(iorequest::READ, fd, data, length, offset));
+        }
+
+        /* co_await one pwrite's worth, returns the bytes written or -errno */
+        awaitable write(int fd, char* data, long length, long offset) {
+            if (ringFd == -1) {
+                return offload([fd, data, length, offset] {
+                    ssize_t n = pwrite(fd, data, length, offset);
+                    return n < 0 ? (long) -errno : (long) n;
+                });
+            }
+            return awaitable(this, iorequest(iorequest::WRITE, fd, data, length, offset));
+        }
+
+        /* resume a coroutine from the loop once whatever is running now suspends */
+        void post(std::coroutine_handle<> handle) {
+            ready.push_back(handle);
+        }
+
+        bool usingRing() const {
+            return ringFd != -1;
+        }
+
+        /* submission queue entries the kernel gave the ring */
+        unsigned ringEntries() const {
+            return ringFd != -1 ? sqEntries : 0;
+        }
+
+        /* pool threads actually started, the pool only starts once something needs it */
+        int poolThreads() const {
+            return threads.size();
+        }
+
+        /* resume coroutines as their requests finish until none are left */
+        void run() {
+            while (liveTasks > 0) {
+                while (!ready.empty()) {
+                    std::coroutine_handle<> handle = ready.front();
+                    ready.pop_front();
+                    handle.resume();
+                }
+                /* whatever is left is waiting on a turn that a coroutine which threw will never pass */
+                if (liveTasks == 0 || (pending == 0 && error)) {
+                    break;
+                }
+                if (ringFd != -1) {
+                    waitRing();
+                } else {
+                    waitPool();
+                }
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+    private:
+        int numPoolThreads;
+        std::vector<pthread_t> threads;
+        std::deque<iorequest*> submitted;
+        std::deque<iorequest*> completed;
+        std::deque<std::coroutine_handle<>> ready;
+        bool stopping;
+        long pending;
+        pthread_mutex_t submitMutex;
+        pthread_cond_t submitCond;
+        pthread_mutex_t completeMutex;
+        pthread_cond_t completeCond;
+
+        int ringFd;
+        /* the pool writes this when it finishes work, the ring polls it so the loop only ever waits in io_uring_enter */
+        int wakeFd;
+        bool wakeArmed;
+        /* reads and writes in the ring, capped below sqEntries so there's always room for the wake poll */
+        long ringPending;
+        /* sqes queued since the last io_uring_enter */
+        unsigned toSubmit;
+        /* requests waiting for room in the ring */
+        std::deque<iorequest*> backlog;
+        unsigned sqEntries;
+        void* sqRing;
+        void* cqRing;
+        size_t sqRingSize;
+        size_t cqRingSize;
+        unsigned* sqHead;
+        unsigned* sqTail;
+        unsigned* sqMask;
+        unsigned* sqArray;
+        struct io_uring_sqe* sqes;
+        unsigned* cqHead;
+        unsigned* cqTail;
+        unsigned* cqMask;
+        struct io_uring_cqe* cqes;
+
+        /* set up the ring with raw syscalls, leaves ringFd at -1 and says why if the kernel won't have it */
+        void setupRing(unsigned entries) {
+            struct io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            int fd = syscall(__NR_io_uring_setup, entries, &params);
+            if (fd < 0) {
+                fallbackReason = std::string("io_uring_setup failed: ") + std::strerror(errno);
+                return;
+            }
+            sqEntries = params.sq_entries;
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (singleMap) {
+                sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+            }
+            sqRing = mmap(nullptr, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            cqRing = singleMap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            void* sqeMap = mmap(nullptr, sqEntries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqeMap == MAP_FAILED) {
+                fallbackReason = std::string("could not map the io_uring: ") + std::strerror(errno);
+                close(fd);
+                return;
+            }
+            char* sq = (char*) sqRing;
+            char* cq = (char*) cqRing;
+            sqHead = (unsigned*) (sq + params.sq_off.head);
+            sqTail = (unsigned*) (sq + params.sq_off.tail);
+            sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+            sqArray = (unsigned*) (sq + params.sq_off.array);
+            sqes = (struct io_uring_sqe*) sqeMap;
+            cqHead = (unsigned*) (cq + params.cq_off.head);
+            cqTail = (unsigned*) (cq + params.cq_off.tail);
+            cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+            cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+            ringFd = fd;
+        }
+
+        /* the next free sqe, there always is one since ringPending stays below sqEntries */
+        struct io_uring_sqe* nextSqe() {
+            unsigned tail = *sqTail;
+            unsigned index = tail & *sqMask;
+            struct io_uring_sqe* sqe = &sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            ++toSubmit;
+            return sqe;
+        }
+
+        void queueOnRing(iorequest* request) {
+            struct io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = request->kind == iorequest::READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->fd = request->fd;
+            sqe->addr = (uint64_t) &request->iov;
+            sqe->len = 1;
+            sqe->off = request->offset;
+            sqe->user_data = (uint64_t) request;
+            ++ringPending;
+        }
+
+        /* have the ring complete when the pool has finished something */
+        void armWake() {
+            struct io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = wakeFd;
+            sqe->poll_events = POLLIN;
+            sqe->user_data = POOL_WAKE_TAG;
+            wakeArmed = true;
+        }
+
+        void submit(iorequest* request) {
+            if (++pending > highestPending) {
+                highestPending = pending;
+            }
+            if (request->kind != iorequest::WORK) {
+                if (ringPending < (long) sqEntries - 1) {
+                    queueOnRing(request);
+                } else {
+                    backlog.push_back(request);
+                }
+                return;
+            }
+            if (threads.empty()) {
+                startPool();
+            }
+            pthread_mutex_lock(&submitMutex);
+            submitted.push_back(request);
+            pthread_cond_signal(&submitCond);
+            pthread_mutex_unlock(&submitMutex);
+        }
+
+        void startPool() {
+            if (ringFd != -1) {
+                wakeFd = eventfd(0, EFD_CLOEXEC);
+                if (wakeFd == -1) {
+                    throw std::runtime_error("ioengine: could not create eventfd");
+                }
+                armWake();
+            }
+            threads.resize(numPoolThreads);
+            for (pthread_t& thread : threads) {
+                if (pthread_create(&thread, nullptr, &ioengine::worker, this) != 0) {
+                    throw std::runtime_error("ioengine: could not create thread");
+                }
+            }
+        }
+
+        /* submit what's queued, wait for at least one completion and resume whatever finished */
+        void waitRing() {
+            while (!backlog.empty() && ringPending < (long) sqEntries - 1) {
+                queueOnRing(backlog.front());
+                backlog.pop_front();
+            }
+            int submittedNow = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submittedNow < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                    return;
+                }
+                throw std::runtime_error(std::string("ioengine: io_uring_enter failed: ") + std::strerror(errno));
+            }
+            toSubmit -= std::min((unsigned) submittedNow, toSubmit);
+
+            /* take every cqe off the ring before resuming anything, resuming queues more sqes */
+            std::vector<std::coroutine_handle<>> resumed;
+            bool woken = false;
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                struct io_uring_cqe* cqe = &cqes[head & *cqMask];
+                if (cqe->user_data == POOL_WAKE_TAG) {
+                    woken = true;
+                    continue;
+                }
+                iorequest* request = (iorequest*) cqe->user_data;
+                request->result = cqe->res;
+                resumed.push_back(request->handle);
+                --ringPending;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            if (woken) {
+                /* clear the eventfd before looking at the queue, so work finished after this wakes the next poll */
+                uint64_t count;
+                if (::read(wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    throw std::runtime_error("ioengine: could not read eventfd");
+                }
+                pthread_mutex_lock(&completeMutex);
+                for (iorequest* request : completed) {
+                    resumed.push_back(request->handle);
+                }
+                completed.clear();
+                pthread_mutex_unlock(&completeMutex);
+                armWake();
+            }
+
+            /* the request lives in the coroutine frame, so only the handle is used from here */
+            for (std::coroutine_handle<> handle : resumed) {
+                --pending;
+                handle.resume();
+            }
+        }
+
+        void waitPool() {
+            std::deque<iorequest*> done;
+            pthread_mutex_lock(&completeMutex);
+            while (completed.empty()) {
+                pthread_cond_wait(&completeCond, &completeMutex);
+            }
+            done.swap(completed);
+            pthread_mutex_unlock(&completeMutex);
+
+            while (!done.empty()) {
+                std::coroutine_handle<> handle = done.front()->handle;
+                done.pop_front();
+                --pending;
+                handle.resume();
+            }
+        }
+
+        static void* worker(void* arg) {
+            ioengine* engine = (ioengine*) arg;
+            while (true) {
+                pthread_mutex_lock(&engine->submitMutex);
+                while (engine->submitted.empty() && !engine->stopping) {
+                    pthread_cond_wait(&engine->submitCond, &engine->submitMutex);
+                }
+                if (engine->submitted.empty()) {
+                    pthread_mutex_unlock(&engine->submitMutex);
+                    return nullptr;
+                }
+                iorequest* request = engine->submitted.front();
+                engine->submitted.pop_front();
+                pthread_mutex_unlock(&engine->submitMutex);
+
+                try {
+                    request->result = request->work();
+                }
+                catch (...) {
+                    request->error = std::current_exception();
+                }
+
+                pthread_mutex_lock(&engine->completeMutex);
+                engine->completed.push_back(request);
+                pthread_cond_signal(&engine->completeCond);
+                pthread_mutex_unlock(&engine->completeMutex);
+                if (engine->wakeFd != -1) {
+                    uint64_t one = 1;
+                    if (::write(engine->wakeFd, &one, sizeof(one)) < 0) {
+                        /* the counter only overflows after 2^64 - 1 unread wakes, and any wake is enough */
+                    }
+                }
+            }
+        }
+};
+
+/*
+* hands out turns in chunk order to coroutines that finish out of order,
+* e.g. so a transform that changes sizes can give each chunk its place in the outfile,
+* only used from the loop thread
+*/
+class chunkturns
+{
+    public:
+        /* chunk whose turn it is */
+        long next;
+
+        chunkturns(ioengine& e) : next(0), engine(&e) {};
+
+        class awaitable
+        {
+            public:
+                chunkturns* turns;
+                long chunk;
+                bool await_ready() const noexcept { return chunk == turns->next; }
+                void await_suspend(std::coroutine_handle<> h) { turns->waiting[chunk] = h; }
+                void await_resume() const noexcept {}
+        };
+
+        /* co_await until it's chunk's turn */
+        awaitable turn(long chunk) {
+            return awaitable{this, chunk};
+        }
+
+        /* end the current turn and wake the next chunk if it's already waiting */
+        void pass() {
+            auto it = waiting.find(++next);
+            if (it != waiting.end()) {
+                engine->post(it->second);
+                waiting.erase(it);
+            }
+        }
+
+    private:
+        ioengine* engine;
+        std::map<long, std::coroutine_handle<>> waiting;
+};
+
+/*
+* return type for the copier's coroutines
+* they start straight away and free themselves when they finish,
+* the engine only needs to know how many are still alive
+*/
+class copytask
+{
+    public:
+        class promise_type
+        {
+            public:
+                ioengine* engine;
+                template <typename... Args>
+                promise_type(ioengine& e, Args&...) : engine(&e) {
+                    ++engine->liveTasks;
+                }
+                copytask get_return_object() { return copytask(); }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept {
+                    --engine->liveTasks;
+                    return {};
+                }
+                void return_void() {}
+                void unhandled_exception() {
+                    if (!engine->error) {
+                        engine->error = std::current_exception();
+                    }
+                }
+        };
+};
+
+#endif
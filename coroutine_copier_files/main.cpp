@@ -0,0 +1,306 @@
+/*
+This copies files with C++20 coroutines instead of a thread per job
+each chunk in flight is a coroutine which co_awaits its read, an optional
+transform and its write, the reads and writes are queued on an io_uring
+(set up with the raw syscalls, no liburing needed) and one loop resumes
+whichever coroutine's cqe just came in, so thousands of chunks can be in
+the kernel at once without a thread each
+
+epoll can't wait on regular files, so when io_uring_setup fails a small
+fixed pool of threads runs the syscalls instead, the pool also runs the
+transform so its cpu time doesn't hold up the loop
+*/
+
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ioengine.h"
+#include "resourceusage.h"
+#include "transform.h"
+
+/*----CONSTANTS----*/
+/* cmd args position for infile */
+#define INFILE_INDX 1
+/* cmd args position for outfile */
+#define OUTFILE_INDX 2
+/* cmd args position where the optional flags start */
+#define OPTIONS_INDX 3
+/* min number of cmd args */
+#define MIN_NUM_ARGS 3
+/* num bytes read at a time */
+#define READ_CHUNK 32768
+/* default number of threads running syscalls */
+#define DEFAULT_IO_THREADS 4
+/* default number of chunk coroutines in flight */
+#define DEFAULT_INFLIGHT 256
+/* file open error*/
+#define FILE_OPEN_ERR -1
+/* convert nano seconds to ms*/
+#define NANO_PER_MS 1000000
+/* convert nano seconds to s*/
+#define NANO_PER_SEC 1000000000.0
+/* bytes in a GB */
+#define BYTES_PER_GB 1000000000.0
+/* read write access */
+#define READ_WRITE_ACCESS 0644
+
+/*----GLOBAL VARIABLES-----*/
+/* whether we should show the time */
+bool showTime = false;
+/* number of pool threads, for the transform and for the syscalls when there's no io_uring */
+int numIOThreads = DEFAULT_IO_THREADS;
+/* number of chunk coroutines in flight */
+int numInflight = DEFAULT_INFLIGHT;
+/* run the syscalls on the pool even when io_uring is there */
+bool usePool = false;
+/* next chunk to be claimed, only touched from the loop thread */
+long nextChunk = 0;
+/* chunks copied */
+long chunksCopied = 0;
+/* the transform run on every chunk between its read and its write, nullptr to copy as is */
+chunktransform* transformStage = nullptr;
+/* where the next transformed chunk goes in the outfile, handed out in chunk order */
+long nextOutputOffset = 0;
+/* bytes into and out of the transform stage */
+long transformInBytes = 0;
+long transformOutBytes = 0;
+
+/* used to time functions */
+std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
+    auto start = std::chrono::high_resolution_clock::now();
+    func();
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+    return duration;
+}
+
+/* function which is used to hopefully get a file's size */
+long getFileSize(const char* fileName) {
+    struct stat st;
+    if (stat(fileName, &st) == 0) {
+        return st.st_size;
+    }
+    return -1;
+}
+
+/*
+* one chunk slot in flight
+* keeps claiming the next chunk, reading it, transforming it and writing it until the file runs out
+*/
+copytask copyChunks(ioengine& engine, chunkturns& turns, int infile, int outfile, long infileSize, long numChunks) {
+    long framedChunks = transformStage != nullptr ? transformStage->inputChunks() : -1;
+    std::vector<char> buffer(transformStage != nullptr ? transformStage->maxInputChunk(READ_CHUNK) : READ_CHUNK);
+
+    while (nextChunk < numChunks) {
+        long chunk = nextChunk++;
+        /* a transform with its own framing says where each of its chunks is */
+        long offset = framedChunks >= 0 ? transformStage->inputOffset(chunk) : chunk * READ_CHUNK;
+        long length = framedChunks >= 0 ? transformStage->inputOffset(chunk + 1) - offset
+            : std::min((long) READ_CHUNK, infileSize - offset);
+        if (length > (long) buffer.size()) {
+            throw std::runtime_error("copyChunks: infile chunk is bigger than the transform allows");
+        }
+
+        /* read stage */
+        long got = 0;
+        while (got < length) {
+            long n = co_await engine.read(infile, buffer.data() + got, length - got, offset + got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        if (got != length) {
+            throw std::runtime_error("copyChunks: short read from infile");
+        }
+
+        /* transform stage, on the pool, then wait for this chunk's place in the outfile */
+        char* data = buffer.data();
+        long outputOffset = offset;
+        std::string transformed;
+        if (transformStage != nullptr) {
+            co_await engine.offload([&transformed, &buffer, length] {
+                transformed = transformStage->apply(std::string(buffer.data(), length));
+                return (long) transformed.length();
+            });
+            co_await turns.turn(chunk);
+            outputOffset = nextOutputOffset;
+            nextOutputOffset += transformed.length();
+            transformInBytes += length;
+            transformOutBytes += transformed.length();
+            transformStage->written(transformed, outputOffset);
+            turns.pass();
+            data = transformed.data();
+            length = transformed.length();
+        }
+
+        /* write stage */
+        long put = 0;
+        while (put < length) {
+            long n = co_await engine.write(outfile, data + put, length - put, outputOffset + put);
+            if (n <= 0) {
+                break;
+            }
+            put += n;
+        }
+        if (put != length) {
+            throw std::runtime_error("copyChunks: short write to outfile");
+        }
+
+        ++chunksCopied;
+    }
+}
+
+/* open the files, start the chunk coroutines and drive them to the end */
+long copyFile(ioengine& engine, const char* infileName, const char* outfileName) {
+    int infile = open(infileName, O_RDONLY);
+    if (infile == FILE_OPEN_ERR) {
+        throw std::runtime_error("copyFile: cannot find infile");
+    }
+
+    int outfile = open(outfileName, O_WRONLY|O_CREAT|O_TRUNC, READ_WRITE_ACCESS);
+    if (outfile == FILE_OPEN_ERR) {
+        throw std::runtime_error("copyFile: cannot find outfile");
+    }
+
+    long infileSize = getFileSize(infileName);
+
+    /* no point starting more coroutines than there are chunks */
+    long numChunks = (infileSize + READ_CHUNK - 1) / READ_CHUNK;
+    if (transformStage != nullptr && transformStage->inputChunks() >= 0) {
+        numChunks = transformStage->inputChunks();
+    }
+    long numTasks = std::min((long) numInflight, numChunks);
+    chunkturns turns(engine);
+    for (long i = 0; i < numTasks; ++i) {
+        copyChunks(engine, turns, infile, outfile, infileSize, numChunks);
+    }
+    engine.run();
+
+    /* the transform gets the last word in the outfile, and a decompressed file has to come out the size it was */
+    if (transformStage != nullptr) {
+        std::string trailer = transformStage->trailer();
+        if (pwrite(outfile, trailer.data(), trailer.length(), nextOutputOffset) != (ssize_t) trailer.length()) {
+            throw std::runtime_error("copyFile: could not write the transform's trailer");
+        }
+        if (transformStage->expectedSize() >= 0 && nextOutputOffset != transformStage->expectedSize()) {
+            throw std::runtime_error("copyFile: the transformed outfile is the wrong size");
+        }
+    }
+
+    close(infile);
+    close(outfile);
+    return numTasks;
+}
+
+int main(int argc, char** argv) {
+
+    const std::string cmdErrorMessage = "main: the correct command is: ./ccopier <infile> <outfile> <optional -t> <optional --io-threads <#threads>> <optional --inflight <#chunks>> <optional --transform <compress|decompress>> <optional --pool>";
+    const std::string timerFlag = "-t";
+    const std::string ioThreadsFlag = "--io-threads";
+    const std::string inflightFlag = "--inflight";
+    const std::string transformFlag = "--transform";
+    const std::string poolFlag = "--pool";
+    std::string transformName;
+
+    /* check number of cmd args */
+    if (argc < MIN_NUM_ARGS) {
+        throw std::runtime_error(cmdErrorMessage);
+    }
+
+    /* the cmd args */
+    char* infileName = argv[INFILE_INDX];
+    char* outfileName = argv[OUTFILE_INDX];
+
+    /* check the optional flags */
+    for (int i = OPTIONS_INDX; i < argc; ++i) {
+        if (argv[i] == timerFlag) {
+            showTime = true;
+        } else if (argv[i] == poolFlag) {
+            usePool = true;
+        } else if (argv[i] == transformFlag && i + 1 < argc) {
+            transformName = argv[++i];
+        } else if ((argv[i] == ioThreadsFlag || argv[i] == inflightFlag) && i + 1 < argc) {
+            int* count = argv[i] == ioThreadsFlag ? &numIOThreads : &numInflight;
+            try {
+                *count = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid count command argument format");
+            }
+            if (*count < 1) {
+                throw std::runtime_error("main: count command argument cannot be below 1");
+            }
+        } else {
+            throw std::runtime_error(cmdErrorMessage);
+        }
+    }
+
+    if (!transformName.empty()) {
+        transformStage = chunktransform::named(transformName, infileName);
+        if (transformStage == nullptr) {
+            throw std::runtime_error("main: unknown transform " + transformName + ", it can be compress or decompress");
+        }
+    }
+
+    /* snapshot the process counters so only the copy gets counted */
+    resourceusage startProcessUsage = resourceusage::ofProcess();
+    processio startProcessIO = processio::current();
+
+    ioengine engine(numIOThreads, numInflight, !usePool);
+    long numTasks = 0;
+    long totalActualTime = timeFunction([&engine, &numTasks, &infileName, &outfileName]{
+        numTasks = copyFile(engine, infileName, outfileName);
+    }).count();
+
+    resourceusage processUsage = resourceusage::ofProcess() - startProcessUsage;
+    processio processIO = processio::current() - startProcessIO;
+    long bytesCopied = getFileSize(infileName);
+
+    /* display the times */
+    if (showTime) {
+        std::cout << "===FINAL STATS===" << std::endl;
+        if (engine.usingRing()) {
+            std::cout << "IO ENGINE: io_uring, " << engine.ringEntries() << " entries" << std::endl;
+        } else {
+            std::cout << "IO ENGINE: thread pool (" << engine.fallbackReason << ")" << std::endl;
+        }
+        std::cout << "POOL THREADS: " << engine.poolThreads() << std::endl;
+        std::cout << "CHUNK COROUTINES: " << numTasks << std::endl;
+        std::cout << "CHUNKS COPIED: " << chunksCopied << std::endl;
+        std::cout << "HIGHEST PENDING REQUESTS: " << engine.highestPending << std::endl;
+        if (transformStage != nullptr) {
+            std::cout << "TRANSFORM " << transformStage->name() << ": " << transformInBytes << " bytes in, " << transformOutBytes << " bytes out";
+            if (transformInBytes > 0 && transformOutBytes > 0) {
+                std::cout << " (ratio " << (double) transformInBytes / transformOutBytes << ")";
+            }
+            std::cout << std::endl;
+        }
+        std::cout << "TOTAL ACTUAL TIME: " << totalActualTime / NANO_PER_MS << " ms" << std::endl;
+
+        std::cout << "===RESOURCE STATS===" << std::endl;
+        std::cout << "PROCESS VOLUNTARY CONTEXT SWITCHES: " << processUsage.voluntarySwitches << std::endl;
+        std::cout << "PROCESS INVOLUNTARY CONTEXT SWITCHES: " << processUsage.involuntarySwitches << std::endl;
+        std::cout << "PROCESS MINOR FAULTS: " << processUsage.minorFaults << std::endl;
+        std::cout << "PROCESS MAJOR FAULTS: " << processUsage.majorFaults << std::endl;
+        std::cout << "PROCESS CPU TIME: " << processUsage.cpuTime / NANO_PER_MS << " ms" << std::endl;
+        std::cout << "PROCESS READ CHARS: " << processIO.readChars << std::endl;
+        std::cout << "PROCESS WRITE CHARS: " << processIO.writeChars << std::endl;
+        std::cout << "PROCESS STORAGE READ BYTES: " << processIO.readBytes << std::endl;
+        std::cout << "PROCESS STORAGE WRITE BYTES: " << processIO.writeBytes << std::endl;
+        if (bytesCopied > 0) {
+            std::cout << "CPU SECONDS PER GB: " << (processUsage.cpuTime / NANO_PER_SEC) / (bytesCopied / BYTES_PER_GB) << std::endl;
+        }
+    }
+
+    delete transformStage;
+    return EXIT_SUCCESS;
+}
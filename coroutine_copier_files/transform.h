@@ -0,0 +1,303 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* shortest match worth a sequence */
+#define LZ_MIN_MATCH 4
+/* furthest back a match can be, offsets are 16 bits */
+#define LZ_MAX_OFFSET 65535
+/* bits of the compressor's hash table */
+#define LZ_HASH_BITS 13
+/* set in a frame's stored length when the payload is compressed rather than the chunk as it was */
+#define FRAME_COMPRESSED 0x80000000u
+/* first 8 bytes of the footer at the end of a compressed file */
+#define FRAME_MAGIC "MTCLZ01"
+
+/*
+* lz77 block codec in the same shape as lz4 blocks: a sequence is a token (literal length
+* in the high nibble, match length - 4 in the low one, 15 meaning more length bytes follow),
+* the literals, a 16 bit offset back and any more match length, the last sequence is only literals
+*/
+class lzcodec
+{
+    public:
+        static std::string compress(const char* src, long length) {
+            std::string out;
+            out.reserve(length + length / 255 + 16);
+            std::vector<int32_t> table(1 << LZ_HASH_BITS, -1);
+
+            long anchor = 0;
+            long pos = 0;
+            long misses = 0;
+            while (pos + LZ_MIN_MATCH <= length) {
+                uint32_t sequence = read32(src + pos);
+                uint32_t slot = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+                long candidate = table[slot];
+                table[slot] = pos;
+                if (candidate < 0 || pos - candidate > LZ_MAX_OFFSET || read32(src + candidate) != sequence) {
+                    /* skip faster through data that isn't matching */
+                    pos += 1 + (misses++ >> 6);
+                    continue;
+                }
+                misses = 0;
+                long matchLength = LZ_MIN_MATCH;
+                while (pos + matchLength < length && src[candidate + matchLength] == src[pos + matchLength]) {
+                    ++matchLength;
+                }
+                writeSequence(out, src + anchor, pos - anchor, pos - candidate, matchLength);
+                pos += matchLength;
+                anchor = pos;
+            }
+            writeSequence(out, src + anchor, length - anchor, 0, 0);
+            return out;
+        }
+
+        /* decompress into exactly rawLength bytes, throws if the block doesn't decode to that */
+        static std::string decompress(const char* src, long length, long rawLength) {
+            std::string out(rawLength, '\0');
+            long in = 0;
+            long pos = 0;
+            while (in < length) {
+                unsigned char token = src[in++];
+                long literals = readLength(src, length, in, token >> 4);
+                if (literals > length - in || literals > rawLength - pos) {
+                    throw std::runtime_error("lzcodec: literals run past the block");
+                }
+                std::memcpy(&out[pos], src + in, literals);
+                in += literals;
+                pos += literals;
+                if (in == length) {
+                    break;
+                }
+                if (in + 2 > length) {
+                    throw std::runtime_error("lzcodec: block cut short");
+                }
+                long offset = (unsigned char) src[in] | ((unsigned char) src[in + 1] << 8);
+                in += 2;
+                long matchLength = readLength(src, length, in, token & 15) + LZ_MIN_MATCH;
+                if (offset == 0 || offset > pos || matchLength > rawLength - pos) {
+                    throw std::runtime_error("lzcodec: match out of range");
+                }
+                /* byte at a time since a match can overlap what it's copying */
+                for (long i = 0; i < matchLength; ++i, ++pos) {
+                    out[pos] = out[pos - offset];
+                }
+            }
+            if (pos != rawLength) {
+                throw std::runtime_error("lzcodec: block decoded to the wrong length");
+            }
+            return out;
+        }
+
+    private:
+        static uint32_t read32(const char* p) {
+            uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        static void writeLength(std::string& out, long length) {
+            for (length -= 15; length >= 255; length -= 255) {
+                out.push_back((char) 255);
+            }
+            out.push_back((char) length);
+        }
+
+        static long readLength(const char* src, long length, long& in, long nibble) {
+            if (nibble < 15) {
+                return nibble;
+            }
+            long total = nibble;
+            unsigned char more;
+            do {
+                if (in >= length) {
+                    throw std::runtime_error("lzcodec: block cut short");
+                }
+                more = src[in++];
+                total += more;
+            } while (more == 255);
+            return total;
+        }
+
+        static void writeSequence(std::string& out, const char* literals, long numLiterals, long offset, long matchLength) {
+            long matchNibble = matchLength == 0 ? 0 : matchLength - LZ_MIN_MATCH;
+            out.push_back((char) ((std::min(numLiterals, 15L) << 4) | std::min(matchNibble, 15L)));
+            if (numLiterals >= 15) {
+                writeLength(out, numLiterals);
+            }
+            out.append(literals, numLiterals);
+            if (matchLength == 0) {
+                return;
+            }
+            out.push_back((char) (offset & 0xFF));
+            out.push_back((char) (offset >> 8));
+            if (matchNibble >= 15) {
+                writeLength(out, matchNibble);
+            }
+        }
+};
+
+/* what goes in front of every chunk in a compressed file */
+struct frameheader
+{
+    uint32_t rawLength;
+    uint32_t storedLength;
+};
+
+/* the end of a compressed file, after the index of where each frame starts */
+struct framefooter
+{
+    char magic[8];
+    uint64_t frameCount;
+    uint64_t rawSize;
+    uint64_t indexOffset;
+};
+
+/*
+* a transform the pipeline runs on every chunk between the readers and the writers
+* apply gets called from several threads at once on different chunks, so it can't keep state,
+* written is called in file order as each transformed chunk goes into the outfile,
+* trailer is appended to the outfile at the end, and a transform whose input isn't plain
+* READ_CHUNK sized chunks says where its input chunks are with inputChunks and inputOffset
+*/
+class chunktransform
+{
+    public:
+        virtual ~chunktransform() {};
+        virtual const char* name() const = 0;
+        virtual std::string apply(const std::string& chunk) const = 0;
+        virtual void written(const std::string& chunk, long offset) {};
+        virtual std::string trailer() { return ""; };
+        /* number of chunks in the infile, -1 if the readers cut it up as usual */
+        virtual long inputChunks() const { return -1; };
+        /* where a chunk starts in the infile, chunk inputChunks() is where the last one ends */
+        virtual long inputOffset(long chunk) const { return 0; };
+        /* most bytes one input chunk can take up */
+        virtual long maxInputChunk(long readChunk) const { return readChunk; };
+        /* how big the output has to come out, -1 if it could be anything */
+        virtual long expectedSize() const { return -1; };
+
+        /* the built in transform with this name, nullptr if there isn't one */
+        static chunktransform* named(const std::string& name, const char* infileName);
+};
+
+/* compresses each chunk into its own frame and indexes the frames so they can be decompressed in parallel */
+class lzcompressor : public chunktransform
+{
+    public:
+        const char* name() const override { return "compress"; }
+
+        std::string apply(const std::string& chunk) const override {
+            if (chunk.empty()) {
+                return chunk;
+            }
+            std::string compressed = lzcodec::compress(chunk.data(), chunk.length());
+            /* chunks that don't shrink are stored as they are */
+            bool keep = compressed.length() < chunk.length();
+            const std::string& payload = keep ? compressed : chunk;
+            frameheader header = {(uint32_t) chunk.length(), (uint32_t) payload.length() | (keep ? FRAME_COMPRESSED : 0)};
+            std::string frame((const char*) &header, sizeof(header));
+            frame += payload;
+            return frame;
+        }
+
+        void written(const std::string& chunk, long offset) override {
+            if (chunk.empty()) {
+                return;
+            }
+            frameOffsets.push_back(offset);
+            rawSize += ((const frameheader*) chunk.data())->rawLength;
+            end = offset + chunk.length();
+        }
+
+        std::string trailer() override {
+            std::string out((const char*) frameOffsets.data(), frameOffsets.size() * sizeof(uint64_t));
+            framefooter footer;
+            std::memcpy(footer.magic, FRAME_MAGIC, sizeof(footer.magic));
+            footer.frameCount = frameOffsets.size();
+            footer.rawSize = rawSize;
+            footer.indexOffset = end;
+            out.append((const char*) &footer, sizeof(footer));
+            return out;
+        }
+
+    private:
+        std::vector<uint64_t> frameOffsets;
+        uint64_t rawSize = 0;
+        uint64_t end = 0;
+};
+
+/* reads a compressed file's index so the readers can hand out whole frames, and decompresses each one */
+class lzdecompressor : public chunktransform
+{
+    public:
+        uint64_t rawSize;
+
+        lzdecompressor(const char* infileName) : rawSize(0) {
+            std::ifstream in(infileName, std::ifstream::binary);
+            framefooter footer;
+            in.seekg(0, std::ios::end);
+            long size = in.tellg();
+            if (size < (long) sizeof(footer)) {
+                throw std::runtime_error("lzdecompressor: infile is too small to be compressed");
+            }
+            in.seekg(size - sizeof(footer));
+            in.read((char*) &footer, sizeof(footer));
+            if (!in || std::memcmp(footer.magic, FRAME_MAGIC, sizeof(footer.magic)) != 0
+                || footer.indexOffset + footer.frameCount * sizeof(uint64_t) + sizeof(footer) != (uint64_t) size) {
+                throw std::runtime_error("lzdecompressor: infile wasn't compressed by mtcopier");
+            }
+            frameOffsets.resize(footer.frameCount + 1);
+            in.seekg(footer.indexOffset);
+            in.read((char*) frameOffsets.data(), footer.frameCount * sizeof(uint64_t));
+            frameOffsets[footer.frameCount] = footer.indexOffset;
+            rawSize = footer.rawSize;
+            if (!in || frameOffsets[0] != 0 || !std::is_sorted(frameOffsets.begin(), frameOffsets.end())) {
+                throw std::runtime_error("lzdecompressor: infile's frame index is damaged");
+            }
+        }
+
+        const char* name() const override { return "decompress"; }
+
+        std::string apply(const std::string& chunk) const override {
+            if (chunk.empty()) {
+                return chunk;
+            }
+            const frameheader* header = (const frameheader*) chunk.data();
+            long stored = header->storedLength & ~FRAME_COMPRESSED;
+            if ((long) (sizeof(frameheader) + stored) != (long) chunk.length()) {
+                throw std::runtime_error("lzdecompressor: frame is the wrong size");
+            }
+            if (!(header->storedLength & FRAME_COMPRESSED)) {
+                return chunk.substr(sizeof(frameheader));
+            }
+            return lzcodec::decompress(chunk.data() + sizeof(frameheader), stored, header->rawLength);
+        }
+
+        long inputChunks() const override { return frameOffsets.size() - 1; }
+        long inputOffset(long chunk) const override { return frameOffsets[chunk]; }
+        long maxInputChunk(long readChunk) const override { return readChunk + sizeof(frameheader); }
+        long expectedSize() const override { return rawSize; }
+
+    private:
+        std::vector<uint64_t> frameOffsets;
+};
+
+inline chunktransform* chunktransform::named(const std::string& name, const char* infileName) {
+    if (name == "compress") {
+        return new lzcompressor();
+    }
+    if (name == "decompress") {
+        return new lzdecompressor(infileName);
+    }
+    return nullptr;
+}
+
+#endif
@@ -11,13 +11,26 @@ so I can see the true execution times for this copier
 #include <chrono>
 #include <functional>
 #include <sstream>
-#include <queue>
-#include <fstream>
+#include <map>
 #include <vector>
 #include <numeric>
 #include <iterator>
+#include <algorithm>
+#include <string>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <deque>
 
 #include "threadtimes.h"
+#include "resourceusage.h"
+#include "simdscan.h"
+#include "tcptransport.h"
+#include "transform.h"
+#include "waitqueue.h"
 
 /*----CONSTANTS----*/
 /* cmd args position for number of threads*/
@@ -26,20 +39,44 @@ so I can see the true execution times for this copier
 #define INFILE_INDX 2
 /* cmd args position for outfile */
 #define OUTFILE_INDX 3
-/* cmd args position for timer flag*/
-#define TIMER_INDEX 4
+/* cmd args position where the optional flags start */
+#define OPTIONS_INDX 4
 /* min number of cmd args */
 #define MIN_NUM_ARGS 4
-/* max number of cmd args*/
-#define MAX_NUM_ARGS 5
 /* num bytes read at a time */
 #define READ_CHUNK 32768
+/* default number of chunks a reader reads in one go */
+#define DEFAULT_READ_BATCH 8
 /* value for successful thread create or join*/
 #define THREAD_SUCCESS 0
 /* max size for the queue */
 #define QUEUE_MAX_SIZE 1024
+/* default number of bytes allowed between the readers and writers */
+#define DEFAULT_MAX_INFLIGHT (QUEUE_MAX_SIZE * (long) READ_CHUNK)
+/* most threads the adaptive controller can grow either pool to */
+#define MAX_POOL_THREADS 64
+/* how often the adaptive controller samples the pipeline */
+#define CONTROLLER_INTERVAL_MS 50
+/* inflight occupancy (percent of the budget) above which the writers are falling behind */
+#define HIGH_OCCUPANCY_PERCENT 75
+/* inflight occupancy (percent of the budget) below which the readers are falling behind */
+#define LOW_OCCUPANCY_PERCENT 25
+/* throughput drop (percent) after a change that makes the controller undo it */
+#define THROUGHPUT_DROP_PERCENT 10
+/* convert ms to micro seconds */
+#define US_PER_MS 1000
 /* convert nano seconds to ms*/
 #define NS_PER_MS 1000000
+/* convert nano seconds to s*/
+#define NS_PER_SEC 1000000000.0
+/* bytes in a GB */
+#define BYTES_PER_GB 1000000000.0
+/* bytes in a MB */
+#define BYTES_PER_MB 1000000.0
+/* most a receiver moves from its connection to the outfile in one go */
+#define RECEIVE_PIECE (1024 * 1024)
+/* what open returns when it fails */
+#define FILE_OPEN_ERR -1
 
 /* whether to show the time for each thread */
 //#define SHOW_EACH_THREAD_TIME
@@ -49,12 +86,25 @@ so I can see the true execution times for this copier
 //#define SHOW_HIGHEST_QUEUE_SIZE
 
 /*----GLOBAL VARIABLES----*/
-/* the input file*/
-std::ifstream infile;
-/* the ouput file*/
-std::ofstream outfile;
-/* the queue to hold the file chunks */
-std::priority_queue<std::pair<long, std::string>, std::vector<std::pair<long, std::string>>, std::greater<std::pair<long, std::string>>> queue;
+/* the input file, read a batch of chunks per readv */
+int infile = FILE_OPEN_ERR;
+/* the ouput file, written a batch of chunks per pwritev */
+int outfile = FILE_OPEN_ERR;
+/* the queue to hold the file chunks, keyed (and so ordered) by their chunk index */
+std::map<long, std::string> queue;
+/* number of chunks a reader reads in one go */
+int readBatch = DEFAULT_READ_BATCH;
+/* whether a reader has hit the end of the infile, guarded by infileMutex */
+bool eofReached = false;
+/* number of chunks in the file, known once the end is read */
+long totalChunks = -1;
+/* index of the next chunk a writer will take from the queue */
+long nextChunkToTake = 0;
+/* index of the next chunk to go into the outfile, guarded by outfileMutex */
+long nextChunkToWrite = 0;
+/* number of batches written and the chunks in them */
+long writeBatches = 0;
+long writtenChunks = 0;
 /* whether the reader threads are still reading */
 bool reading = true;
 /* wether the writer threads are still writing */
@@ -65,25 +115,115 @@ pthread_mutex_t queueMutex;
 pthread_mutex_t infileMutex;
 /* mutex for outfile */
 pthread_mutex_t outfileMutex;
-/* conditional to check if queue has elements*/
-pthread_cond_t queueFullCond;
-/* conditional to check if the queue has space*/
-pthread_cond_t queueEmptyCond;
-
-pthread_cond_t writeFileCond;
-
-std::priority_queue<std::pair<long, std::string>, std::vector<std::pair<long, std::string>>, std::greater<std::pair<long, std::string>>> queue2;
-
-pthread_mutex_t queue2Mutex = PTHREAD_MUTEX_INITIALIZER;
+/* writers waiting for the next chunk in the file to be queued */
+waitqueue writersWaiting;
+/* transformers and senders waiting for any chunk to be queued */
+waitqueue takersWaiting;
+/* readers waiting for room in the inflight budget, keyed by their first chunk */
+waitqueue readersWaiting;
+/* writers waiting for their turn at the outfile, keyed by their first chunk */
+waitqueue writeTurns;
+/* how the threads wait on those */
+waitstrategy waitStrategy = waitstrategy::adaptive;
 
 /* whether to show the time*/
 bool showTime = false;
 
+/* number of reader and writer threads to start with */
+int numReaders = 0;
+int numWriters = 0;
+/* whether the adaptive controller resizes the pools while copying */
+bool adaptive = false;
+/* how many readers and writers should be running, a worker in a slot at or above this retires */
+std::atomic<int> targetReaders(0);
+std::atomic<int> targetWriters(0);
+/* the pool threads, one slot per thread the pool can hold */
+std::vector<pthread_t> readers;
+std::vector<pthread_t> writers;
+/* whether a slot has ever had a thread started in it (so it needs joining) */
+std::vector<bool> readerStarted;
+std::vector<bool> writerStarted;
+/* whether the thread in a slot hasn't exited yet */
+std::vector<bool> readerRunning;
+std::vector<bool> writerRunning;
+/* number of slots used so far */
+int readerSlots = 0;
+int writerSlots = 0;
+/* bytes that have made it to the outfile */
+long bytesWritten = 0;
+/* whether to seek over chunks that are all zeros instead of writing them */
+bool sparse = false;
+/* bytes of zeros seeked over, guarded by outfileMutex */
+long elidedBytes = 0;
+
+/* the transform run on every chunk between the queue and the writers, nullptr if they go straight through */
+chunktransform* transformStage = nullptr;
+/* the transformed chunks waiting for the writers, keyed by chunk index like queue */
+std::map<long, std::string> transformedQueue;
+/* number of transformer threads */
+int numTransformers = 0;
+/* chunks the transformers have taken, guarded by queueMutex */
+long transformTaken = 0;
+/* where the next chunk goes in the outfile, guarded by outfileMutex */
+long outputOffset = 0;
+/* bytes into and out of the transform stage, and the time the transformers spent in it */
+std::atomic<long> transformInBytes(0);
+std::atomic<long> transformOutBytes(0);
+std::atomic<long> transformBusyTime(0);
+/* record what the os charged each transformer thread */
+resourceusage* transformerUsage;
+
+/* where to send the chunks when the outfile is tcp:<host>:<port>, one connection per writer */
+std::string sendHost;
+std::string sendPort;
+/* port to take the chunks on when the infile is tcp:<port> */
+std::string receivePort;
+/* the outfile the receivers write to */
+std::string receiveOutfileName;
+/* the connections, indexed by writer slot */
+std::vector<int> connections;
+/* whether the senders ask for MSG_ZEROCOPY */
+bool zeroCopy = false;
+/* chunks the senders have taken and bytes the readers have read, guarded by queueMutex */
+long takenChunks = 0;
+long bytesRead = 0;
+/* what went over the connections */
+std::atomic<long> bytesSent(0);
+std::atomic<long> zeroCopySends(0);
+std::atomic<long> zeroCopyCopied(0);
+std::atomic<long> bytesReceived(0);
+std::atomic<long> splicedBytes(0);
+/* what the receivers did: runs of chunks taken, reads from their sockets, and their time waiting and writing */
+std::atomic<long> receivedRuns(0);
+std::atomic<long> socketReads(0);
+std::atomic<long> receiveWaitTime(0);
+std::atomic<long> receiveWriteTime(0);
+/* the biggest receive buffer the kernel gave a connection */
+std::atomic<int> receiveBufferBytes(0);
+/* size of the file the sender sent, -1 until a connection ends */
+std::atomic<long> receivedFileSize(-1);
+/* the decisions the adaptive controller made */
+std::vector<std::string> controllerLog;
+
+/* bytes read but not yet written (queued or held by a writer) */
+long inflightBytes = 0;
+/* max bytes allowed in flight before readers block */
+long maxInflightBytes = DEFAULT_MAX_INFLIGHT;
+/* highest number of bytes in flight achieved */
+long highestInflightBytes = 0;
+/* total time readers spent blocked on the inflight budget */
+long throttledTime = 0;
+
 #ifdef SHOW_HIGHEST_QUEUE_SIZE
 /* track the highest queue size achieved */
 unsigned int highestQueueSize = 0;
 #endif
 
+/* record what the os charged each reader thread */
+resourceusage* readerUsage;
+/* record what the os charged each writer thread */
+resourceusage* writerUsage;
+
 #ifdef SHOW_OTHER_TIMES
 /* record the times for reader threads */
 threadtimes* readerTimes;
@@ -91,9 +231,8 @@ threadtimes* readerTimes;
 threadtimes* writerTimes;
 #endif
 
+/* number of chunk indexes handed out to readers */
 long linesRead = 0;
-long linesWritten = 0;
-
 
 /* used to time functions */
 std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
@@ -104,28 +243,83 @@ std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
     return duration;
 }
 
+/* parse a byte count with an optional K, M or G suffix */
+long parseByteSize(const std::string& str) {
+    size_t end = 0;
+    long bytes = std::stol(str, &end);
+    if (end < str.size()) {
+        if (end + 1 != str.size()) {
+            throw std::invalid_argument(str);
+        }
+        switch (str[end]) {
+            case 'K': case 'k': bytes *= 1024L; break;
+            case 'M': case 'm': bytes *= 1024L * 1024L; break;
+            case 'G': case 'g': bytes *= 1024L * 1024L * 1024L; break;
+            default: throw std::invalid_argument(str);
+        }
+    }
+    return bytes;
+}
+
+/* function which is used to hopefully get a file's size */
+long getFileSize(const char* fileName) {
+    struct stat st;
+    if (stat(fileName, &st) == 0) {
+        return st.st_size;
+    }
+    return -1;
+}
+
+/* write the chunks in iov (none of them empty) to the outfile at offset with as few pwritev calls as a short write allows, and empty iov */
+void writeChunks(std::vector<struct iovec>& iov, long offset)
+{
+    size_t first = 0;
+    while (first < iov.size()) {
+        ssize_t written = pwritev(outfile, &iov[first], iov.size() - first, offset);
+        if (written <= 0) {
+            throw std::runtime_error("writer: could not write the outfile");
+        }
+        offset += written;
+
+        /* skip what made it out, a short write can leave part of a chunk behind */
+        while (first < iov.size() && written >= (ssize_t) iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            ++first;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = (char*) iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+    iov.clear();
+}
+
 /* reader thread */
 void* reader(void* arg)
 {
-    /* buffer to read file chunks at a time */
-    char buffer[READ_CHUNK];
+    /* a batch of file chunks read straight into the strings that get queued, one iovec per chunk */
+    long maxChunk = transformStage != nullptr ? transformStage->maxInputChunk(READ_CHUNK) : READ_CHUNK;
+    std::vector<std::string> chunks(readBatch);
+    std::vector<struct iovec> iov(readBatch);
 
     /* the parameters */
     int* params = (int*) arg;
 
-    #ifdef SHOW_OTHER_TIMES
     /* get the thread id */
     int index = *params;
 
+    #ifdef SHOW_OTHER_TIMES
     /* store the total times */
     long totalReadTime = 0;
     long totalReadLockWaitTime = 0;
     long totalReadBusyWaitTime = 0;
     #endif
 
-    long chunkIndex;
-
-    while (reading) {
+    while (true) {
+        /* retire if the controller has shrunk the pool below this slot */
+        if (index >= targetReaders) {
+            break;
+        }
 
         /* lock the infile mutex */
         #ifdef SHOW_OTHER_TIMES
@@ -136,20 +330,84 @@ void* reader(void* arg)
         }).count();
         #endif
 
-        /* read the from the file */
+        /* someone else already read the end of the file */
+        if (eofReached) {
+            pthread_mutex_unlock(&infileMutex);
+            break;
+        }
+
+        /* a transform with its own framing says how big each of the next batch of chunks is */
+        long framedChunks = transformStage != nullptr ? transformStage->inputChunks() : -1;
+        long framesInBatch = framedChunks >= 0 ? std::min((long) readBatch, framedChunks - linesRead) : readBatch;
+        long wanted = 0;
+        for (long i = 0; i < framesInBatch; ++i) {
+            long size = READ_CHUNK;
+            if (framedChunks >= 0) {
+                size = transformStage->inputOffset(linesRead + i + 1) - transformStage->inputOffset(linesRead + i);
+                if (size > maxChunk) {
+                    throw std::runtime_error("reader: the frames in the infile are bigger than the read buffer");
+                }
+            }
+            chunks[i].resize(size);
+            iov[i].iov_base = chunks[i].data();
+            iov[i].iov_len = size;
+            wanted += size;
+        }
+
+        /* read the batch with one readv, more only if it comes up short before the end of the file */
+        long len = 0;
         #ifdef SHOW_OTHER_TIMES
-        totalReadTime += timeFunction([&buffer] {
+        totalReadTime += timeFunction([&iov, framesInBatch, wanted, &len] {
         #endif
-            infile.read(buffer, READ_CHUNK);
+            long first = 0;
+            while (len < wanted) {
+                ssize_t got = readv(infile, &iov[first], framesInBatch - first);
+                if (got < 0) {
+                    throw std::runtime_error("reader: could not read the infile");
+                }
+                if (got == 0) {
+                    break;
+                }
+                len += got;
+                while (first < framesInBatch && got >= (ssize_t) iov[first].iov_len) {
+                    got -= iov[first].iov_len;
+                    ++first;
+                }
+                if (first < framesInBatch) {
+                    iov[first].iov_base = (char*) iov[first].iov_base + got;
+                    iov[first].iov_len -= got;
+                }
+            }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
-        /* get the number of bytes actually read */
-        std::streamsize len = infile.gcount();
-
-        chunkIndex = linesRead;
-        ++linesRead;
+        /* 
+        * claim the chunk indexes for the batch
+        * an empty read still takes one so the writers see the end of the file
+        */
+        long firstChunk = linesRead;
+        long numChunks;
+        bool lastBatch;
+        if (framedChunks >= 0) {
+            if (len != wanted) {
+                throw std::runtime_error("reader: the infile ended in the middle of a frame");
+            }
+            numChunks = std::max(framesInBatch, 1L);
+            lastBatch = firstChunk + framesInBatch >= framedChunks;
+        } else {
+            /* only the last chunk read can be short, the ones after it weren't reached */
+            numChunks = len == 0 ? 1 : (len + READ_CHUNK - 1) / READ_CHUNK;
+            chunks[numChunks - 1].resize(len - (numChunks - 1) * READ_CHUNK);
+            lastBatch = len < wanted;
+        }
+        if (framesInBatch == 0) {
+            chunks[0].clear();
+        }
+        linesRead += numChunks;
+        if (lastBatch) {
+            eofReached = true;
+        }
 
         /* unlock the infile mutex */
         pthread_mutex_unlock(&infileMutex);
@@ -163,54 +421,81 @@ void* reader(void* arg)
         }).count();
         #endif
 
-        /* keep waiting until the queue has space */
+        /* 
+        * keep waiting until there is budget for this batch, nothing in flight always takes one
+        * and neither does the batch the writers are waiting on
+        */
         #ifdef SHOW_OTHER_TIMES
-        totalReadBusyWaitTime += timeFunction([] {
+        totalReadBusyWaitTime += timeFunction([len, firstChunk] {
         #endif
-            while (queue.size() >= QUEUE_MAX_SIZE && reading) {
-                pthread_cond_wait(&queueEmptyCond, &queueMutex);
+            if (inflightBytes > 0 && inflightBytes + len > maxInflightBytes && firstChunk != nextChunkToTake) {
+                throttledTime += timeFunction([len, firstChunk] {
+                    while (inflightBytes > 0 && inflightBytes + len > maxInflightBytes && firstChunk != nextChunkToTake) {
+                        readersWaiting.wait(&queueMutex, firstChunk);
+                    }
+                }).count();
             }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
+        /* push the read chunks to the queue */
+        for (long i = 0; i < numChunks; ++i) {
+            queue.emplace(firstChunk + i, std::move(chunks[i]));
+        }
 
-        /* push the file chunk to the queue */
-        if (reading) {
-            /* push read chunk to queue */
+        /* keep track of the bytes in flight */
+        inflightBytes += len;
+        bytesRead += len;
+        if (inflightBytes > highestInflightBytes) {
+            highestInflightBytes = inflightBytes;
+        }
 
-            // std::cout << chunkIndex << ": " << std::string(buffer, len).substr(0, 10) << std::endl;
-            queue.push(std::make_pair(chunkIndex, std::string(buffer, len)));
+        #ifdef SHOW_HIGHEST_QUEUE_SIZE
+        /* keep track of the highest queue size*/
+        if (queue.size() > highestQueueSize) {
+            highestQueueSize = queue.size();
+        }
+        #endif
 
-            #ifdef SHOW_HIGHEST_QUEUE_SIZE
-            /* keep track of the highest queue size*/
-            if (queue.size() > highestQueueSize) {
-                highestQueueSize = queue.size();
-            }
-            #endif
+        /* the end of the file tells the writers how many chunks there are */
+        if (lastBatch) {
+            totalChunks = firstChunk + numChunks;
+            reading = false;
+        }
 
-            /* stop the loop when the end of file is reached*/
-            if (infile.eof()) {
-                reading = false;
-                pthread_cond_broadcast(&queueEmptyCond);
-            }
+        /* wake a thread for each new chunk that can take any, or a writer if its next chunk just came in */
+        if (transformStage != nullptr || !sendHost.empty()) {
+            takersWaiting.notify(numChunks);
+        } else if (queue.begin()->first == nextChunkToTake) {
+            writersWaiting.notify();
         }
 
-        /* broadcast that there is new element in the queue */
-        pthread_cond_broadcast(&queueFullCond);
+        /* pass the budget on to the next reader if there's still room for another batch like this one */
+        if (inflightBytes + len <= maxInflightBytes) {
+            readersWaiting.notify();
+        }
 
         /* unlock the queue mutex */
         pthread_mutex_unlock(&queueMutex);
     }
 
     #ifdef SHOW_OTHER_TIMES
-    /* set the times */
-    readerTimes[index].lockTime = totalReadLockWaitTime;
-    readerTimes[index].busyWaitTime = totalReadBusyWaitTime;
-    readerTimes[index].processTime = totalReadTime;
+    /* set the times (a slot can be reused, so add to what's there) */
+    readerTimes[index].lockTime += totalReadLockWaitTime;
+    readerTimes[index].busyWaitTime += totalReadBusyWaitTime;
+    readerTimes[index].processTime += totalReadTime;
 
     #endif
 
+    /* record the os accounting for this thread before it exits */
+    readerUsage[index] = readerUsage[index] + resourceusage::ofThread();
+
+    /* let the controller know this slot is free */
+    pthread_mutex_lock(&queueMutex);
+    readerRunning[index] = false;
+    pthread_mutex_unlock(&queueMutex);
+
     /* clean up */
     delete params;
 
@@ -218,23 +503,100 @@ void* reader(void* arg)
     return nullptr; 
 }
 
+/*
+* transformer thread
+* takes any chunk off the queue, runs the transform on it and leaves it for the writers,
+* so the transform's cpu time is spread over its own pool instead of holding up the file order
+*/
+void* transformer(void* arg)
+{
+    int* params = (int*) arg;
+    int index = *params;
+
+    while (true) {
+        pthread_mutex_lock(&queueMutex);
+
+        /* wait for any chunk until they've all been taken */
+        while (queue.empty() && transformTaken != totalChunks) {
+            takersWaiting.wait(&queueMutex);
+        }
+        if (queue.empty()) {
+            pthread_mutex_unlock(&queueMutex);
+            break;
+        }
+
+        /* the lowest chunk first, since that's the one the writers are waiting on */
+        long chunkIndex = queue.begin()->first;
+        std::string chunk = std::move(queue.begin()->second);
+        queue.erase(queue.begin());
+        if (++transformTaken == totalChunks) {
+            takersWaiting.notifyAll();
+        }
+        pthread_mutex_unlock(&queueMutex);
+
+        std::string transformed;
+        transformBusyTime += timeFunction([&transformed, &chunk] {
+            transformed = transformStage->apply(chunk);
+        }).count();
+        long inBytes = chunk.length();
+        long outBytes = transformed.length();
+        transformInBytes += inBytes;
+        transformOutBytes += outBytes;
+
+        /* the chunk in flight is now the size it came out as */
+        pthread_mutex_lock(&queueMutex);
+        inflightBytes += outBytes - inBytes;
+        transformedQueue.emplace(chunkIndex, std::move(transformed));
+        if (chunkIndex == nextChunkToTake) {
+            writersWaiting.notify();
+        }
+        if (outBytes < inBytes) {
+            readersWaiting.notify();
+        }
+        pthread_mutex_unlock(&queueMutex);
+    }
+
+    transformerUsage[index] = transformerUsage[index] + resourceusage::ofThread();
+
+    delete params;
+    return nullptr;
+}
+
 /* writer thread */
 void* writer(void* arg)
 {
     /* get the paremters */
     int* params = (int*) arg;
 
-    #ifdef SHOW_OTHER_TIMES
     /* get the thread id */
     int index = *params;
 
+    #ifdef SHOW_OTHER_TIMES
     /* store the total times */
     long totalWriteTime = 0;
     long totalLockTime = 0;
     long totalBusyWaitTime = 0;
     #endif
 
+    /* the chunks taken in one go, and an iovec for each that gets written */
+    std::vector<std::string> batch;
+    std::vector<struct iovec> iov;
+
+    /* bytes of the chunks this writer is holding */
+    long heldBytes = 0;
+
+    /* with a transform the writers take what the transformers have finished */
+    std::map<long, std::string>& pending = transformStage != nullptr ? transformedQueue : queue;
+
     while (writing) {
+        /* index of the first chunk in the batch */
+        long firstChunk = 0;
+        batch.clear();
+
+        /* retire if the controller has shrunk the pool below this slot */
+        if (index >= targetWriters) {
+            break;
+        }
 
         #ifdef SHOW_OTHER_TIMES
         totalLockTime += timeFunction([]{
@@ -246,69 +608,122 @@ void* writer(void* arg)
         #endif
 
         #ifdef SHOW_OTHER_TIMES
-        totalBusyWaitTime += timeFunction([] {
+        totalBusyWaitTime += timeFunction([&pending] {
         #endif
-            /* keep waiting until theres an element in the queue */
-            while (queue.empty() && writing) {
-                pthread_cond_wait(&queueFullCond, &queueMutex);
+            /* keep waiting until the next chunk in the file is in the queue */
+            while ((pending.empty() || pending.begin()->first != nextChunkToTake) && writing) {
+                writersWaiting.wait(&queueMutex);
             }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
+        /* take every chunk that carries on in order, up to IOV_MAX of them */
         if (writing) {
-            auto element = queue.top();
-            queue.pop();
-            //std::cout << element.first << ": " << element.second.substr(0, 10) << std::endl;
-            if (queue.empty() && !reading) {
+            firstChunk = nextChunkToTake;
+            auto it = pending.begin();
+            while (it != pending.end() && it->first == nextChunkToTake && (long) batch.size() < IOV_MAX) {
+                heldBytes += it->second.length();
+                batch.push_back(std::move(it->second));
+                it = pending.erase(it);
+                ++nextChunkToTake;
+            }
+            ++writeBatches;
+            writtenChunks += batch.size();
+
+            /* stop the loop once every chunk in the file has been taken */
+            if (nextChunkToTake == totalChunks) {
                 writing = false;
-                pthread_cond_broadcast(&queueFullCond);
+                writersWaiting.notifyAll();
             }
-            /* broadcast that there is empty space in the queue */
-            pthread_mutex_lock(&queue2Mutex);
-            queue2.push(element);
-            pthread_mutex_unlock(&queue2Mutex);
-        }
 
-        /* broadcast that there is empty space in the queue */
-        pthread_cond_broadcast(&queueEmptyCond);
+            /* the reader of the new next chunk doesn't have to wait for budget, and a batch cut short leaves work for another writer */
+            readersWaiting.notifyKey(nextChunkToTake);
+            if (!pending.empty() && pending.begin()->first == nextChunkToTake) {
+                writersWaiting.notify();
+            }
+        }
 
         /* unlock the queue mutex */
         pthread_mutex_unlock(&queueMutex);
 
-        
+        /* nothing was taken because the copy is done */
+        if (batch.empty()) {
+            break;
+        }
+
         #ifdef SHOW_OTHER_TIMES
-        totalLockTime += timeFunction([]{
+        totalLockTime += timeFunction([firstChunk]{
         #endif
-            /* lock the queue mutex */
+            /* lock the outfile mutex and wait for the batches before this one to be written */
             pthread_mutex_lock(&outfileMutex);
+            while (nextChunkToWrite != firstChunk) {
+                writeTurns.wait(&outfileMutex, firstChunk);
+            }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
         #ifdef SHOW_OTHER_TIMES
-        totalWriteTime += timeFunction([&item]{
+        totalWriteTime += timeFunction([&batch, &iov]{
         #endif
-            pthread_mutex_lock(&queue2Mutex);
-            auto element = queue2.top();
-            queue2.pop();
-            pthread_mutex_unlock(&queue2Mutex);
-            /* write the element to the file */
-            outfile.write(element.second.c_str(), element.second.length());
+            /*
+            * write the batch to the file with one pwritev, the outfile was truncated so skipped zeros
+            * stay a hole and only split the batch into a pwritev for each run of chunks between them
+            */
+            long runOffset = outputOffset;
+            iov.clear();
+            for (std::string& chunk : batch) {
+                if (sparse && allZero(chunk.c_str(), chunk.length())) {
+                    writeChunks(iov, runOffset);
+                    runOffset = outputOffset + chunk.length();
+                    elidedBytes += chunk.length();
+                } else if (!chunk.empty()) {
+                    iov.push_back({chunk.data(), chunk.length()});
+                }
+                if (transformStage != nullptr) {
+                    transformStage->written(chunk, outputOffset);
+                }
+                outputOffset += chunk.length();
+            }
+            writeChunks(iov, runOffset);
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
+
+        /* let the writer with the next batch have its turn */
+        nextChunkToWrite += batch.size();
+        writeTurns.notifyKey(nextChunkToWrite);
+
         /* unlock the outfile mutex */
         pthread_mutex_unlock(&outfileMutex);
+
+        /* the chunks are written so they are no longer in flight */
+        if (heldBytes > 0) {
+            pthread_mutex_lock(&queueMutex);
+            inflightBytes -= heldBytes;
+            bytesWritten += heldBytes;
+            readersWaiting.notify();
+            pthread_mutex_unlock(&queueMutex);
+            heldBytes = 0;
+        }
     }
 
     #ifdef SHOW_OTHER_TIMES
-    /* set the times for the writer threads */
-    writerTimes[index].busyWaitTime = totalBusyWaitTime;
-    writerTimes[index].lockTime = totalLockTime;
-    writerTimes[index].processTime = totalWriteTime;
+    /* set the times for the writer threads (a slot can be reused, so add to what's there) */
+    writerTimes[index].busyWaitTime += totalBusyWaitTime;
+    writerTimes[index].lockTime += totalLockTime;
+    writerTimes[index].processTime += totalWriteTime;
 
     #endif
+
+    /* record the os accounting for this thread before it exits */
+    writerUsage[index] = writerUsage[index] + resourceusage::ofThread();
+
+    /* let the controller know this slot is free */
+    pthread_mutex_lock(&queueMutex);
+    writerRunning[index] = false;
+    pthread_mutex_unlock(&queueMutex);
     
     /* cleanup */
     delete params;
@@ -317,87 +732,598 @@ void* writer(void* arg)
     return nullptr;
 }
 
+/*
+* sender thread, the writer for a tcp outfile
+* takes whatever chunks are queued, in any order since they carry their offset,
+* and sends runs of them down its own connection
+*/
+void* sender(void* arg)
+{
+    int* params = (int*) arg;
+    int index = *params;
+    int sock = connections[index];
+
+    #ifdef SHOW_OTHER_TIMES
+    long totalSendTime = 0;
+    long totalLockTime = 0;
+    long totalBusyWaitTime = 0;
+    #endif
+
+    /* the header and chunks taken in one go, and the zerocopy ones the kernel still has */
+    std::vector<std::string> batch;
+    std::deque<tcptransport::pendingsend> pending;
+    uint32_t zeroCopyCalls = 0;
+    bool useZeroCopy = zeroCopy && tcptransport::enableZeroCopy(sock);
+
+    while (true) {
+        batch.clear();
+
+        #ifdef SHOW_OTHER_TIMES
+        totalLockTime += timeFunction([]{
+        #endif
+            pthread_mutex_lock(&queueMutex);
+        #ifdef SHOW_OTHER_TIMES
+        }).count();
+        #endif
+
+        #ifdef SHOW_OTHER_TIMES
+        totalBusyWaitTime += timeFunction([] {
+        #endif
+            /* wait for any chunk until they've all been taken */
+            while (queue.empty() && takenChunks != totalChunks) {
+                takersWaiting.wait(&queueMutex);
+            }
+        #ifdef SHOW_OTHER_TIMES
+        }).count();
+        #endif
+
+        if (queue.empty()) {
+            pthread_mutex_unlock(&queueMutex);
+            break;
+        }
+
+        /* the first chunk queued and every one straight after it, with room in the iovec for the header */
+        chunkheader header;
+        long firstChunk = queue.begin()->first;
+        header.offset = firstChunk * READ_CHUNK;
+        header.length = 0;
+        batch.emplace_back();
+        auto it = queue.begin();
+        while (it != queue.end() && it->first == firstChunk + (long) batch.size() - 1 && (long) batch.size() < IOV_MAX) {
+            header.length += it->second.length();
+            batch.push_back(std::move(it->second));
+            it = queue.erase(it);
+        }
+        batch[0] = std::string((const char*) &header, sizeof(header));
+        takenChunks += batch.size() - 1;
+        ++writeBatches;
+        writtenChunks += batch.size() - 1;
+        if (takenChunks == totalChunks) {
+            takersWaiting.notifyAll();
+        }
+        pthread_mutex_unlock(&queueMutex);
+
+        /* an empty file's only chunk has nothing to send */
+        if (header.length > 0) {
+            std::vector<struct iovec> iov;
+            for (const std::string& part : batch) {
+                iov.push_back({(void*) part.data(), part.length()});
+            }
+            #ifdef SHOW_OTHER_TIMES
+            totalSendTime += timeFunction([sock, &iov, &zeroCopyCalls, useZeroCopy]{
+            #endif
+                zeroCopyCalls += tcptransport::sendAll(sock, iov, useZeroCopy ? MSG_ZEROCOPY : 0);
+            #ifdef SHOW_OTHER_TIMES
+            }).count();
+            #endif
+            bytesSent += header.length;
+        }
+
+        /* the kernel may still be reading zerocopy chunks, so they're only freed once it says so */
+        if (useZeroCopy && header.length > 0) {
+            pending.emplace_back(zeroCopyCalls - 1, std::move(batch));
+            batch = std::vector<std::string>();
+            zeroCopyCopied += tcptransport::reapZeroCopy(sock, pending, false);
+            while (pending.size() > MAX_PENDING_ZEROCOPY) {
+                zeroCopyCopied += tcptransport::reapZeroCopy(sock, pending, true);
+            }
+        }
+
+        /* the chunks are sent so they are no longer in flight */
+        pthread_mutex_lock(&queueMutex);
+        inflightBytes -= header.length;
+        bytesWritten += header.length;
+        readersWaiting.notify();
+        pthread_mutex_unlock(&queueMutex);
+    }
+
+    zeroCopyCopied += tcptransport::reapZeroCopy(sock, pending, true);
+    zeroCopySends += useZeroCopy ? zeroCopyCalls : 0;
+
+    /* every chunk has been read by now, so this is the size of the file */
+    chunkheader end;
+    pthread_mutex_lock(&queueMutex);
+    end.offset = bytesRead;
+    pthread_mutex_unlock(&queueMutex);
+    end.length = -1;
+    tcptransport::sendAll(sock, &end, sizeof(end));
+    close(sock);
+
+    #ifdef SHOW_OTHER_TIMES
+    writerTimes[index].busyWaitTime += totalBusyWaitTime;
+    writerTimes[index].lockTime += totalLockTime;
+    writerTimes[index].processTime += totalSendTime;
+    #endif
+
+    writerUsage[index] = writerUsage[index] + resourceusage::ofThread();
+
+    pthread_mutex_lock(&queueMutex);
+    writerRunning[index] = false;
+    pthread_mutex_unlock(&queueMutex);
+
+    delete params;
+    return nullptr;
+}
+
+/*
+* receiver thread, one per connection from the sender
+* writes each run of chunks at its offset, spliced from the socket through a pipe
+* so it never comes up to user space, or through a buffer if the socket can't be spliced
+*/
+void* receiver(void* arg)
+{
+    int* params = (int*) arg;
+    int index = *params;
+    int sock = connections[index];
+    int out = open(receiveOutfileName.c_str(), O_WRONLY);
+    if (out == -1) {
+        throw std::runtime_error("receiver: could not open outfile");
+    }
+
+    /* always timed here, the receivers only have waiting on the sender and writing to show for themselves */
+    long totalWriteTime = 0;
+    long totalBusyWaitTime = 0;
+    long reads = 0;
+    long runs = 0;
+
+    int bufferBytes = 0;
+    socklen_t optionLength = sizeof(bufferBytes);
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufferBytes, &optionLength) == 0) {
+        int seen = receiveBufferBytes;
+        while (bufferBytes > seen && !receiveBufferBytes.compare_exchange_weak(seen, bufferBytes)) {}
+    }
+
+    int pipeFds[2];
+    bool useSplice = pipe(pipeFds) == 0;
+    if (useSplice) {
+        fcntl(pipeFds[1], F_SETPIPE_SZ, RECEIVE_PIECE);
+    }
+    std::vector<char> buffer;
+
+    chunkheader header;
+    while (true) {
+        bool gotHeader = false;
+        totalBusyWaitTime += timeFunction([sock, &header, &gotHeader]{
+            gotHeader = tcptransport::receiveAll(sock, &header, sizeof(header));
+        }).count();
+        if (!gotHeader) {
+            throw std::runtime_error("receiver: the sender went away before the end of the file");
+        }
+        if (header.length < 0) {
+            receivedFileSize = header.offset;
+            break;
+        }
+
+        totalWriteTime += timeFunction([&]{
+            loff_t offset = header.offset;
+            long left = header.length;
+            while (left > 0) {
+                long piece = std::min(left, (long) RECEIVE_PIECE);
+                ssize_t moved;
+                if (useSplice) {
+                    moved = splice(sock, nullptr, pipeFds[1], nullptr, piece, SPLICE_F_MOVE | SPLICE_F_MORE);
+                    if (moved < 0 && errno == EINVAL) {
+                        useSplice = false;
+                        continue;
+                    }
+                    for (ssize_t drained = 0; drained < moved; ) {
+                        ssize_t n = splice(pipeFds[0], nullptr, out, &offset, moved - drained, SPLICE_F_MOVE);
+                        if (n <= 0) {
+                            throw std::runtime_error("receiver: could not splice into the outfile");
+                        }
+                        drained += n;
+                    }
+                    splicedBytes += std::max(moved, (ssize_t) 0);
+                } else {
+                    buffer.resize(RECEIVE_PIECE);
+                    moved = recv(sock, buffer.data(), piece, 0);
+                    if (moved > 0 && pwrite(out, buffer.data(), moved, offset) != moved) {
+                        throw std::runtime_error("receiver: could not write the outfile");
+                    }
+                    offset += std::max(moved, (ssize_t) 0);
+                }
+                if (moved <= 0) {
+                    throw std::runtime_error("receiver: the sender went away in the middle of a chunk");
+                }
+                ++reads;
+                left -= moved;
+            }
+        }).count();
+        bytesReceived += header.length;
+        ++runs;
+    }
+
+    if (useSplice) {
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+    }
+    close(sock);
+    close(out);
+
+    receivedRuns += runs;
+    socketReads += reads;
+    receiveWaitTime += totalBusyWaitTime;
+    receiveWriteTime += totalWriteTime;
+    #ifdef SHOW_OTHER_TIMES
+    writerTimes[index].busyWaitTime += totalBusyWaitTime;
+    writerTimes[index].processTime += totalWriteTime;
+    #endif
+
+    writerUsage[index] = writerUsage[index] + resourceusage::ofThread();
+
+    delete params;
+    return nullptr;
+}
+
+/* 
+* start a reader in the given slot
+* reaps the thread that retired from the slot first
+* queueMutex must be held once the copy is running
+*/
+void startReader(int slot)
+{
+    if (readerStarted[slot] && pthread_join(readers[slot], nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to join reader thread";
+        throw std::runtime_error(errMsg);
+    }
+    readerStarted[slot] = true;
+    readerRunning[slot] = true;
+    readerSlots = std::max(readerSlots, slot + 1);
+
+    int* index = new int(slot);
+    if (pthread_create(&readers[slot], nullptr, &reader, index) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to create reader thread";
+        throw std::runtime_error(errMsg);
+    }
+}
+
+/* 
+* start a writer in the given slot
+* reaps the thread that retired from the slot first
+* queueMutex must be held once the copy is running
+*/
+void startWriter(int slot)
+{
+    if (writerStarted[slot] && pthread_join(writers[slot], nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to join writer thread";
+        throw std::runtime_error(errMsg);
+    }
+    writerStarted[slot] = true;
+    writerRunning[slot] = true;
+    writerSlots = std::max(writerSlots, slot + 1);
+
+    int* index = new int(slot);
+    if (pthread_create(&writers[slot], nullptr, sendHost.empty() ? &writer : &sender, index) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to create writer thread";
+        throw std::runtime_error(errMsg);
+    }
+}
+
+/* grow (by one) or shrink (by one) a pool, queueMutex must be held */
+void resizeReaders(int change)
+{
+    targetReaders += change;
+    /* a retiring thread might still be in the slot, in which case it just keeps going */
+    if (change > 0 && !readerRunning[targetReaders - 1]) {
+        startReader(targetReaders - 1);
+    }
+}
+
+void resizeWriters(int change)
+{
+    targetWriters += change;
+    /* a retiring thread might still be in the slot, in which case it just keeps going */
+    if (change > 0 && !writerRunning[targetWriters - 1]) {
+        startWriter(targetWriters - 1);
+    }
+}
+
+/* 
+* adaptive controller thread
+* samples the inflight occupancy and the write throughput and resizes the pools:
+* a full budget means writers are behind, an empty one means readers are behind,
+* and a change that made throughput drop gets undone
+*/
+void* controller(void* arg)
+{
+    /* the last change made and the throughput before it */
+    int lastReaderChange = 0;
+    int lastWriterChange = 0;
+    long throughputBeforeChange = 0;
+    long lastBytesWritten = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    while (true) {
+        usleep(CONTROLLER_INTERVAL_MS * US_PER_MS);
+
+        pthread_mutex_lock(&queueMutex);
+        if (!writing) {
+            pthread_mutex_unlock(&queueMutex);
+            break;
+        }
+
+        /* bring back slots whose thread retired just as the pool grew again */
+        for (int i = 0; i < targetReaders && reading; ++i) {
+            if (!readerRunning[i]) {
+                startReader(i);
+            }
+        }
+        for (int i = 0; i < targetWriters; ++i) {
+            if (!writerRunning[i]) {
+                startWriter(i);
+            }
+        }
+
+        /* sample the pipeline */
+        long occupancy = inflightBytes * 100 / maxInflightBytes;
+        long throughput = (bytesWritten - lastBytesWritten) / CONTROLLER_INTERVAL_MS;
+        lastBytesWritten = bytesWritten;
+        long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+
+        std::string decision;
+        if ((lastReaderChange != 0 || lastWriterChange != 0)
+            && throughput * 100 < throughputBeforeChange * (100 - THROUGHPUT_DROP_PERCENT)) {
+            /* the last change made things worse so undo it */
+            if (lastReaderChange != 0 && (lastReaderChange < 0 || reading)) {
+                resizeReaders(-lastReaderChange);
+            }
+            if (lastWriterChange != 0) {
+                resizeWriters(-lastWriterChange);
+            }
+            decision = "undo last change";
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+        } else if (reading && occupancy >= HIGH_OCCUPANCY_PERCENT) {
+            /* the writers can't keep up */
+            throughputBeforeChange = throughput;
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+            if (targetWriters < (int) writers.size()) {
+                resizeWriters(1);
+                lastWriterChange = 1;
+                decision = "add writer";
+            } else if (targetReaders > 1) {
+                resizeReaders(-1);
+                lastReaderChange = -1;
+                decision = "retire reader";
+            }
+        } else if (reading && occupancy <= LOW_OCCUPANCY_PERCENT) {
+            /* the readers can't keep up */
+            throughputBeforeChange = throughput;
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+            if (targetReaders < (int) readers.size()) {
+                resizeReaders(1);
+                lastReaderChange = 1;
+                decision = "add reader";
+            } else if (targetWriters > 1) {
+                resizeWriters(-1);
+                lastWriterChange = -1;
+                decision = "retire writer";
+            }
+        } else {
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+        }
+
+        if (!decision.empty()) {
+            std::ostringstream entry;
+            entry << elapsed << " ms: " << decision << " (occupancy " << occupancy << "%, "
+                << throughput / 1000 << " MB/s) -> " << targetReaders << " readers, " << targetWriters << " writers";
+            controllerLog.push_back(entry.str());
+        }
+
+        pthread_mutex_unlock(&queueMutex);
+    }
+
+    return nullptr;
+}
+
 /* starting the copying threads */
-void startCopierThreads(int numThreads, const char* infileName, const char* outfileName)
+void startCopierThreads(const char* infileName, const char* outfileName)
 {  
     /* set reading flag to true */
     reading = true;
     writing = true;
-
-    /* reader threads */
-    pthread_t readers[numThreads];
-    pthread_t writers[numThreads];
+    eofReached = false;
+    totalChunks = -1;
+    linesRead = 0;
+    nextChunkToTake = 0;
+    nextChunkToWrite = 0;
+    transformTaken = 0;
+    outputOffset = 0;
+    targetReaders = numReaders;
+    targetWriters = numWriters;
+
+    /* the adaptive controller */
+    pthread_t controllerThread;
+
+    /* the transformers, a fixed pool since the controller only sizes the readers and writers */
+    std::vector<pthread_t> transformers(transformStage != nullptr ? numTransformers : 0);
 
     /* initialise mutexes */
     pthread_mutex_init(&queueMutex, nullptr);
     pthread_mutex_init(&infileMutex, nullptr);
     pthread_mutex_init(&outfileMutex, nullptr);
 
-    /* initialise conditionals */
-    pthread_cond_init(&queueFullCond, nullptr);
-    pthread_cond_init(&queueEmptyCond, nullptr);
-    pthread_cond_init(&writeFileCond, nullptr);
+    /* set how the threads wait */
+    for (waitqueue* waiting : {&writersWaiting, &takersWaiting, &readersWaiting, &writeTurns}) {
+        waiting->setStrategy(waitStrategy);
+    }
 
     /* open the infile */
-    infile.open(infileName, std::ifstream::binary);
+    infile = open(infileName, O_RDONLY);
     /* check if the infile exists */
-    if (!infile){
+    if (infile == FILE_OPEN_ERR){
         const std::string errMsg = "Could not find infile";
         throw std::runtime_error(errMsg);
     }
 
-    /* open the outfile */
-    outfile.open(outfileName, std::ofstream::binary | std::ofstream::trunc);
+    /* open the outfile, unless the writers are sending the chunks somewhere else */
+    if (sendHost.empty()) {
+        outfile = open(outfileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    }
     /* check if the outfile exists */
-    if (!outfile) {
+    if (sendHost.empty() && outfile == FILE_OPEN_ERR) {
+        close(infile);
         const std::string errMsg = "Could not find outfile";
         throw std::runtime_error(errMsg);
     }
 
-    /* create reader and writer threads */
-    for (int i = 0; i < numThreads; ++i) {
-        int* index1 = new int(i);
-        if (pthread_create(&readers[i], nullptr, &reader, index1) != THREAD_SUCCESS) {
-            const std::string errMsg = "Failed to create reader thread";
-            throw std::runtime_error(errMsg);
-        }
-        int* index2 = new int(i);
-        if (pthread_create(&writers[i], nullptr, &writer, index2) != THREAD_SUCCESS) {
-            const std::string errMsg = "Failed to create writer thread";
+    /* create reader and writer threads, holding the queue mutex so early exits can't race the setup */
+    pthread_mutex_lock(&queueMutex);
+    for (int i = 0; i < numReaders; ++i) {
+        startReader(i);
+    }
+    for (int i = 0; i < numWriters; ++i) {
+        startWriter(i);
+    }
+    for (int i = 0; i < (int) transformers.size(); ++i) {
+        if (pthread_create(&transformers[i], nullptr, &transformer, new int(i)) != THREAD_SUCCESS) {
+            const std::string errMsg = "Failed to create transformer thread";
             throw std::runtime_error(errMsg);
         }
     }
+    pthread_mutex_unlock(&queueMutex);
+
+    /* start the controller */
+    if (adaptive && pthread_create(&controllerThread, nullptr, &controller, nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to create controller thread";
+        throw std::runtime_error(errMsg);
+    }
+
+    /* join the controller first so the pools stop changing */
+    if (adaptive && pthread_join(controllerThread, nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to join controller thread";
+        throw std::runtime_error(errMsg);
+    }
 
     /* join reader and writer threads */
-    for (int i = 0; i < numThreads; ++i) {
-        if (pthread_join(readers[i], nullptr) != THREAD_SUCCESS) {
+    for (int i = 0; i < (int) readers.size(); ++i) {
+        if (readerStarted[i] && pthread_join(readers[i], nullptr) != THREAD_SUCCESS) {
             const std::string errMsg = "Failed to join reader thread";
             throw std::runtime_error(errMsg);
         }
-        if (pthread_join(writers[i], nullptr) != THREAD_SUCCESS) {
+    }
+    for (int i = 0; i < (int) transformers.size(); ++i) {
+        if (pthread_join(transformers[i], nullptr) != THREAD_SUCCESS) {
+            const std::string errMsg = "Failed to join transformer thread";
+            throw std::runtime_error(errMsg);
+        }
+    }
+    for (int i = 0; i < (int) writers.size(); ++i) {
+        if (writerStarted[i] && pthread_join(writers[i], nullptr) != THREAD_SUCCESS) {
             const std::string errMsg = "Failed to join writer thread";
             throw std::runtime_error(errMsg);
         }
     }
 
+    /* the transform gets the last word in the outfile, and a decompressed file has to come out the size it was */
+    if (transformStage != nullptr) {
+        std::string trailer = transformStage->trailer();
+        if (!trailer.empty()) {
+            std::vector<struct iovec> iov = {{trailer.data(), trailer.length()}};
+            writeChunks(iov, outputOffset);
+        }
+        if (transformStage->expectedSize() >= 0 && bytesWritten != transformStage->expectedSize()) {
+            throw std::runtime_error("startCopierThreads: the transformed outfile is the wrong size");
+        }
+    }
+
+    close(infile);
+    if (outfile != FILE_OPEN_ERR) {
+        close(outfile);
+    }
+
+    /* a file that ends in zeros was never written that far, so size it */
+    if (sparse) {
+        if (getFileSize(outfileName) < bytesWritten) {
+            std::ignore = truncate(outfileName, bytesWritten);
+        }
+    }
+
     /* destroy mutexes */
     pthread_mutex_destroy(&queueMutex);
     pthread_mutex_destroy(&infileMutex);
     pthread_mutex_destroy(&outfileMutex);
+}
 
-    /* destroy conditionals */
-    pthread_cond_destroy(&queueFullCond);
-    pthread_cond_destroy(&queueEmptyCond);
-    pthread_cond_destroy(&writeFileCond);
+/* 
+* run the receiving end of a tcp copy, a writer per connection the sender opened
+* the chunks can turn up in any order, so the outfile is sized once the sender says how big it is
+*/
+void startReceiverThreads(const char* outfileName)
+{
+    receiveOutfileName = outfileName;
+    int out = open(outfileName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (out == -1) {
+        const std::string errMsg = "Could not find outfile";
+        throw std::runtime_error(errMsg);
+    }
+    close(out);
+
+    pthread_mutex_init(&queueMutex, nullptr);
+    for (int i = 0; i < (int) connections.size(); ++i) {
+        writerStarted[i] = true;
+        writerSlots = std::max(writerSlots, i + 1);
+        if (pthread_create(&writers[i], nullptr, &receiver, new int(i)) != THREAD_SUCCESS) {
+            const std::string errMsg = "Failed to create receiver thread";
+            throw std::runtime_error(errMsg);
+        }
+    }
+    for (int i = 0; i < (int) connections.size(); ++i) {
+        if (pthread_join(writers[i], nullptr) != THREAD_SUCCESS) {
+            const std::string errMsg = "Failed to join receiver thread";
+            throw std::runtime_error(errMsg);
+        }
+    }
+    pthread_mutex_destroy(&queueMutex);
+
+    if (receivedFileSize >= 0 && truncate(outfileName, receivedFileSize) != 0) {
+        throw std::runtime_error("startReceiverThreads: could not size the outfile");
+    }
 }
 
 int main(int argc, char** argv) {
 
-    const std::string cmdErrorMessage = "main: the correct command is: ./better_mtcopier <#threads> <infile> <outfile> <optional -t>";
+    const std::string cmdErrorMessage = "main: the correct command is: ./mtcopier <#threads> <infile> <outfile> <optional -t> <optional --max-inflight <bytes>[K|M|G]> <optional --readers <#threads>> <optional --writers <#threads>> <optional --auto> <optional --read-batch <#chunks>> <optional --sparse> <optional --zerocopy> <optional --transform <compress|decompress>> <optional --transformers <#threads>> <optional --wait <broadcast|park|spin|adaptive>> (outfile can be tcp:<host>:<port> to send, infile tcp:<port> to receive)";
     const std::string timerFlag = "-t";
+    const std::string maxInflightFlag = "--max-inflight";
+    const std::string readersFlag = "--readers";
+    const std::string writersFlag = "--writers";
+    const std::string adaptiveFlag = "--auto";
+    const std::string readBatchFlag = "--read-batch";
+    const std::string sparseFlag = "--sparse";
+    const std::string zeroCopyFlag = "--zerocopy";
+    const std::string transformFlag = "--transform";
+    const std::string transformersFlag = "--transformers";
+    const std::string waitFlag = "--wait";
+    std::string transformName;
 
     /* check number of cmd args */
-    if (argc < MIN_NUM_ARGS || argc > MAX_NUM_ARGS) {
+    if (argc < MIN_NUM_ARGS) {
 
         throw std::runtime_error(cmdErrorMessage);
     }
@@ -417,38 +1343,152 @@ int main(int argc, char** argv) {
     if (numThreads < 1) {
         throw std::runtime_error("main: thread command argument cannot be below 1");
     }
+    numReaders = numThreads;
+    numWriters = numThreads;
+    numTransformers = numThreads;
 
-    /* check if the command has the timer flag*/
-    if (argc == MAX_NUM_ARGS) {
-        if (argv[TIMER_INDEX] == timerFlag) {
+    /* check the optional flags */
+    for (int i = OPTIONS_INDX; i < argc; ++i) {
+        if (argv[i] == timerFlag) {
             showTime = true;
+        } else if (argv[i] == maxInflightFlag && i + 1 < argc) {
+            try {
+                maxInflightBytes = parseByteSize(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid max inflight command argument format");
+            }
+            if (maxInflightBytes < 1) {
+                throw std::runtime_error("main: max inflight command argument cannot be below 1");
+            }
+        } else if ((argv[i] == readersFlag || argv[i] == writersFlag || argv[i] == transformersFlag) && i + 1 < argc) {
+            int* count = argv[i] == readersFlag ? &numReaders : argv[i] == writersFlag ? &numWriters : &numTransformers;
+            try {
+                *count = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid thread command argument format");
+            }
+            if (*count < 1) {
+                throw std::runtime_error("main: thread command argument cannot be below 1");
+            }
+        } else if (argv[i] == adaptiveFlag) {
+            adaptive = true;
+        } else if (argv[i] == sparseFlag) {
+            sparse = true;
+        } else if (argv[i] == zeroCopyFlag) {
+            zeroCopy = true;
+        } else if (argv[i] == waitFlag && i + 1 < argc) {
+            waitStrategy = waitStrategyNamed(argv[++i]);
+        } else if (argv[i] == transformFlag && i + 1 < argc) {
+            transformName = argv[++i];
+        } else if (argv[i] == readBatchFlag && i + 1 < argc) {
+            try {
+                readBatch = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid read batch command argument format");
+            }
+            if (readBatch < 1 || readBatch > IOV_MAX) {
+                throw std::runtime_error("main: read batch command argument must be between 1 and IOV_MAX");
+            }
         } else {
             throw std::runtime_error(cmdErrorMessage);
         }
     }
 
+    /* 
+    * a tcp outfile sends down a connection per writer and a tcp infile takes however many the sender opens
+    * both are set up before the clock starts, so waiting for the other end isn't counted
+    */
+    const std::string tcpPrefix = TCP_PREFIX;
+    if (std::string(outfileName).rfind(tcpPrefix, 0) == 0) {
+        std::string endpoint = std::string(outfileName).substr(tcpPrefix.size());
+        size_t colon = endpoint.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::runtime_error("main: a tcp outfile is tcp:<host>:<port>");
+        }
+        sendHost = endpoint.substr(0, colon);
+        sendPort = endpoint.substr(colon + 1);
+    }
+    if (std::string(infileName).rfind(tcpPrefix, 0) == 0) {
+        receivePort = std::string(infileName).substr(tcpPrefix.size());
+    }
+    if ((!sendHost.empty() || !receivePort.empty()) && (adaptive || sparse)) {
+        throw std::runtime_error("main: a tcp infile or outfile doesn't go with --auto or --sparse");
+    }
+    if (!sendHost.empty() && !receivePort.empty()) {
+        throw std::runtime_error("main: only one of the infile and outfile can be tcp");
+    }
+    if (!transformName.empty() && (!sendHost.empty() || !receivePort.empty())) {
+        throw std::runtime_error("main: a tcp infile or outfile doesn't go with --transform");
+    }
+    if (!transformName.empty()) {
+        transformStage = chunktransform::named(transformName, infileName);
+        if (transformStage == nullptr) {
+            throw std::runtime_error("main: unknown transform " + transformName + ", it can be compress or decompress");
+        }
+    }
+    if (!receivePort.empty()) {
+        connections = tcptransport::acceptOn(receivePort);
+        numWriters = connections.size();
+    }
+    if (!sendHost.empty()) {
+        connections = tcptransport::connectTo(sendHost, sendPort, numWriters);
+    }
+
+    /* size the pools, the controller can grow them up to MAX_POOL_THREADS */
+    int readerPoolSize = adaptive ? std::max(numReaders, MAX_POOL_THREADS) : numReaders;
+    int writerPoolSize = adaptive ? std::max(numWriters, MAX_POOL_THREADS) : numWriters;
+    readers.resize(readerPoolSize);
+    writers.resize(writerPoolSize);
+    readerStarted.resize(readerPoolSize, false);
+    writerStarted.resize(writerPoolSize, false);
+    readerRunning.resize(readerPoolSize, false);
+    writerRunning.resize(writerPoolSize, false);
+
     #ifdef SHOW_OTHER_TIMES
     /* set up the arrays to store the times for writer and reader threads */
-    readerTimes = new threadtimes[numThreads];
-    writerTimes = new threadtimes[numThreads];
+    readerTimes = new threadtimes[readerPoolSize];
+    writerTimes = new threadtimes[writerPoolSize];
     #endif
+    /* set up the arrays to store the os accounting for writer and reader threads */
+    readerUsage = new resourceusage[readerPoolSize];
+    writerUsage = new resourceusage[writerPoolSize];
+    transformerUsage = new resourceusage[numTransformers];
+
+    /* snapshot the process counters so only the copy gets counted */
+    resourceusage startProcessUsage = resourceusage::ofProcess();
+    processio startProcessIO = processio::current();
 
     /* start the threads */
-    long totalActualTime = timeFunction([numThreads, &infileName, &outfileName]{
-        startCopierThreads(numThreads, infileName, outfileName);
+    long totalActualTime = timeFunction([&infileName, &outfileName]{
+        if (!receivePort.empty()) {
+            startReceiverThreads(outfileName);
+        } else {
+            startCopierThreads(infileName, outfileName);
+        }
     }).count();
 
+    resourceusage processUsage = resourceusage::ofProcess() - startProcessUsage;
+    processio processIO = processio::current() - startProcessIO;
+    resourceusage totalReaderUsage = std::accumulate(readerUsage, readerUsage + readerSlots, resourceusage());
+    resourceusage totalWriterUsage = std::accumulate(writerUsage, writerUsage + writerSlots, resourceusage());
+    resourceusage totalTransformerUsage = std::accumulate(transformerUsage, transformerUsage + numTransformers, resourceusage());
+    long bytesCopied = !receivePort.empty() ? bytesReceived.load() : getFileSize(infileName);
+
     /* display time */
     if (showTime) { 
         
         #if defined(SHOW_EACH_THREAD_TIME) && defined(SHOW_OTHER_TIMES)
             /* display times for each thread */
-            for (int i = 0; i < numThreads; ++i) {
+            for (int i = 0; i < readerSlots; ++i) {
                 std::cout << "---READER THREAD " << i << "---" << std::endl;
                 std::cout << "busy wait time: " << readerTimes[i].busyWaitTime / NS_PER_MS << " ms" << std::endl;
                 std::cout << "lock time: " << readerTimes[i].lockTime / NS_PER_MS << " ms" << std::endl;
                 std::cout << "read time: " << readerTimes[i].processTime / NS_PER_MS << " ms" << std::endl;
-
+            }
+            for (int i = 0; i < writerSlots; ++i) {
                 std::cout << "---WRITER THREAD " << i << "---" << std::endl;
                 std::cout << "busy wait time: " << writerTimes[i].busyWaitTime / NS_PER_MS << " ms" << std::endl;
                 std::cout << "lock time: " << writerTimes[i].lockTime / NS_PER_MS << " ms" << std::endl;
@@ -456,20 +1496,40 @@ int main(int argc, char** argv) {
             }
         #endif
 
+        #ifdef SHOW_EACH_THREAD_TIME
+            /* display os accounting for each thread */
+            for (int i = 0; i < readerSlots; ++i) {
+                std::cout << "---READER THREAD " << i << " RESOURCES---" << std::endl;
+                std::cout << "voluntary context switches: " << readerUsage[i].voluntarySwitches << std::endl;
+                std::cout << "involuntary context switches: " << readerUsage[i].involuntarySwitches << std::endl;
+                std::cout << "minor faults: " << readerUsage[i].minorFaults << std::endl;
+                std::cout << "major faults: " << readerUsage[i].majorFaults << std::endl;
+                std::cout << "cpu time: " << readerUsage[i].cpuTime / NS_PER_MS << " ms" << std::endl;
+            }
+            for (int i = 0; i < writerSlots; ++i) {
+                std::cout << "---WRITER THREAD " << i << " RESOURCES---" << std::endl;
+                std::cout << "voluntary context switches: " << writerUsage[i].voluntarySwitches << std::endl;
+                std::cout << "involuntary context switches: " << writerUsage[i].involuntarySwitches << std::endl;
+                std::cout << "minor faults: " << writerUsage[i].minorFaults << std::endl;
+                std::cout << "major faults: " << writerUsage[i].majorFaults << std::endl;
+                std::cout << "cpu time: " << writerUsage[i].cpuTime / NS_PER_MS << " ms" << std::endl;
+            }
+        #endif
+
         #ifdef SHOW_OTHER_TIMES
         /* calculate the total times */
-        long totalReadBusyWaitTime = std::accumulate(readerTimes, readerTimes + numThreads, 0L, 
+        long totalReadBusyWaitTime = std::accumulate(readerTimes, readerTimes + readerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.busyWaitTime; });
-        long totalReadLockTime = std::accumulate(readerTimes, readerTimes + numThreads, 0L, 
+        long totalReadLockTime = std::accumulate(readerTimes, readerTimes + readerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.lockTime; });
-        long totalReadTime = std::accumulate(readerTimes, readerTimes + numThreads, 0L, 
+        long totalReadTime = std::accumulate(readerTimes, readerTimes + readerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.processTime; });
 
-        long totalWriteBusyWaitTime = std::accumulate(writerTimes, writerTimes + numThreads, 0L, 
+        long totalWriteBusyWaitTime = std::accumulate(writerTimes, writerTimes + writerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.busyWaitTime; });
-        long totalWriteLockTime = std::accumulate(writerTimes, writerTimes + numThreads, 0L, 
+        long totalWriteLockTime = std::accumulate(writerTimes, writerTimes + writerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.lockTime; });
-        long totalWriteTime = std::accumulate(writerTimes, writerTimes + numThreads, 0L, 
+        long totalWriteTime = std::accumulate(writerTimes, writerTimes + writerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.processTime; });
 
         long totalBusyWaitTime = totalWriteBusyWaitTime + totalReadBusyWaitTime;
@@ -492,6 +1552,118 @@ int main(int argc, char** argv) {
         #ifdef SHOW_HIGHEST_QUEUE_SIZE
         std::cout << "HIGHEST QUEUE SIZE: " << highestQueueSize << std::endl;
         #endif
+        /* a receiver has no readers, queue or budget, just a writer per connection */
+        if (receivePort.empty()) {
+            std::cout << "MAX INFLIGHT BYTES: " << maxInflightBytes << std::endl;
+            std::cout << "HIGHEST INFLIGHT BYTES: " << highestInflightBytes << std::endl;
+            std::cout << "READ THROTTLED TIME TOTAL: " << throttledTime / NS_PER_MS << " ms" << std::endl;
+            std::cout << "READER THREADS: " << numReaders << " at start, " << targetReaders << " at end, " << readerSlots << " slots used" << std::endl;
+            std::cout << "WRITER THREADS: " << numWriters << " at start, " << targetWriters << " at end, " << writerSlots << " slots used" << std::endl;
+            std::cout << "READ BATCH: " << readBatch << " chunks" << std::endl;
+            std::cout << "WRITE BATCHES: " << writeBatches << std::endl;
+            if (writeBatches > 0) {
+                std::cout << "AVERAGE WRITE BATCH: " << (double) writtenChunks / writeBatches << " chunks" << std::endl;
+            }
+        } else {
+            std::cout << "RECEIVER THREADS: " << connections.size() << ", one per connection" << std::endl;
+            std::cout << "RECEIVED RUNS: " << receivedRuns;
+            if (receivedRuns > 0) {
+                std::cout << " (" << bytesReceived / receivedRuns << " bytes each on average)";
+            }
+            std::cout << std::endl;
+            /* splice isn't counted in the process syscalls below, so the receivers count their own */
+            std::cout << "SOCKET READS: " << socketReads;
+            if (socketReads > 0) {
+                std::cout << " (" << bytesReceived / socketReads << " bytes each on average)";
+            }
+            std::cout << std::endl;
+            std::cout << "SOCKET RECEIVE BUFFER: " << receiveBufferBytes << " bytes" << std::endl;
+            std::cout << "RECEIVER TIME TOTAL: " << receiveWaitTime / NS_PER_MS << " ms waiting on the sender, "
+                << receiveWriteTime / NS_PER_MS << " ms moving data into the outfile" << std::endl;
+        }
+        if (!sendHost.empty()) {
+            std::cout << "SENT: " << bytesSent << " bytes over " << connections.size() << " connections to " << sendHost << ":" << sendPort << std::endl;
+            if (zeroCopy) {
+                std::cout << "ZEROCOPY SENDS: " << zeroCopySends << " (" << zeroCopyCopied << " copied by the kernel anyway)" << std::endl;
+            }
+        }
+        if (!receivePort.empty()) {
+            std::cout << "RECEIVED: " << bytesReceived << " bytes over " << connections.size() << " connections on port " << receivePort
+                << " (" << splicedBytes << " spliced straight into the outfile)" << std::endl;
+        }
+        if (sparse) {
+            std::cout << "ZEROS ELIDED: " << elidedBytes << " bytes";
+            if (bytesCopied > 0) {
+                std::cout << " (" << elidedBytes * 100 / bytesCopied << "% of the copy left as holes)";
+            }
+            std::cout << std::endl;
+        }
+        if (receivePort.empty()) {
+            waitstats waits = writersWaiting.stats + takersWaiting.stats + readersWaiting.stats + writeTurns.stats;
+            std::cout << "WAIT STRATEGY: " << waitStrategyName(waitStrategy);
+            if (writersWaiting.current() != waitStrategy) {
+                std::cout << " (" << waitStrategyName(writersWaiting.current()) << " on a single cpu)";
+            }
+            std::cout << std::endl;
+            std::cout << "WAKEUPS: " << waits.wakeups << " (readers " << readersWaiting.stats.wakeups << ", writers "
+                << writersWaiting.stats.wakeups << ", takers " << takersWaiting.stats.wakeups << ", outfile turns " << writeTurns.stats.wakeups << ")" << std::endl;
+            if (linesRead > 0) {
+                std::cout << "WAKEUPS PER CHUNK: " << (double) waits.wakeups / linesRead << std::endl;
+            }
+            std::cout << "WAITS: " << waits.waits << " (" << waits.caughtSpinning << " caught spinning, "
+                << waits.caughtYielding << " caught yielding, " << waits.parked << " parked)" << std::endl;
+        }
+        if (transformStage != nullptr) {
+            std::cout << "TRANSFORM " << transformStage->name() << ": " << transformInBytes << " bytes in, " << transformOutBytes << " bytes out";
+            if (transformInBytes > 0 && transformOutBytes > 0) {
+                std::cout << " (ratio " << (double) transformInBytes / transformOutBytes << ")";
+            }
+            std::cout << " on " << numTransformers << " threads, " << transformBusyTime / NS_PER_MS << " ms busy" << std::endl;
+            /* each stage's throughput over the cpu time its threads were charged, the slowest one limits the copy */
+            if (totalReaderUsage.cpuTime > 0) {
+                std::cout << "READ STAGE THROUGHPUT: " << (bytesRead / BYTES_PER_MB) / (totalReaderUsage.cpuTime / NS_PER_SEC) << " MB/s of cpu" << std::endl;
+            }
+            if (totalTransformerUsage.cpuTime > 0) {
+                std::cout << "TRANSFORM STAGE THROUGHPUT: " << (transformInBytes / BYTES_PER_MB) / (totalTransformerUsage.cpuTime / NS_PER_SEC) << " MB/s of cpu" << std::endl;
+            }
+            if (totalWriterUsage.cpuTime > 0) {
+                std::cout << "WRITE STAGE THROUGHPUT: " << (bytesWritten / BYTES_PER_MB) / (totalWriterUsage.cpuTime / NS_PER_SEC) << " MB/s of cpu" << std::endl;
+            }
+        }
+        if (adaptive) {
+            std::cout << "===CONTROLLER DECISIONS===" << std::endl;
+            for (const std::string& entry : controllerLog) {
+                std::cout << entry << std::endl;
+            }
+        }
+
+        std::cout << "===RESOURCE STATS===" << std::endl;
+        if (receivePort.empty()) {
+            std::cout << "READER VOLUNTARY CONTEXT SWITCHES: " << totalReaderUsage.voluntarySwitches << std::endl;
+            std::cout << "READER INVOLUNTARY CONTEXT SWITCHES: " << totalReaderUsage.involuntarySwitches << std::endl;
+            std::cout << "READER MINOR FAULTS: " << totalReaderUsage.minorFaults << std::endl;
+            std::cout << "READER MAJOR FAULTS: " << totalReaderUsage.majorFaults << std::endl;
+            std::cout << "READER CPU TIME: " << totalReaderUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        }
+        std::cout << "WRITER VOLUNTARY CONTEXT SWITCHES: " << totalWriterUsage.voluntarySwitches << std::endl;
+        std::cout << "WRITER INVOLUNTARY CONTEXT SWITCHES: " << totalWriterUsage.involuntarySwitches << std::endl;
+        std::cout << "WRITER MINOR FAULTS: " << totalWriterUsage.minorFaults << std::endl;
+        std::cout << "WRITER MAJOR FAULTS: " << totalWriterUsage.majorFaults << std::endl;
+        std::cout << "WRITER CPU TIME: " << totalWriterUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        if (transformStage != nullptr) {
+            std::cout << "TRANSFORMER CPU TIME: " << totalTransformerUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        }
+        std::cout << "PROCESS CPU TIME: " << processUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "PROCESS READ CHARS: " << processIO.readChars << std::endl;
+        std::cout << "PROCESS WRITE CHARS: " << processIO.writeChars << std::endl;
+        std::cout << "PROCESS STORAGE READ BYTES: " << processIO.readBytes << std::endl;
+        std::cout << "PROCESS STORAGE WRITE BYTES: " << processIO.writeBytes << std::endl;
+        std::cout << "PROCESS READ SYSCALLS: " << processIO.readCalls << std::endl;
+        std::cout << "PROCESS WRITE SYSCALLS: " << processIO.writeCalls << std::endl;
+        if (bytesCopied > 0) {
+            std::cout << "CPU SECONDS PER GB: " << (processUsage.cpuTime / NS_PER_SEC) / (bytesCopied / BYTES_PER_GB) << std::endl;
+            std::cout << "SYSCALLS PER GB: " << (processIO.readCalls + processIO.writeCalls) / (bytesCopied / BYTES_PER_GB) << std::endl;
+        }
     }
 
     #ifdef SHOW_OTHER_TIMES
@@ -499,6 +1671,10 @@ int main(int argc, char** argv) {
     delete[] writerTimes;
     delete[] readerTimes;
     #endif
+    delete[] writerUsage;
+    delete[] readerUsage;
+    delete[] transformerUsage;
+    delete transformStage;
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,217 @@
+#ifndef TCPTRANSPORT_H
+#define TCPTRANSPORT_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/errqueue.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* prefix of an infile (tcp:<port>) or outfile (tcp:<host>:<port>) that's a connection instead of a file */
+#define TCP_PREFIX "tcp:"
+/* how many times the sender tries to connect, so the receiver can be started second */
+#define CONNECT_ATTEMPTS 50
+/* how long the sender waits between tries in ms */
+#define CONNECT_RETRY_MS 100
+/* zerocopy sends a connection can have waiting on the kernel before it stops to reap them */
+#define MAX_PENDING_ZEROCOPY 64
+
+/*
+* what goes in front of every run of chunks on a connection
+* a negative length ends the connection's stream, with offset being the size of the whole file
+*/
+struct chunkheader
+{
+    int64_t offset;
+    int64_t length;
+};
+
+/*
+* the sockets between an mtcopier sender and receiver
+* every connection starts with the number of connections, so the receiver knows how many to accept
+*/
+class tcptransport
+{
+    public:
+        /* a batch sent with MSG_ZEROCOPY, kept until the kernel says it's done with the memory */
+        class pendingsend
+        {
+            public:
+                uint32_t id;
+                std::vector<std::string> chunks;
+                pendingsend(uint32_t i, std::vector<std::string>&& c) : id(i), chunks(std::move(c)) {};
+        };
+
+        /* open count connections to host:port, retrying while nothing is listening yet */
+        static std::vector<int> connectTo(const std::string& host, const std::string& port, int count) {
+            struct addrinfo hints;
+            std::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            struct addrinfo* address;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &address) != 0) {
+                throw std::runtime_error("tcptransport: could not resolve " + host + ":" + port);
+            }
+
+            std::vector<int> sockets;
+            for (int i = 0; i < count; ++i) {
+                int sock = -1;
+                for (int attempt = 0; attempt < CONNECT_ATTEMPTS && sock == -1; ++attempt) {
+                    sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+                    if (sock != -1 && connect(sock, address->ai_addr, address->ai_addrlen) != 0) {
+                        close(sock);
+                        sock = -1;
+                        usleep(CONNECT_RETRY_MS * 1000);
+                    }
+                }
+                if (sock == -1) {
+                    freeaddrinfo(address);
+                    throw std::runtime_error("tcptransport: could not connect to " + host + ":" + port);
+                }
+                int64_t hello = count;
+                sendAll(sock, &hello, sizeof(hello));
+                sockets.push_back(sock);
+            }
+            freeaddrinfo(address);
+            return sockets;
+        }
+
+        /* wait on port for a sender and accept however many connections it opens */
+        static std::vector<int> acceptOn(const std::string& port) {
+            int listener = socket(AF_INET6, SOCK_STREAM, 0);
+            int on = 1;
+            int off = 0;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            /* take ipv4 connections on the same socket */
+            setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            struct sockaddr_in6 address;
+            std::memset(&address, 0, sizeof(address));
+            address.sin6_family = AF_INET6;
+            address.sin6_addr = in6addr_any;
+            address.sin6_port = htons(std::stoi(port));
+            if (listener == -1 || bind(listener, (struct sockaddr*) &address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+                throw std::runtime_error("tcptransport: could not listen on port " + port);
+            }
+
+            std::vector<int> sockets;
+            int64_t count = 1;
+            while ((int64_t) sockets.size() < count) {
+                int sock = accept(listener, nullptr, nullptr);
+                int64_t hello;
+                if (sock == -1 || !receiveAll(sock, &hello, sizeof(hello)) || hello < 1) {
+                    throw std::runtime_error("tcptransport: bad connection on port " + port);
+                }
+                count = hello;
+                sockets.push_back(sock);
+            }
+            close(listener);
+            return sockets;
+        }
+
+        /* send all of iov, picking up where a partial send left off, returns how many sendmsg calls it took */
+        static uint32_t sendAll(int sock, std::vector<struct iovec>& iov, int flags) {
+            uint32_t calls = 0;
+            size_t first = 0;
+            while (first < iov.size()) {
+                struct msghdr message;
+                std::memset(&message, 0, sizeof(message));
+                message.msg_iov = iov.data() + first;
+                message.msg_iovlen = iov.size() - first;
+                ssize_t sent = sendmsg(sock, &message, flags);
+                if (sent < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error("tcptransport: connection lost while sending");
+                }
+                ++calls;
+                while (first < iov.size() && (size_t) sent >= iov[first].iov_len) {
+                    sent -= iov[first].iov_len;
+                    ++first;
+                }
+                if (first < iov.size()) {
+                    iov[first].iov_base = (char*) iov[first].iov_base + sent;
+                    iov[first].iov_len -= sent;
+                }
+            }
+            return calls;
+        }
+
+        static void sendAll(int sock, const void* data, size_t length) {
+            std::vector<struct iovec> iov(1);
+            iov[0].iov_base = (void*) data;
+            iov[0].iov_len = length;
+            sendAll(sock, iov, 0);
+        }
+
+        /* receive exactly length bytes, false if the connection ends first */
+        static bool receiveAll(int sock, void* data, size_t length) {
+            size_t got = 0;
+            while (got < length) {
+                ssize_t n = recv(sock, (char*) data + got, length - got, MSG_WAITALL);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                got += n;
+            }
+            return true;
+        }
+
+        /* ask for MSG_ZEROCOPY on a socket, false if the kernel doesn't do it */
+        static bool enableZeroCopy(int sock) {
+            int on = 1;
+            return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+        }
+
+        /*
+        * free the zerocopy batches the kernel has finished sending, waiting for all of them if block
+        * returns how many sends the kernel ended up copying anyway (loopback always does)
+        */
+        static long reapZeroCopy(int sock, std::deque<pendingsend>& pending, bool block) {
+            long copied = 0;
+            while (!pending.empty()) {
+                char control[128];
+                struct msghdr message;
+                std::memset(&message, 0, sizeof(message));
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+                if (recvmsg(sock, &message, MSG_ERRQUEUE) == -1) {
+                    if ((errno != EAGAIN && errno != EWOULDBLOCK) || !block) {
+                        break;
+                    }
+                    /* completions show up as an error on the socket */
+                    struct pollfd waitFor = {sock, 0, 0};
+                    poll(&waitFor, 1, -1);
+                    continue;
+                }
+                for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                    struct sock_extended_err* error = (struct sock_extended_err*) CMSG_DATA(cmsg);
+                    if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                        continue;
+                    }
+                    /* sends ee_info to ee_data are done, tcp reports them in order */
+                    if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                        copied += error->ee_data - error->ee_info + 1;
+                    }
+                    while (!pending.empty() && pending.front().id <= error->ee_data) {
+                        pending.pop_front();
+                    }
+                }
+            }
+            return copied;
+        }
+};
+
+#endif
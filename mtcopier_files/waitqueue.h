@@ -0,0 +1,232 @@
+#ifndef WAITQUEUE_H
+#define WAITQUEUE_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* most pauses a waiter spins for before yielding */
+#define MAX_SPIN_PAUSES 4096
+/* fewest an adaptive waiter spins for, so it can find out spinning has started paying again */
+#define MIN_SPIN_PAUSES 64
+/* times a waiter yields its cpu before parking */
+#define YIELD_ROUNDS 4
+
+/*
+* how a thread waits for its turn
+* broadcast parks and wakes every waiter on any change, which is what the condition variables did,
+* park wakes only the waiters that can go and parks them on a futex straight away,
+* spin pauses on the cpu for a while, then yields, then parks,
+* adaptive is spin with each queue's spin shortened when it ends up parking and lengthened when spinning catches the wakeup,
+* and just parks on a single cpu, where the thread it's waiting on can't run while it spins
+*/
+enum class waitstrategy { broadcast, park, spin, adaptive };
+
+inline waitstrategy waitStrategyNamed(const std::string& name) {
+    if (name == "broadcast") {
+        return waitstrategy::broadcast;
+    }
+    if (name == "park") {
+        return waitstrategy::park;
+    }
+    if (name == "spin") {
+        return waitstrategy::spin;
+    }
+    if (name == "adaptive") {
+        return waitstrategy::adaptive;
+    }
+    throw std::runtime_error("waitqueue: unknown wait strategy " + name + ", it can be broadcast, park, spin or adaptive");
+}
+
+inline const char* waitStrategyName(waitstrategy strategy) {
+    switch (strategy) {
+        case waitstrategy::broadcast: return "broadcast";
+        case waitstrategy::park: return "park";
+        case waitstrategy::spin: return "spin";
+        default: return "adaptive";
+    }
+}
+
+/* what a queue's waiters went through, summed over the run */
+class waitstats
+{
+    public:
+        long waits;
+        long wakeups;
+        long caughtSpinning;
+        long caughtYielding;
+        long parked;
+        waitstats(): waits(0), wakeups(0), caughtSpinning(0), caughtYielding(0), parked(0) {};
+
+        waitstats operator+(const waitstats& other) const {
+            waitstats sum;
+            sum.waits = waits + other.waits;
+            sum.wakeups = wakeups + other.wakeups;
+            sum.caughtSpinning = caughtSpinning + other.caughtSpinning;
+            sum.caughtYielding = caughtYielding + other.caughtYielding;
+            sum.parked = parked + other.parked;
+            return sum;
+        }
+};
+
+/*
+* a replacement for a condition variable that knows what each waiter is waiting for
+* waiters register with a key (the chunk they need, say) under the caller's mutex,
+* so a change can wake just the waiter with that key, or the lowest few, instead of all of them,
+* every call has to be made with the mutex held, like pthread_cond_wait and a signal under the lock
+*/
+class waitqueue
+{
+    public:
+        waitqueue() : strategy(waitstrategy::park), spinLimit(MAX_SPIN_PAUSES) {};
+
+        void setStrategy(waitstrategy s) {
+            strategy = s;
+            spinLimit = MAX_SPIN_PAUSES;
+            if (strategy == waitstrategy::adaptive && sysconf(_SC_NPROCESSORS_ONLN) <= 1) {
+                strategy = waitstrategy::park;
+            }
+        }
+
+        /* give up the mutex until notified, then take it back, the caller checks its condition again */
+        void wait(pthread_mutex_t* mutex, long key = 0) {
+            waiter self(key);
+            waiters.insert(std::upper_bound(waiters.begin(), waiters.end(), &self,
+                [](const waiter* a, const waiter* b) { return a->key < b->key; }), &self);
+            ++stats.waits;
+            long spins = strategy == waitstrategy::adaptive ? spinLimit.load(std::memory_order_relaxed)
+                : strategy == waitstrategy::spin ? MAX_SPIN_PAUSES : 0;
+            pthread_mutex_unlock(mutex);
+
+            int caught = pause(self, spins);
+            if (caught == CAUGHT_NOTHING && strategy != waitstrategy::broadcast && strategy != waitstrategy::park) {
+                for (int i = 0; i < YIELD_ROUNDS && self.signalled.load() == 0; ++i) {
+                    sched_yield();
+                }
+                caught = self.signalled.load() != 0 ? CAUGHT_YIELDING : CAUGHT_NOTHING;
+            }
+            if (caught == CAUGHT_NOTHING) {
+                self.parked.store(1);
+                while (self.signalled.load() == 0) {
+                    syscall(SYS_futex, (uint32_t*) &self.signalled, FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr, 0);
+                }
+            }
+
+            /* spin longer next time if spinning caught the wakeup, shorter if it had to park */
+            if (strategy == waitstrategy::adaptive && caught != CAUGHT_YIELDING) {
+                long limit = spinLimit.load(std::memory_order_relaxed);
+                spinLimit.store(caught == CAUGHT_SPINNING ? std::min(limit * 2, (long) MAX_SPIN_PAUSES)
+                    : std::max(limit / 2, (long) MIN_SPIN_PAUSES), std::memory_order_relaxed);
+            }
+
+            pthread_mutex_lock(mutex);
+            if (caught == CAUGHT_SPINNING) {
+                ++stats.caughtSpinning;
+            } else if (caught == CAUGHT_YIELDING) {
+                ++stats.caughtYielding;
+            } else {
+                ++stats.parked;
+            }
+        }
+
+        /* wake the waiters waiting on key */
+        void notifyKey(long key) {
+            if (strategy == waitstrategy::broadcast) {
+                notifyAll();
+                return;
+            }
+            for (auto it = waiters.begin(); it != waiters.end() && (*it)->key <= key;) {
+                if ((*it)->key == key) {
+                    wake(*it);
+                    it = waiters.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        /* wake up to count waiters, lowest key first */
+        void notify(long count = 1) {
+            if (strategy == waitstrategy::broadcast) {
+                notifyAll();
+                return;
+            }
+            long n = std::min(count, (long) waiters.size());
+            for (long i = 0; i < n; ++i) {
+                wake(waiters[i]);
+            }
+            waiters.erase(waiters.begin(), waiters.begin() + n);
+        }
+
+        void notifyAll() {
+            for (waiter* w : waiters) {
+                wake(w);
+            }
+            waiters.clear();
+        }
+
+        /* the strategy in use, adaptive turns into park on a single cpu */
+        waitstrategy current() const {
+            return strategy;
+        }
+
+        waitstats stats;
+
+    private:
+        static const int CAUGHT_NOTHING = 0;
+        static const int CAUGHT_SPINNING = 1;
+        static const int CAUGHT_YIELDING = 2;
+
+        /* lives on the waiting thread's stack, which can't return before the notifier lets go of the mutex */
+        class waiter
+        {
+            public:
+                long key;
+                std::atomic<uint32_t> signalled;
+                std::atomic<uint32_t> parked;
+                waiter(long k) : key(k), signalled(0), parked(0) {};
+        };
+
+        waitstrategy strategy;
+        /* pauses the next adaptive waiter spins for */
+        std::atomic<long> spinLimit;
+        /* everyone waiting, sorted by key */
+        std::vector<waiter*> waiters;
+
+        /*
+        * only go into the kernel for a waiter that has parked, both sides store then load
+        * so either the waiter sees the signal or the notifier sees it parked
+        */
+        void wake(waiter* w) {
+            ++stats.wakeups;
+            w->signalled.store(1);
+            if (w->parked.load() != 0) {
+                syscall(SYS_futex, (uint32_t*) &w->signalled, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            }
+        }
+
+        static int pause(waiter& self, long spins) {
+            for (long i = 0; i < spins; ++i) {
+                if (self.signalled.load(std::memory_order_acquire) != 0) {
+                    return CAUGHT_SPINNING;
+                }
+                #if defined(__x86_64__) || defined(__i386__)
+                _mm_pause();
+                #endif
+            }
+            return spins > 0 && self.signalled.load() != 0 ? CAUGHT_SPINNING : CAUGHT_NOTHING;
+        }
+};
+
+#endif
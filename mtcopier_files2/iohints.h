@@ -0,0 +1,140 @@
+#ifndef IOHINTS_H
+#define IOHINTS_H
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+/* how far ahead of the read cursor readahead is asked for, and how much gets written before write-behind kicks in */
+#define HINT_WINDOW 8388608L
+
+/* what the hints saw, kept so threads' results can be combined */
+class hintstats
+{
+    public:
+        /* most dirty page cache seen system wide in kB */
+        long highestDirtyKB;
+        /* time spent waiting for written windows to hit the disk before dropping them in ns */
+        long syncWaitTime;
+        hintstats(): highestDirtyKB(0), syncWaitTime(0) {};
+
+        /* dirty page cache system wide in kB from /proc/meminfo, -1 if it isn't there */
+        static long dirtyKB() {
+            std::ifstream file("/proc/meminfo");
+            std::string key;
+            long value;
+            std::string unit;
+            while (file >> key >> value >> unit) {
+                if (key == "Dirty:") {
+                    return value;
+                }
+            }
+            return -1;
+        }
+
+        hintstats operator+(const hintstats& other) const {
+            hintstats sum;
+            sum.highestDirtyKB = highestDirtyKB > other.highestDirtyKB ? highestDirtyKB : other.highestDirtyKB;
+            sum.syncWaitTime = syncWaitTime + other.syncWaitTime;
+            return sum;
+        }
+};
+
+/*
+* page cache hints for one copy over a range of the infile and outfile
+* reads get readahead asked for a window in front and the source dropped behind,
+* writes get writeback started each window and the window before that
+* waited on and dropped, so neither file's pages pile up in the cache
+* cursors only ever move forward, so it's fine to report them out of order
+*/
+class iohints
+{
+    public:
+        const int infile;
+        const int outfile;
+        hintstats stats;
+
+        iohints(int in, int out, long start, long length) :
+            infile(in), outfile(out), readHinted(start), readDropped(start),
+            writeStarted(start), writeDropped(start), end(start + length) {
+            pthread_mutex_init(&mutex, nullptr);
+            posix_fadvise(infile, start, length, POSIX_FADV_SEQUENTIAL);
+            hintRead(start);
+        };
+
+        ~iohints() {
+            pthread_mutex_destroy(&mutex);
+        };
+
+        /* the infile has been read up to cursor */
+        void afterRead(long cursor) {
+            pthread_mutex_lock(&mutex);
+            hintRead(cursor);
+            if (cursor - readDropped >= HINT_WINDOW) {
+                posix_fadvise(infile, readDropped, cursor - readDropped, POSIX_FADV_DONTNEED);
+                readDropped = cursor;
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+
+        /* the outfile has been written up to cursor */
+        void afterWrite(long cursor) {
+            pthread_mutex_lock(&mutex);
+            if (cursor - writeStarted >= HINT_WINDOW) {
+                sync_file_range(outfile, writeStarted, cursor - writeStarted, SYNC_FILE_RANGE_WRITE);
+                dropWritten(writeStarted);
+                writeStarted = cursor;
+
+                long dirty = hintstats::dirtyKB();
+                if (dirty > stats.highestDirtyKB) {
+                    stats.highestDirtyKB = dirty;
+                }
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+
+        /* the copy is done, drop whatever is left of both files */
+        void finish() {
+            pthread_mutex_lock(&mutex);
+            if (end > readDropped) {
+                posix_fadvise(infile, readDropped, end - readDropped, POSIX_FADV_DONTNEED);
+                readDropped = end;
+            }
+            dropWritten(end);
+            pthread_mutex_unlock(&mutex);
+        }
+
+    private:
+        long readHinted;
+        long readDropped;
+        long writeStarted;
+        long writeDropped;
+        const long end;
+        pthread_mutex_t mutex;
+
+        /* ask for the next window once the cursor is halfway through the last one */
+        void hintRead(long cursor) {
+            if (cursor + HINT_WINDOW / 2 >= readHinted && readHinted < end) {
+                posix_fadvise(infile, readHinted, HINT_WINDOW, POSIX_FADV_WILLNEED);
+                readHinted += HINT_WINDOW;
+            }
+        }
+
+        /* wait for everything written before upTo to be on disk then drop it */
+        void dropWritten(long upTo) {
+            if (upTo <= writeDropped) {
+                return;
+            }
+            auto start = std::chrono::high_resolution_clock::now();
+            sync_file_range(outfile, writeDropped, upTo - writeDropped,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            stats.syncWaitTime += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+            posix_fadvise(outfile, writeDropped, upTo - writeDropped, POSIX_FADV_DONTNEED);
+            writeDropped = upTo;
+        }
+};
+
+#endif
@@ -9,17 +9,27 @@ to do I/O operations with files
 #include <chrono>
 #include <functional>
 #include <sstream>
-#include <deque>
+#include <map>
 #include <fstream>
 #include <vector>
 #include <numeric>
 #include <iterator>
+#include <atomic>
+#include <algorithm>
+#include <string>
 #include <fcntl.h> 
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <climits>
 
 #include "threadtimes.h"
+#include "resourceusage.h"
+#include "iohints.h"
+#include "durablefile.h"
+#include "placement.h"
+#include "waitqueue.h"
 
 /*----CONSTANTS----*/
 /* cmd args position for number of threads*/
@@ -28,22 +38,40 @@ to do I/O operations with files
 #define INFILE_INDX 2
 /* cmd args position for outfile */
 #define OUTFILE_INDX 3
-/* cmd args position for timer flag*/
-#define TIMER_INDEX 4
+/* cmd args position where the optional flags start */
+#define OPTIONS_INDX 4
 /* min number of cmd args */
 #define MIN_NUM_ARGS 4
-/* max number of cmd args*/
-#define MAX_NUM_ARGS 5
 /* num bytes read at a time */
 #define READ_CHUNK 32768
+/* default number of chunks a reader fills per readv/preadv */
+#define DEFAULT_READ_BATCH 8
 /* value for successful thread create or join*/
 #define THREAD_SUCCESS 0
 /* max size for the queue */
 #define QUEUE_MAX_SIZE 1024
+/* default number of bytes allowed between the readers and writers */
+#define DEFAULT_MAX_INFLIGHT (QUEUE_MAX_SIZE * (long) READ_CHUNK)
+/* most threads the adaptive controller can grow either pool to */
+#define MAX_POOL_THREADS 64
+/* how often the adaptive controller samples the pipeline */
+#define CONTROLLER_INTERVAL_MS 50
+/* inflight occupancy (percent of the budget) above which the writers are falling behind */
+#define HIGH_OCCUPANCY_PERCENT 75
+/* inflight occupancy (percent of the budget) below which the readers are falling behind */
+#define LOW_OCCUPANCY_PERCENT 25
+/* throughput drop (percent) after a change that makes the controller undo it */
+#define THROUGHPUT_DROP_PERCENT 10
+/* convert ms to micro seconds */
+#define US_PER_MS 1000
 /* file open error*/
 #define FILE_OPEN_ERR -1
 /* convert nano seconds to ms*/
 #define NS_PER_MS 1000000
+/* convert nano seconds to s*/
+#define NS_PER_SEC 1000000000.0
+/* bytes in a GB */
+#define BYTES_PER_GB 1000000000.0
 
 /* whether to show the time for each thread */
 //#define SHOW_EACH_THREAD_TIME
@@ -57,8 +85,58 @@ to do I/O operations with files
 int infile;
 /* the ouput file*/
 int outfile;
-/* the queue to hold the file chunks */
-std::deque<std::string> queue;
+/* the queue to hold the file chunks, keyed (and so ordered) by their offset in the file */
+std::map<long, std::string> queue;
+/* number of chunks a reader fills per readv/preadv */
+int readBatch = DEFAULT_READ_BATCH;
+/* number of writev/pwritev batches written and the chunks in them */
+long writeBatches = 0;
+long writtenChunks = 0;
+/* offset of the next chunk the sequential readers will read */
+long readOffset = 0;
+/* whether readers claim chunks with pread instead of sharing the infile position */
+bool positionalReads = false;
+/* size of the infile, used by the positional readers to know when to stop */
+long infileSize = 0;
+/* offset of the next chunk a positional reader will claim */
+std::atomic<long> nextReadOffset(0);
+/* number of reader threads that haven't finished yet */
+int activeReaders = 0;
+
+/* number of reader and writer threads to start with */
+int numReaders = 0;
+int numWriters = 0;
+/* whether the adaptive controller resizes the pools while copying */
+bool adaptive = false;
+/* how many readers and writers should be running, a worker in a slot at or above this retires */
+std::atomic<int> targetReaders(0);
+std::atomic<int> targetWriters(0);
+/* the pool threads, one slot per thread the pool can hold */
+std::vector<pthread_t> readers;
+std::vector<pthread_t> writers;
+/* whether a slot has ever had a thread started in it (so it needs joining) */
+std::vector<bool> readerStarted;
+std::vector<bool> writerStarted;
+/* whether the thread in a slot hasn't exited yet */
+std::vector<bool> readerRunning;
+std::vector<bool> writerRunning;
+/* number of slots used so far */
+int readerSlots = 0;
+int writerSlots = 0;
+/* bytes that have made it to the outfile */
+long bytesWritten = 0;
+/* whether to give the kernel readahead and write-behind hints */
+bool useHints = false;
+/* the hints for this copy, null when they're off */
+iohints* hints = nullptr;
+/* what the hints saw */
+hintstats copyHints;
+/* whether to copy into a temp file and only rename it into place once it's on disk */
+bool durable = false;
+/* which cpus the reader and writer threads run on */
+placement threadPlacement;
+/* the decisions the adaptive controller made */
+std::vector<std::string> controllerLog;
 /* whether the reader threads are still reading */
 bool reading = true;
 /* wether the writer threads are still writing */
@@ -69,19 +147,35 @@ pthread_mutex_t queueMutex;
 pthread_mutex_t infileMutex;
 /* mutex for outfile */
 pthread_mutex_t outfileMutex;
-/* conditional to check if queue has elements*/
-pthread_cond_t queueFullCond;
-/* conditional to check if the queue has space*/
-pthread_cond_t queueEmptyCond;
+/* writers waiting for a chunk to be queued */
+waitqueue writersWaiting;
+/* readers waiting for room in the inflight budget, keyed by the offset of their batch */
+waitqueue readersWaiting;
+/* how the threads wait on those */
+waitstrategy waitStrategy = waitstrategy::adaptive;
 
 /* whether to show the time*/
 bool showTime = false;
 
+/* bytes read but not yet written (queued or held by a writer) */
+long inflightBytes = 0;
+/* max bytes allowed in flight before readers block */
+long maxInflightBytes = DEFAULT_MAX_INFLIGHT;
+/* highest number of bytes in flight achieved */
+long highestInflightBytes = 0;
+/* total time readers spent blocked on the inflight budget */
+long throttledTime = 0;
+
 #ifdef SHOW_HIGHEST_QUEUE_SIZE
 /* track the highest queue size achieved */
 unsigned int highestQueueSize = 0;
 #endif
 
+/* record what the os charged each reader thread */
+resourceusage* readerUsage;
+/* record what the os charged each writer thread */
+resourceusage* writerUsage;
+
 #ifdef SHOW_OTHER_TIMES
 /* record the times for reader threads */
 threadtimes* readerTimes;
@@ -98,19 +192,113 @@ std::chrono::nanoseconds timeFunction(const std::function<void()>& func) {
     return duration;
 }
 
+/* parse a byte count with an optional K, M or G suffix */
+long parseByteSize(const std::string& str) {
+    size_t end = 0;
+    long bytes = std::stol(str, &end);
+    if (end < str.size()) {
+        if (end + 1 != str.size()) {
+            throw std::invalid_argument(str);
+        }
+        switch (str[end]) {
+            case 'K': case 'k': bytes *= 1024L; break;
+            case 'M': case 'm': bytes *= 1024L * 1024L; break;
+            case 'G': case 'g': bytes *= 1024L * 1024L * 1024L; break;
+            default: throw std::invalid_argument(str);
+        }
+    }
+    return bytes;
+}
+
+/* function which is used to hopefully get a file's size */
+long getFileSize(const char* fileName) {
+    struct stat st;
+    if (stat(fileName, &st) == 0) {
+        return st.st_size;
+    }
+    return -1;
+}
+
+/* 
+* split a batch read into chunks and put them in the queue
+* an empty read still gets queued so the writers see the end of the file
+* queueMutex must be held
+*/
+void queueChunks(long offset, const char* data, long len)
+{
+    if (len == 0) {
+        queue.emplace(offset, std::string());
+    }
+    for (long b = 0; b < len; b += READ_CHUNK) {
+        queue.emplace(offset + b, std::string(data + b, std::min((long) READ_CHUNK, len - b)));
+    }
+
+    /* keep track of the bytes in flight */
+    inflightBytes += len;
+    if (inflightBytes > highestInflightBytes) {
+        highestInflightBytes = inflightBytes;
+    }
+
+    #ifdef SHOW_HIGHEST_QUEUE_SIZE
+    /* keep track of the highest queue size*/
+    if (queue.size() > highestQueueSize) {
+        highestQueueSize = queue.size();
+    }
+    #endif
+}
+
+/* 
+* write a batch of chunks that follow on from each other with as few syscalls as possible
+* goes to the given offset with positional reads, otherwise to the current file position
+*/
+void writeBatch(std::vector<std::string>& batch, std::vector<struct iovec>& iov, long offset)
+{
+    iov.resize(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        iov[i].iov_base = batch[i].data();
+        iov[i].iov_len = batch[i].length();
+    }
+
+    size_t first = 0;
+    while (first < iov.size()) {
+        ssize_t written = positionalReads
+            ? pwritev(outfile, &iov[first], iov.size() - first, offset)
+            : writev(outfile, &iov[first], iov.size() - first);
+        if (written <= 0) {
+            break;
+        }
+        offset += written;
+
+        /* skip what made it out, a short write can leave part of a chunk behind */
+        while (first < iov.size() && written >= (ssize_t) iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            ++first;
+        }
+        if (first < iov.size()) {
+            iov[first].iov_base = (char*) iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+}
+
 /* reader thread */
 void* reader(void* arg)
 {
-    /* buffer to read file chunks at a time */
-    char buffer[READ_CHUNK];
+    /* buffer to read a batch of file chunks at a time, with one iovec per chunk */
+    std::vector<char> buffer((long) READ_CHUNK * readBatch);
+    std::vector<struct iovec> iov(readBatch);
+    for (int i = 0; i < readBatch; ++i) {
+        iov[i].iov_base = buffer.data() + (long) i * READ_CHUNK;
+        iov[i].iov_len = READ_CHUNK;
+    }
 
     /* the parameters */
     int* params = (int*) arg;
 
-    #ifdef SHOW_OTHER_TIMES
     /* get the thread id */
     int index = *params;
 
+    #ifdef SHOW_OTHER_TIMES
     /* store the total times */
     long totalReadTime = 0;
     long totalReadLockWaitTime = 0;
@@ -118,6 +306,11 @@ void* reader(void* arg)
     #endif
 
     while (reading) {
+        /* retire if the controller has shrunk the pool below this slot */
+        if (index >= targetReaders) {
+            break;
+        }
+
         /* lock the infile mutex */
         #ifdef SHOW_OTHER_TIMES
         totalReadLockWaitTime += timeFunction([] {
@@ -130,18 +323,27 @@ void* reader(void* arg)
         /* get the number of bytes actually read */
         ssize_t len;
 
-        /* read the from the file */
+        /* read a batch of chunks from the file in one go */
         #ifdef SHOW_OTHER_TIMES
-        totalReadTime += timeFunction([&buffer, &len] {
+        totalReadTime += timeFunction([&iov, &len] {
         #endif
-            len = read(infile, buffer, READ_CHUNK);
+            len = readv(infile, iov.data(), readBatch);
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
+        /* a failed read ends the copy like the end of the file does */
+        if (len < 0) {
+            len = 0;
+        }
+
+        /* where the batch came from */
+        long offset = readOffset;
+        readOffset += len;
 
-        /* the string */
-        std::string item(buffer, len);
+        if (hints != nullptr) {
+            hints->afterRead(readOffset);
+        }
 
         /* lock the queue mutex */
         #ifdef SHOW_OTHER_TIMES
@@ -153,54 +355,208 @@ void* reader(void* arg)
         #endif
 
 
-        /* keep waiting until the queue has space */
+        /* keep waiting until there is budget for this batch, nothing in flight always takes one */
         #ifdef SHOW_OTHER_TIMES
-        totalReadBusyWaitTime += timeFunction([] {
+        totalReadBusyWaitTime += timeFunction([len, offset] {
         #endif
-            while (queue.size() >= QUEUE_MAX_SIZE && reading) {
-                pthread_cond_wait(&queueEmptyCond, &queueMutex);
+            if (inflightBytes > 0 && inflightBytes + len > maxInflightBytes && reading) {
+                throttledTime += timeFunction([len, offset] {
+                    while (inflightBytes > 0 && inflightBytes + len > maxInflightBytes && reading) {
+                        readersWaiting.wait(&queueMutex, offset);
+                    }
+                }).count();
             }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
-        /* push the file chunk to the queue */
+        /* push the file chunks to the queue */
         if (reading) {
-            /* push read chunk to queue */
-            queue.push_back(item);
-
-            #ifdef SHOW_HIGHEST_QUEUE_SIZE
-            /* keep track of the highest queue size*/
-            if (queue.size() > highestQueueSize) {
-                highestQueueSize = queue.size();
-            }
-            #endif
+            queueChunks(offset, buffer.data(), len);
 
             /* stop the loop when the end of file is reached*/
             if (len == 0) {
                 reading = false;
-                pthread_cond_broadcast(&queueEmptyCond);
+                readersWaiting.notifyAll();
+            }
+
+            /* a writer for the new chunks, and the next reader if there's room for another batch like this one */
+            writersWaiting.notify();
+            if (inflightBytes + len <= maxInflightBytes) {
+                readersWaiting.notify();
             }
         }
 
         /* unlock the queue mutex */
         pthread_mutex_unlock(&queueMutex);
 
-        /* broadcast that there is new element in the queue */
-        pthread_cond_broadcast(&queueFullCond);
-
         /* unlock the infile mutex */
         pthread_mutex_unlock(&infileMutex);
     }
 
     #ifdef SHOW_OTHER_TIMES
-    /* set the times */
-    readerTimes[index].lockTime = totalReadLockWaitTime;
-    readerTimes[index].busyWaitTime = totalReadBusyWaitTime;
-    readerTimes[index].processTime = totalReadTime;
+    /* set the times (a slot can be reused, so add to what's there) */
+    readerTimes[index].lockTime += totalReadLockWaitTime;
+    readerTimes[index].busyWaitTime += totalReadBusyWaitTime;
+    readerTimes[index].processTime += totalReadTime;
 
     #endif
 
+    /* record the os accounting for this thread before it exits */
+    readerUsage[index] = readerUsage[index] + resourceusage::ofThread();
+
+    /* let the controller know this slot is free */
+    pthread_mutex_lock(&queueMutex);
+    readerRunning[index] = false;
+    pthread_mutex_unlock(&queueMutex);
+
+    /* clean up */
+    delete params;
+
+    /* exit thread */
+    return nullptr; 
+}
+
+/*
+* positional reader thread
+* claims the next batch offset with a fetch-add and preadvs it,
+* so readers never wait on each other for the infile
+*/
+void* positionalReader(void* arg)
+{
+    /* buffer to read a batch of file chunks at a time, with one iovec per chunk, set up again for each batch */
+    std::vector<char> buffer((long) READ_CHUNK * readBatch);
+    std::vector<struct iovec> iov(readBatch);
+
+    /* the parameters */
+    int* params = (int*) arg;
+
+    /* get the thread id */
+    int index = *params;
+
+    #ifdef SHOW_OTHER_TIMES
+    /* store the total times */
+    long totalReadTime = 0;
+    long totalReadLockWaitTime = 0;
+    long totalReadBusyWaitTime = 0;
+    #endif
+
+    while (true) {
+        /* retire if the controller has shrunk the pool below this slot */
+        if (index >= targetReaders) {
+            break;
+        }
+
+        /* claim the next batch */
+        long offset = nextReadOffset.fetch_add((long) READ_CHUNK * readBatch);
+        if (offset >= infileSize) {
+            break;
+        }
+
+        /* get the number of bytes actually read */
+        ssize_t len = 0;
+
+        /* read the batch at its own offset, picking up where a short preadv left off until it's full or the file ends */
+        #ifdef SHOW_OTHER_TIMES
+        totalReadTime += timeFunction([&iov, &buffer, &len, offset] {
+        #endif
+            for (int i = 0; i < readBatch; ++i) {
+                iov[i].iov_base = buffer.data() + (long) i * READ_CHUNK;
+                iov[i].iov_len = READ_CHUNK;
+            }
+            int first = 0;
+            while (first < readBatch) {
+                ssize_t got = preadv(infile, &iov[first], readBatch - first, offset + len);
+                if (got <= 0) {
+                    break;
+                }
+                len += got;
+                while (first < readBatch && got >= (ssize_t) iov[first].iov_len) {
+                    got -= iov[first].iov_len;
+                    ++first;
+                }
+                if (first < readBatch) {
+                    iov[first].iov_base = (char*) iov[first].iov_base + got;
+                    iov[first].iov_len -= got;
+                }
+            }
+        #ifdef SHOW_OTHER_TIMES
+        }).count();
+        #endif
+
+        /* the file got shorter under us */
+        if (len <= 0) {
+            break;
+        }
+
+        if (hints != nullptr) {
+            hints->afterRead(offset + len);
+        }
+
+        /* lock the queue mutex */
+        #ifdef SHOW_OTHER_TIMES
+        totalReadLockWaitTime += timeFunction([] {
+        #endif
+            pthread_mutex_lock(&queueMutex);
+        #ifdef SHOW_OTHER_TIMES
+        }).count();
+        #endif
+
+        /* keep waiting until there is budget for this batch, nothing in flight always takes one */
+        #ifdef SHOW_OTHER_TIMES
+        totalReadBusyWaitTime += timeFunction([len, offset] {
+        #endif
+            if (inflightBytes > 0 && inflightBytes + len > maxInflightBytes) {
+                throttledTime += timeFunction([len, offset] {
+                    while (inflightBytes > 0 && inflightBytes + len > maxInflightBytes) {
+                        readersWaiting.wait(&queueMutex, offset);
+                    }
+                }).count();
+            }
+        #ifdef SHOW_OTHER_TIMES
+        }).count();
+        #endif
+
+        /* push the read chunks to the queue */
+        queueChunks(offset, buffer.data(), len);
+
+        /* a writer for the new chunks, and the next reader if there's room for another batch like this one */
+        writersWaiting.notify();
+        if (inflightBytes + len <= maxInflightBytes) {
+            readersWaiting.notify();
+        }
+
+        /* unlock the queue mutex */
+        pthread_mutex_unlock(&queueMutex);
+    }
+
+    #ifdef SHOW_OTHER_TIMES
+    /* set the times (a slot can be reused, so add to what's there) */
+    readerTimes[index].lockTime += totalReadLockWaitTime;
+    readerTimes[index].busyWaitTime += totalReadBusyWaitTime;
+    readerTimes[index].processTime += totalReadTime;
+
+    #endif
+
+    /* record the os accounting for this thread before it exits */
+    readerUsage[index] = readerUsage[index] + resourceusage::ofThread();
+
+    /* 
+    * let the controller know this slot is free
+    * and if this is the last reader out let the writers know nothing else is coming
+    */
+    pthread_mutex_lock(&queueMutex);
+    readerRunning[index] = false;
+    --activeReaders;
+    if (activeReaders == 0) {
+        reading = false;
+        if (queue.empty()) {
+            writing = false;
+        }
+        writersWaiting.notifyAll();
+    }
+    pthread_mutex_unlock(&queueMutex);
+
     /* clean up */
     delete params;
 
@@ -214,27 +570,44 @@ void* writer(void* arg)
     /* get the paremters */
     int* params = (int*) arg;
 
-    #ifdef SHOW_OTHER_TIMES
     /* get the thread id */
     int index = *params;
 
+    #ifdef SHOW_OTHER_TIMES
     /* store the total times */
     long totalWriteTime = 0;
     long totalLockTime = 0;
     long totalBusyWaitTime = 0;
     #endif
 
+    /* the chunks taken in one go and an iovec for each of them */
+    std::vector<std::string> batch;
+    std::vector<struct iovec> iov;
+
+    /* bytes of the chunks this writer is holding */
+    long heldBytes = 0;
+
     while (writing) {
-        std::string item;
+        /* where the batch goes in the file */
+        long offset = 0;
+        batch.clear();
 
-        #ifdef SHOW_OTHER_TIMES
-        totalLockTime += timeFunction([]{
-        #endif
-            /* lock the queue mutex */
-            pthread_mutex_lock(&outfileMutex);
-        #ifdef SHOW_OTHER_TIMES
-        }).count();
-        #endif
+        /* retire if the controller has shrunk the pool below this slot */
+        if (index >= targetWriters) {
+            break;
+        }
+
+        /* positional chunks get written at their own offset so they don't need the outfile lock */
+        if (!positionalReads) {
+            #ifdef SHOW_OTHER_TIMES
+            totalLockTime += timeFunction([]{
+            #endif
+                /* lock the outfile mutex */
+                pthread_mutex_lock(&outfileMutex);
+            #ifdef SHOW_OTHER_TIMES
+            }).count();
+            #endif
+        }
 
         #ifdef SHOW_OTHER_TIMES
         totalLockTime += timeFunction([]{
@@ -250,50 +623,85 @@ void* writer(void* arg)
         #endif
             /* keep waiting until theres an element in the queue */
             while (queue.empty() && writing) {
-                pthread_cond_wait(&queueFullCond, &queueMutex);
+                writersWaiting.wait(&queueMutex);
             }
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
-        /* get the front element of the queue */
+        /* take the first chunk and every chunk that carries on from it, up to IOV_MAX of them */
         if (writing) {
-            item = queue.front();
-            queue.pop_front();
+            auto it = queue.begin();
+            offset = it->first;
+            long end = offset;
+            while (it != queue.end() && it->first == end && (long) batch.size() < IOV_MAX) {
+                end += it->second.length();
+                batch.push_back(std::move(it->second));
+                it = queue.erase(it);
+            }
+            heldBytes = end - offset;
+            ++writeBatches;
+            writtenChunks += batch.size();
 
             /* stop the loop when both the queue is empty and all readers have stopped */
             if (queue.empty() && !reading) {
                 writing = false;
-                pthread_cond_broadcast(&queueFullCond);
+                writersWaiting.notifyAll();
+            }
+
+            /* a batch cut short or a run that didn't follow on leaves work for another writer */
+            if (!queue.empty()) {
+                writersWaiting.notify();
             }
         }
 
         /* unlock the queue mutex */
         pthread_mutex_unlock(&queueMutex);
 
-        /* broadcast that there is empty space in the queue */
-        pthread_cond_broadcast(&queueEmptyCond);
-
         #ifdef SHOW_OTHER_TIMES
-        totalWriteTime += timeFunction([&item]{
+        totalWriteTime += timeFunction([&batch, &iov, offset]{
         #endif
-            /* write the element to the file */
-            std::ignore = write(outfile, item.c_str(), item.length());
+            /* write the whole batch to the file */
+            writeBatch(batch, iov, offset);
         #ifdef SHOW_OTHER_TIMES
         }).count();
         #endif
 
+        if (hints != nullptr && heldBytes > 0) {
+            hints->afterWrite(offset + heldBytes);
+        }
+
         /* unlock the outfile mutex */
-        pthread_mutex_unlock(&outfileMutex);
+        if (!positionalReads) {
+            pthread_mutex_unlock(&outfileMutex);
+        }
+
+        /* the chunks are written so they are no longer in flight */
+        if (heldBytes > 0) {
+            pthread_mutex_lock(&queueMutex);
+            inflightBytes -= heldBytes;
+            bytesWritten += heldBytes;
+            readersWaiting.notify();
+            pthread_mutex_unlock(&queueMutex);
+            heldBytes = 0;
+        }
     }
 
     #ifdef SHOW_OTHER_TIMES
-    /* set the times for the writer threads */
-    writerTimes[index].busyWaitTime = totalBusyWaitTime;
-    writerTimes[index].lockTime = totalLockTime;
-    writerTimes[index].processTime = totalWriteTime;
+    /* set the times for the writer threads (a slot can be reused, so add to what's there) */
+    writerTimes[index].busyWaitTime += totalBusyWaitTime;
+    writerTimes[index].lockTime += totalLockTime;
+    writerTimes[index].processTime += totalWriteTime;
 
     #endif
+
+    /* record the os accounting for this thread before it exits */
+    writerUsage[index] = writerUsage[index] + resourceusage::ofThread();
+
+    /* let the controller know this slot is free */
+    pthread_mutex_lock(&queueMutex);
+    writerRunning[index] = false;
+    pthread_mutex_unlock(&queueMutex);
     
     /* cleanup */
     delete params;
@@ -302,27 +710,212 @@ void* writer(void* arg)
     return nullptr;
 }
 
+/* 
+* start a reader in the given slot
+* reaps the thread that retired from the slot first
+* queueMutex must be held once the copy is running
+*/
+void startReader(int slot)
+{
+    if (readerStarted[slot] && pthread_join(readers[slot], nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to join reader thread";
+        throw std::runtime_error(errMsg);
+    }
+    readerStarted[slot] = true;
+    readerRunning[slot] = true;
+    readerSlots = std::max(readerSlots, slot + 1);
+    ++activeReaders;
+
+    /* readers take the first cpus in the list */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (threadPlacement.active()) {
+        threadPlacement.apply(&attr, slot);
+    }
+
+    int* index = new int(slot);
+    if (pthread_create(&readers[slot], &attr, positionalReads ? &positionalReader : &reader, index) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to create reader thread";
+        throw std::runtime_error(errMsg);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* 
+* start a writer in the given slot
+* reaps the thread that retired from the slot first
+* queueMutex must be held once the copy is running
+*/
+void startWriter(int slot)
+{
+    if (writerStarted[slot] && pthread_join(writers[slot], nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to join writer thread";
+        throw std::runtime_error(errMsg);
+    }
+    writerStarted[slot] = true;
+    writerRunning[slot] = true;
+    writerSlots = std::max(writerSlots, slot + 1);
+
+    /* writers carry on through the cpu list after the readers */
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (threadPlacement.active()) {
+        threadPlacement.apply(&attr, numReaders + slot);
+    }
+
+    int* index = new int(slot);
+    if (pthread_create(&writers[slot], &attr, &writer, index) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to create writer thread";
+        throw std::runtime_error(errMsg);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* grow (by one) or shrink (by one) a pool, queueMutex must be held */
+void resizeReaders(int change)
+{
+    targetReaders += change;
+    /* a retiring thread might still be in the slot, in which case it just keeps going */
+    if (change > 0 && !readerRunning[targetReaders - 1]) {
+        startReader(targetReaders - 1);
+    }
+}
+
+void resizeWriters(int change)
+{
+    targetWriters += change;
+    /* a retiring thread might still be in the slot, in which case it just keeps going */
+    if (change > 0 && !writerRunning[targetWriters - 1]) {
+        startWriter(targetWriters - 1);
+    }
+}
+
+/* 
+* adaptive controller thread
+* samples the inflight occupancy and the write throughput and resizes the pools:
+* a full budget means writers are behind, an empty one means readers are behind,
+* and a change that made throughput drop gets undone
+*/
+void* controller(void* arg)
+{
+    /* the last change made and the throughput before it */
+    int lastReaderChange = 0;
+    int lastWriterChange = 0;
+    long throughputBeforeChange = 0;
+    long lastBytesWritten = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    while (true) {
+        usleep(CONTROLLER_INTERVAL_MS * US_PER_MS);
+
+        pthread_mutex_lock(&queueMutex);
+        if (!writing) {
+            pthread_mutex_unlock(&queueMutex);
+            break;
+        }
+
+        /* bring back slots whose thread retired just as the pool grew again */
+        for (int i = 0; i < targetReaders && reading; ++i) {
+            if (!readerRunning[i]) {
+                startReader(i);
+            }
+        }
+        for (int i = 0; i < targetWriters; ++i) {
+            if (!writerRunning[i]) {
+                startWriter(i);
+            }
+        }
+
+        /* sample the pipeline */
+        long occupancy = inflightBytes * 100 / maxInflightBytes;
+        long throughput = (bytesWritten - lastBytesWritten) / CONTROLLER_INTERVAL_MS;
+        lastBytesWritten = bytesWritten;
+        long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now() - start).count();
+
+        std::string decision;
+        if ((lastReaderChange != 0 || lastWriterChange != 0)
+            && throughput * 100 < throughputBeforeChange * (100 - THROUGHPUT_DROP_PERCENT)) {
+            /* the last change made things worse so undo it */
+            if (lastReaderChange != 0 && (lastReaderChange < 0 || reading)) {
+                resizeReaders(-lastReaderChange);
+            }
+            if (lastWriterChange != 0) {
+                resizeWriters(-lastWriterChange);
+            }
+            decision = "undo last change";
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+        } else if (reading && occupancy >= HIGH_OCCUPANCY_PERCENT) {
+            /* the writers can't keep up */
+            throughputBeforeChange = throughput;
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+            if (targetWriters < (int) writers.size()) {
+                resizeWriters(1);
+                lastWriterChange = 1;
+                decision = "add writer";
+            } else if (targetReaders > 1) {
+                resizeReaders(-1);
+                lastReaderChange = -1;
+                decision = "retire reader";
+            }
+        } else if (reading && occupancy <= LOW_OCCUPANCY_PERCENT) {
+            /* the readers can't keep up */
+            throughputBeforeChange = throughput;
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+            if (targetReaders < (int) readers.size()) {
+                resizeReaders(1);
+                lastReaderChange = 1;
+                decision = "add reader";
+            } else if (targetWriters > 1) {
+                resizeWriters(-1);
+                lastWriterChange = -1;
+                decision = "retire writer";
+            }
+        } else {
+            lastReaderChange = 0;
+            lastWriterChange = 0;
+        }
+
+        if (!decision.empty()) {
+            std::ostringstream entry;
+            entry << elapsed << " ms: " << decision << " (occupancy " << occupancy << "%, "
+                << throughput / 1000 << " MB/s) -> " << targetReaders << " readers, " << targetWriters << " writers";
+            controllerLog.push_back(entry.str());
+        }
+
+        pthread_mutex_unlock(&queueMutex);
+    }
+
+    return nullptr;
+}
+
 /* starting the copying threads */
-void startCopierThreads(int numThreads, const char* infileName, const char* outfileName)
+void startCopierThreads(const char* infileName, const char* outfileName)
 {  
-    queue.resize(QUEUE_MAX_SIZE);
-
     /* set reading flag to true */
     reading = true;
     writing = true;
+    readOffset = 0;
+    nextReadOffset = 0;
+    activeReaders = 0;
+    targetReaders = numReaders;
+    targetWriters = numWriters;
 
-    /* reader threads */
-    pthread_t readers[numThreads];
-    pthread_t writers[numThreads];
+    /* the adaptive controller */
+    pthread_t controllerThread;
 
     /* initialise mutexes */
     pthread_mutex_init(&queueMutex, nullptr);
     pthread_mutex_init(&infileMutex, nullptr);
     pthread_mutex_init(&outfileMutex, nullptr);
 
-    /* initialise conditionals */
-    pthread_cond_init(&queueFullCond, nullptr);
-    pthread_cond_init(&queueEmptyCond, nullptr);
+    /* set how the threads wait */
+    writersWaiting.setStrategy(waitStrategy);
+    readersWaiting.setStrategy(waitStrategy);
 
     /* open the infile */
     infile = open(infileName, O_RDONLY);
@@ -332,6 +925,15 @@ void startCopierThreads(int numThreads, const char* infileName, const char* outf
         throw std::runtime_error(errMsg);
     }
 
+    /* positional readers need to know where the file ends */
+    if (positionalReads) {
+        infileSize = getFileSize(infileName);
+        if (infileSize < 0) {
+            const std::string errMsg = "Positional reads need an infile with a known size";
+            throw std::runtime_error(errMsg);
+        }
+    }
+
     /* open the outfile */
     outfile = open(outfileName, O_WRONLY|O_CREAT|O_TRUNC, 0644);
     /* check if the outfile exists */
@@ -340,49 +942,76 @@ void startCopierThreads(int numThreads, const char* infileName, const char* outf
         throw std::runtime_error(errMsg);
     }
 
-    /* create reader and writer threads */
-    for (int i = 0; i < numThreads; ++i) {
-        int* index1 = new int(i);
-        if (pthread_create(&readers[i], nullptr, &reader, index1) != THREAD_SUCCESS) {
-            const std::string errMsg = "Failed to create reader thread";
-            throw std::runtime_error(errMsg);
-        }
-        int* index2 = new int(i);
-        if (pthread_create(&writers[i], nullptr, &writer, index2) != THREAD_SUCCESS) {
-            const std::string errMsg = "Failed to create writer thread";
-            throw std::runtime_error(errMsg);
-        }
+    if (useHints) {
+        hints = new iohints(infile, outfile, 0, std::max(getFileSize(infileName), 0L));
+    }
+
+    /* create reader and writer threads, holding the queue mutex so early exits can't race the setup */
+    pthread_mutex_lock(&queueMutex);
+    for (int i = 0; i < numReaders; ++i) {
+        startReader(i);
+    }
+    for (int i = 0; i < numWriters; ++i) {
+        startWriter(i);
+    }
+    pthread_mutex_unlock(&queueMutex);
+
+    /* start the controller */
+    if (adaptive && pthread_create(&controllerThread, nullptr, &controller, nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to create controller thread";
+        throw std::runtime_error(errMsg);
+    }
+
+    /* join the controller first so the pools stop changing */
+    if (adaptive && pthread_join(controllerThread, nullptr) != THREAD_SUCCESS) {
+        const std::string errMsg = "Failed to join controller thread";
+        throw std::runtime_error(errMsg);
     }
 
     /* join reader and writer threads */
-    for (int i = 0; i < numThreads; ++i) {
-        if (pthread_join(readers[i], nullptr) != THREAD_SUCCESS) {
+    for (int i = 0; i < (int) readers.size(); ++i) {
+        if (readerStarted[i] && pthread_join(readers[i], nullptr) != THREAD_SUCCESS) {
             const std::string errMsg = "Failed to join reader thread";
             throw std::runtime_error(errMsg);
         }
-        if (pthread_join(writers[i], nullptr) != THREAD_SUCCESS) {
+    }
+    for (int i = 0; i < (int) writers.size(); ++i) {
+        if (writerStarted[i] && pthread_join(writers[i], nullptr) != THREAD_SUCCESS) {
             const std::string errMsg = "Failed to join writer thread";
             throw std::runtime_error(errMsg);
         }
     }
 
+    if (hints != nullptr) {
+        hints->finish();
+        copyHints = hints->stats;
+        delete hints;
+        hints = nullptr;
+    }
+
     /* destroy mutexes */
     pthread_mutex_destroy(&queueMutex);
     pthread_mutex_destroy(&infileMutex);
     pthread_mutex_destroy(&outfileMutex);
-
-    /* destroy conditionals */
-    pthread_cond_destroy(&queueFullCond);
-    pthread_cond_destroy(&queueEmptyCond);
 }
 
 int main(int argc, char** argv) {
 
-    const std::string cmdErrorMessage = "main: the correct command is: ./better_mtcopier <#threads> <infile> <outfile> <optional -t>";
+    const std::string cmdErrorMessage = "main: the correct command is: ./mtcopier2 <#threads> <infile> <outfile> <optional -t> <optional --max-inflight <bytes>[K|M|G]> <optional --pread> <optional --readers <#threads>> <optional --writers <#threads>> <optional --auto> <optional --read-batch <#chunks>> <optional --hints> <optional --durable> <optional --cpus <list>|near> <optional --wait <broadcast|park|spin|adaptive>>";
     const std::string timerFlag = "-t";
+    const std::string maxInflightFlag = "--max-inflight";
+    const std::string positionalFlag = "--pread";
+    const std::string hintsFlag = "--hints";
+    const std::string durableFlag = "--durable";
+    const std::string cpusFlag = "--cpus";
+    const std::string readersFlag = "--readers";
+    const std::string writersFlag = "--writers";
+    const std::string adaptiveFlag = "--auto";
+    const std::string readBatchFlag = "--read-batch";
+    const std::string waitFlag = "--wait";
 
     /* check number of cmd args */
-    if (argc < MIN_NUM_ARGS || argc > MAX_NUM_ARGS) {
+    if (argc < MIN_NUM_ARGS) {
 
         throw std::runtime_error(cmdErrorMessage);
     }
@@ -402,38 +1031,119 @@ int main(int argc, char** argv) {
     if (numThreads < 1) {
         throw std::runtime_error("main: thread command argument cannot be below 1");
     }
+    numReaders = numThreads;
+    numWriters = numThreads;
 
-    /* check if the command has the timer flag*/
-    if (argc == MAX_NUM_ARGS) {
-        if (argv[TIMER_INDEX] == timerFlag) {
+    /* check the optional flags */
+    for (int i = OPTIONS_INDX; i < argc; ++i) {
+        if (argv[i] == timerFlag) {
             showTime = true;
+        } else if (argv[i] == maxInflightFlag && i + 1 < argc) {
+            try {
+                maxInflightBytes = parseByteSize(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid max inflight command argument format");
+            }
+            if (maxInflightBytes < 1) {
+                throw std::runtime_error("main: max inflight command argument cannot be below 1");
+            }
+        } else if (argv[i] == positionalFlag) {
+            positionalReads = true;
+        } else if (argv[i] == hintsFlag) {
+            useHints = true;
+        } else if (argv[i] == durableFlag) {
+            durable = true;
+        } else if (argv[i] == cpusFlag && i + 1 < argc) {
+            try {
+                threadPlacement = placement::fromArg(argv[++i], infileName);
+            }
+            catch(const std::invalid_argument& e) {
+                throw std::runtime_error("main: invalid cpus command argument format");
+            }
+        } else if ((argv[i] == readersFlag || argv[i] == writersFlag) && i + 1 < argc) {
+            int* count = argv[i] == readersFlag ? &numReaders : &numWriters;
+            try {
+                *count = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid thread command argument format");
+            }
+            if (*count < 1) {
+                throw std::runtime_error("main: thread command argument cannot be below 1");
+            }
+        } else if (argv[i] == adaptiveFlag) {
+            adaptive = true;
+        } else if (argv[i] == waitFlag && i + 1 < argc) {
+            waitStrategy = waitStrategyNamed(argv[++i]);
+        } else if (argv[i] == readBatchFlag && i + 1 < argc) {
+            try {
+                readBatch = std::stoi(argv[++i]);
+            }
+            catch(const std::exception& e) {
+                throw std::runtime_error("main: invalid read batch command argument format");
+            }
+            if (readBatch < 1 || readBatch > IOV_MAX) {
+                throw std::runtime_error("main: read batch command argument must be between 1 and IOV_MAX");
+            }
         } else {
             throw std::runtime_error(cmdErrorMessage);
         }
     }
 
+    /* size the pools, the controller can grow them up to MAX_POOL_THREADS */
+    int readerPoolSize = adaptive ? std::max(numReaders, MAX_POOL_THREADS) : numReaders;
+    int writerPoolSize = adaptive ? std::max(numWriters, MAX_POOL_THREADS) : numWriters;
+    readers.resize(readerPoolSize);
+    writers.resize(writerPoolSize);
+    readerStarted.resize(readerPoolSize, false);
+    writerStarted.resize(writerPoolSize, false);
+    readerRunning.resize(readerPoolSize, false);
+    writerRunning.resize(writerPoolSize, false);
+
     #ifdef SHOW_OTHER_TIMES
     /* set up the arrays to store the times for writer and reader threads */
-    readerTimes = new threadtimes[numThreads];
-    writerTimes = new threadtimes[numThreads];
+    readerTimes = new threadtimes[readerPoolSize];
+    writerTimes = new threadtimes[writerPoolSize];
     #endif
+    /* set up the arrays to store the os accounting for writer and reader threads */
+    readerUsage = new resourceusage[readerPoolSize];
+    writerUsage = new resourceusage[writerPoolSize];
+
+    /* durable copies go to a temp file which gets renamed over the outfile at the end */
+    durablefile* durableOut = durable ? new durablefile(outfileName, infileName) : nullptr;
+    const char* copyOutfileName = durable ? durableOut->tempName.c_str() : outfileName;
+
+    /* snapshot the process counters so only the copy gets counted */
+    resourceusage startProcessUsage = resourceusage::ofProcess();
+    processio startProcessIO = processio::current();
 
     /* start the threads */
-    long totalActualTime = timeFunction([numThreads, &infileName, &outfileName]{
-        startCopierThreads(numThreads, infileName, outfileName);
+    long totalActualTime = timeFunction([&infileName, copyOutfileName, durableOut]{
+        startCopierThreads(infileName, copyOutfileName);
+        if (durableOut != nullptr) {
+            durableOut->publish();
+        }
     }).count();
 
+    resourceusage processUsage = resourceusage::ofProcess() - startProcessUsage;
+    processio processIO = processio::current() - startProcessIO;
+    resourceusage totalReaderUsage = std::accumulate(readerUsage, readerUsage + readerSlots, resourceusage());
+    resourceusage totalWriterUsage = std::accumulate(writerUsage, writerUsage + writerSlots, resourceusage());
+    long bytesCopied = getFileSize(infileName);
+
     /* display time */
     if (showTime) { 
         
         #if defined(SHOW_EACH_THREAD_TIME) && defined(SHOW_OTHER_TIMES)
             /* display times for each thread */
-            for (int i = 0; i < numThreads; ++i) {
+            for (int i = 0; i < readerSlots; ++i) {
                 std::cout << "---READER THREAD " << i << "---" << std::endl;
                 std::cout << "busy wait time: " << readerTimes[i].busyWaitTime / NS_PER_MS << " ms" << std::endl;
                 std::cout << "lock time: " << readerTimes[i].lockTime / NS_PER_MS << " ms" << std::endl;
                 std::cout << "read time: " << readerTimes[i].processTime / NS_PER_MS << " ms" << std::endl;
-
+            }
+            for (int i = 0; i < writerSlots; ++i) {
                 std::cout << "---WRITER THREAD " << i << "---" << std::endl;
                 std::cout << "busy wait time: " << writerTimes[i].busyWaitTime / NS_PER_MS << " ms" << std::endl;
                 std::cout << "lock time: " << writerTimes[i].lockTime / NS_PER_MS << " ms" << std::endl;
@@ -441,20 +1151,40 @@ int main(int argc, char** argv) {
             }
         #endif
 
+        #ifdef SHOW_EACH_THREAD_TIME
+            /* display os accounting for each thread */
+            for (int i = 0; i < readerSlots; ++i) {
+                std::cout << "---READER THREAD " << i << " RESOURCES---" << std::endl;
+                std::cout << "voluntary context switches: " << readerUsage[i].voluntarySwitches << std::endl;
+                std::cout << "involuntary context switches: " << readerUsage[i].involuntarySwitches << std::endl;
+                std::cout << "minor faults: " << readerUsage[i].minorFaults << std::endl;
+                std::cout << "major faults: " << readerUsage[i].majorFaults << std::endl;
+                std::cout << "cpu time: " << readerUsage[i].cpuTime / NS_PER_MS << " ms" << std::endl;
+            }
+            for (int i = 0; i < writerSlots; ++i) {
+                std::cout << "---WRITER THREAD " << i << " RESOURCES---" << std::endl;
+                std::cout << "voluntary context switches: " << writerUsage[i].voluntarySwitches << std::endl;
+                std::cout << "involuntary context switches: " << writerUsage[i].involuntarySwitches << std::endl;
+                std::cout << "minor faults: " << writerUsage[i].minorFaults << std::endl;
+                std::cout << "major faults: " << writerUsage[i].majorFaults << std::endl;
+                std::cout << "cpu time: " << writerUsage[i].cpuTime / NS_PER_MS << " ms" << std::endl;
+            }
+        #endif
+
         #ifdef SHOW_OTHER_TIMES
         /* calculate the total times */
-        long totalReadBusyWaitTime = std::accumulate(readerTimes, readerTimes + numThreads, 0L, 
+        long totalReadBusyWaitTime = std::accumulate(readerTimes, readerTimes + readerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.busyWaitTime; });
-        long totalReadLockTime = std::accumulate(readerTimes, readerTimes + numThreads, 0L, 
+        long totalReadLockTime = std::accumulate(readerTimes, readerTimes + readerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.lockTime; });
-        long totalReadTime = std::accumulate(readerTimes, readerTimes + numThreads, 0L, 
+        long totalReadTime = std::accumulate(readerTimes, readerTimes + readerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.processTime; });
 
-        long totalWriteBusyWaitTime = std::accumulate(writerTimes, writerTimes + numThreads, 0L, 
+        long totalWriteBusyWaitTime = std::accumulate(writerTimes, writerTimes + writerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.busyWaitTime; });
-        long totalWriteLockTime = std::accumulate(writerTimes, writerTimes + numThreads, 0L, 
+        long totalWriteLockTime = std::accumulate(writerTimes, writerTimes + writerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.lockTime; });
-        long totalWriteTime = std::accumulate(writerTimes, writerTimes + numThreads, 0L, 
+        long totalWriteTime = std::accumulate(writerTimes, writerTimes + writerSlots, 0L, 
             [](long s, const threadtimes& t){ return s + t.processTime; });
 
         long totalBusyWaitTime = totalWriteBusyWaitTime + totalReadBusyWaitTime;
@@ -477,6 +1207,68 @@ int main(int argc, char** argv) {
         #ifdef SHOW_HIGHEST_QUEUE_SIZE
         std::cout << "HIGHEST QUEUE SIZE: " << highestQueueSize << std::endl;
         #endif
+        std::cout << "THREAD PLACEMENT: " << threadPlacement.description << std::endl;
+        std::cout << "READ MODE: " << (positionalReads ? "positional (pread)" : "sequential (shared offset)") << std::endl;
+        std::cout << "MAX INFLIGHT BYTES: " << maxInflightBytes << std::endl;
+        std::cout << "HIGHEST INFLIGHT BYTES: " << highestInflightBytes << std::endl;
+        std::cout << "READ THROTTLED TIME TOTAL: " << throttledTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "READER THREADS: " << numReaders << " at start, " << targetReaders << " at end, " << readerSlots << " slots used" << std::endl;
+        std::cout << "WRITER THREADS: " << numWriters << " at start, " << targetWriters << " at end, " << writerSlots << " slots used" << std::endl;
+        std::cout << "READ BATCH: " << readBatch << " chunks" << std::endl;
+        std::cout << "WRITE BATCHES: " << writeBatches << std::endl;
+        if (writeBatches > 0) {
+            std::cout << "AVERAGE WRITE BATCH: " << (double) writtenChunks / writeBatches << " chunks" << std::endl;
+        }
+        waitstats waits = writersWaiting.stats + readersWaiting.stats;
+        std::cout << "WAIT STRATEGY: " << waitStrategyName(waitStrategy);
+        if (writersWaiting.current() != waitStrategy) {
+            std::cout << " (" << waitStrategyName(writersWaiting.current()) << " on a single cpu)";
+        }
+        std::cout << std::endl;
+        std::cout << "WAKEUPS: " << waits.wakeups << " (readers " << readersWaiting.stats.wakeups << ", writers " << writersWaiting.stats.wakeups << ")" << std::endl;
+        if (writtenChunks > 0) {
+            std::cout << "WAKEUPS PER CHUNK: " << (double) waits.wakeups / writtenChunks << std::endl;
+        }
+        std::cout << "WAITS: " << waits.waits << " (" << waits.caughtSpinning << " caught spinning, "
+            << waits.caughtYielding << " caught yielding, " << waits.parked << " parked)" << std::endl;
+        if (adaptive) {
+            std::cout << "===CONTROLLER DECISIONS===" << std::endl;
+            for (const std::string& entry : controllerLog) {
+                std::cout << entry << std::endl;
+            }
+        }
+
+        std::cout << "===RESOURCE STATS===" << std::endl;
+        std::cout << "READER VOLUNTARY CONTEXT SWITCHES: " << totalReaderUsage.voluntarySwitches << std::endl;
+        std::cout << "READER INVOLUNTARY CONTEXT SWITCHES: " << totalReaderUsage.involuntarySwitches << std::endl;
+        std::cout << "READER MINOR FAULTS: " << totalReaderUsage.minorFaults << std::endl;
+        std::cout << "READER MAJOR FAULTS: " << totalReaderUsage.majorFaults << std::endl;
+        std::cout << "READER CPU TIME: " << totalReaderUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "WRITER VOLUNTARY CONTEXT SWITCHES: " << totalWriterUsage.voluntarySwitches << std::endl;
+        std::cout << "WRITER INVOLUNTARY CONTEXT SWITCHES: " << totalWriterUsage.involuntarySwitches << std::endl;
+        std::cout << "WRITER MINOR FAULTS: " << totalWriterUsage.minorFaults << std::endl;
+        std::cout << "WRITER MAJOR FAULTS: " << totalWriterUsage.majorFaults << std::endl;
+        std::cout << "WRITER CPU TIME: " << totalWriterUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "PROCESS CPU TIME: " << processUsage.cpuTime / NS_PER_MS << " ms" << std::endl;
+        std::cout << "PROCESS READ CHARS: " << processIO.readChars << std::endl;
+        std::cout << "PROCESS WRITE CHARS: " << processIO.writeChars << std::endl;
+        std::cout << "PROCESS STORAGE READ BYTES: " << processIO.readBytes << std::endl;
+        std::cout << "PROCESS STORAGE WRITE BYTES: " << processIO.writeBytes << std::endl;
+        if (useHints) {
+            std::cout << "DIRTY PAGE CACHE HIGH WATER: " << copyHints.highestDirtyKB << " kB" << std::endl;
+            std::cout << "WRITE-BEHIND SYNC WAIT: " << copyHints.syncWaitTime / NS_PER_MS << " ms" << std::endl;
+        }
+        std::cout << "PROCESS READ SYSCALLS: " << processIO.readCalls << std::endl;
+        std::cout << "PROCESS WRITE SYSCALLS: " << processIO.writeCalls << std::endl;
+        if (durable) {
+            std::cout << "===SYNC STATS===" << std::endl;
+            std::cout << "FINAL FDATASYNC: " << durableOut->fdatasyncTime / NS_PER_MS << " ms" << std::endl;
+            std::cout << "RENAME + DIRECTORY FSYNC: " << durableOut->publishTime / NS_PER_MS << " ms" << std::endl;
+        }
+        if (bytesCopied > 0) {
+            std::cout << "CPU SECONDS PER GB: " << (processUsage.cpuTime / NS_PER_SEC) / (bytesCopied / BYTES_PER_GB) << std::endl;
+            std::cout << "SYSCALLS PER GB: " << (processIO.readCalls + processIO.writeCalls) / (bytesCopied / BYTES_PER_GB) << std::endl;
+        }
     }
 
     #ifdef SHOW_OTHER_TIMES
@@ -484,6 +1276,9 @@ int main(int argc, char** argv) {
     delete[] writerTimes;
     delete[] readerTimes;
     #endif
+    delete[] writerUsage;
+    delete[] readerUsage;
+    delete durableOut;
 
     return EXIT_SUCCESS;
 }